@@ -85,6 +85,9 @@ static BlockDriverState *bdrv_open_inherit(const char *filename,
 /* If non-zero, use only whitelisted block drivers */
 static int use_bdrv_whitelist;
 
+/* Incremented whenever a child of any node is replaced */
+static unsigned int graph_generation;
+
 #ifdef _WIN32
 static int is_windows_drive_prefix(const char *filename)
 {
@@ -384,6 +387,7 @@ BlockDriverState *bdrv_new(void)
     notifier_with_return_list_init(&bs->before_write_notifiers);
     qemu_co_mutex_init(&bs->reqs_lock);
     qemu_mutex_init(&bs->dirty_bitmap_mutex);
+    qemu_mutex_init(&bs->bsc_lock);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -1367,6 +1371,9 @@ static void bdrv_child_cb_attach(BdrvChild *child)
 {
     BlockDriverState *bs = child->opaque;
 
+    /* Cached block status may point to the old child */
+    bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
+
     if (child->role & BDRV_CHILD_COW) {
         bdrv_backing_attach(child);
     }
@@ -1378,6 +1385,8 @@ static void bdrv_child_cb_detach(BdrvChild *child)
 {
     BlockDriverState *bs = child->opaque;
 
+    bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
+
     if (child->role & BDRV_CHILD_COW) {
         bdrv_backing_detach(child);
     }
@@ -2560,6 +2569,11 @@ uint64_t bdrv_qapi_perm_to_blk_perm(BlockPermission qapi_perm)
     return permissions[qapi_perm];
 }
 
+unsigned int bdrv_get_graph_generation(void)
+{
+    return qatomic_read(&graph_generation);
+}
+
 static void bdrv_replace_child_noperm(BdrvChild *child,
                                       BlockDriverState *new_bs)
 {
@@ -2596,6 +2610,7 @@ static void bdrv_replace_child_noperm(BdrvChild *child,
     }
 
     child->bs = new_bs;
+    qatomic_inc(&graph_generation);
 
     if (new_bs) {
         QLIST_INSERT_HEAD(&new_bs->parents, child, next_parent);
@@ -4713,6 +4728,8 @@ out:
 
 static void bdrv_delete(BlockDriverState *bs)
 {
+    int i;
+
     assert(bdrv_op_blocker_is_empty(bs));
     assert(!bs->refcnt);
 
@@ -4724,6 +4741,10 @@ static void bdrv_delete(BlockDriverState *bs)
 
     bdrv_close(bs);
 
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_log_clear(&bs->latency_log[i]);
+    }
+
     g_free(bs);
 }
 
@@ -4770,6 +4791,9 @@ int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     }
 
     memset(res, 0, sizeof(*res));
+    if (fix) {
+        bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
+    }
     return bs->drv->bdrv_co_check(bs, res, fix);
 }
 
@@ -5859,6 +5883,9 @@ int coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs, Error **errp)
      * of the image is tried.
      */
     if (bs->open_flags & BDRV_O_INACTIVE) {
+        /* Whoever owned the image before may have changed it */
+        bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
+
         bs->open_flags &= ~BDRV_O_INACTIVE;
         ret = bdrv_refresh_perms(bs, errp);
         if (ret < 0) {
@@ -6722,6 +6749,7 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                    bs->drv->format_name);
         return -ENOTSUP;
     }
+    bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
     return bs->drv->bdrv_amend_options(bs, opts, status_cb,
                                        cb_opaque, force, errp);
 }
@@ -7153,6 +7181,7 @@ int bdrv_make_empty(BdrvChild *c, Error **errp)
     }
 
     ret = drv->bdrv_make_empty(c->bs);
+    bdrv_bsc_invalidate_range(c->bs, 0, INT64_MAX);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to empty %s",
                          c->bs->filename);
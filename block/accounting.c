@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
@@ -50,9 +51,14 @@ void block_acct_setup(BlockAcctStats *stats, bool account_invalid,
 void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
+    int i;
+
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_log_clear(&stats->latency_log[i]);
+    }
     qemu_mutex_destroy(&stats->lock);
 }
 
@@ -182,6 +188,98 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
     }
 }
 
+static int block_latency_log_index(uint64_t latency_ns)
+{
+    int exp, group, sub;
+
+    if (latency_ns < (1ULL << BLOCK_LATENCY_LOG_MIN_BITS)) {
+        return 0;
+    }
+    if (latency_ns >= (1ULL << BLOCK_LATENCY_LOG_MAX_BITS)) {
+        return BLOCK_LATENCY_LOG_OVERFLOW;
+    }
+
+    /* Position of the most significant bit, and the bits just below it */
+    exp = 63 - clz64(latency_ns);
+    group = exp - BLOCK_LATENCY_LOG_MIN_BITS;
+    sub = (latency_ns >> (exp - BLOCK_LATENCY_LOG_SUB_BITS)) &
+          ((1 << BLOCK_LATENCY_LOG_SUB_BITS) - 1);
+
+    return 1 + (group << BLOCK_LATENCY_LOG_SUB_BITS) + sub;
+}
+
+/*
+ * Largest latency that is counted in the bucket at @index, or UINT64_MAX for
+ * the overflow bucket
+ */
+static uint64_t block_latency_log_bucket_max(int index)
+{
+    int group, shift;
+    uint64_t sub;
+
+    if (index == 0) {
+        return (1ULL << BLOCK_LATENCY_LOG_MIN_BITS) - 1;
+    }
+    if (index == BLOCK_LATENCY_LOG_OVERFLOW) {
+        return UINT64_MAX;
+    }
+
+    group = (index - 1) >> BLOCK_LATENCY_LOG_SUB_BITS;
+    shift = group + BLOCK_LATENCY_LOG_MIN_BITS - BLOCK_LATENCY_LOG_SUB_BITS;
+    sub = (index - 1) & ((1 << BLOCK_LATENCY_LOG_SUB_BITS) - 1);
+
+    return (((1 << BLOCK_LATENCY_LOG_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+void block_latency_log_account(BlockLatencyLogHistogram *hist,
+                               int64_t latency_ns)
+{
+    /* Most nodes never see requests of some type, don't waste memory */
+    if (!hist->buckets) {
+        hist->buckets = g_new0(uint64_t, BLOCK_LATENCY_LOG_BUCKETS);
+    }
+
+    hist->buckets[block_latency_log_index(MAX(latency_ns, 0))]++;
+    hist->count++;
+}
+
+void block_latency_log_clear(BlockLatencyLogHistogram *hist)
+{
+    g_free(hist->buckets);
+    memset(hist, 0, sizeof(*hist));
+}
+
+/*
+ * Return an upper bound for the @percentile-th percentile of the latencies
+ * counted in @hist, or 0 if nothing was counted.  If the percentile falls
+ * into the overflow bucket, no bound is known and UINT64_MAX is returned.
+ */
+uint64_t block_latency_log_percentile(const BlockLatencyLogHistogram *hist,
+                                      double percentile)
+{
+    double exact_rank = hist->count * percentile / 100;
+    uint64_t rank = exact_rank;
+    uint64_t seen = 0;
+    int i;
+
+    if (hist->count == 0) {
+        return 0;
+    }
+
+    /* Round up, the smallest rank being 1 */
+    if (rank < exact_rank || rank == 0) {
+        rank++;
+    }
+    for (i = 0; i < BLOCK_LATENCY_LOG_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            return block_latency_log_bucket_max(i);
+        }
+    }
+
+    return block_latency_log_bucket_max(BLOCK_LATENCY_LOG_OVERFLOW);
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
@@ -209,6 +307,8 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
         block_latency_histogram_account(&stats->latency_histogram[cookie->type],
                                         latency_ns);
+        block_latency_log_account(&stats->latency_log[cookie->type],
+                                  latency_ns);
 
         if (!failed || stats->account_failed) {
             stats->total_time_ns[cookie->type] += latency_ns;
@@ -338,6 +338,15 @@ static void backup_cancel(Job *job)
     bdrv_cancel_in_flight(s->target_bs);
 }
 
+static void backup_query(Job *job, JobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
+
+    info->has_copy_stats = true;
+    info->copy_stats = g_new(JobCopyStats, 1);
+    block_copy_get_stats(s->bcs, info->copy_stats);
+}
+
 static const BlockJobDriver backup_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(BackupBlockJob),
@@ -350,6 +359,7 @@ static const BlockJobDriver backup_job_driver = {
         .clean                  = backup_clean,
         .pause                  = backup_pause,
         .cancel                 = backup_cancel,
+        .query                  = backup_query,
     },
     .set_speed = backup_set_speed,
 };
@@ -551,6 +561,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
 
     block_copy_set_progress_meter(bcs, &job->common.job.progress);
     block_copy_set_speed(bcs, speed);
+    block_copy_set_adaptive(bcs, perf->adaptive);
 
     /* Required permissions are already taken by backup-top target */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
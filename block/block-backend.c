@@ -2410,23 +2410,123 @@ void blk_unregister_buf(BlockBackend *blk, void *host)
     bdrv_unregister_buf(blk_bs(blk), host);
 }
 
+/* To be called between exactly one pair of blk_inc/dec_in_flight() */
+static int coroutine_fn
+blk_do_copy_range_to(BdrvChild *src, int64_t src_offset, BlockBackend *blk,
+                     int64_t offset, int bytes, BdrvRequestFlags read_flags,
+                     BdrvRequestFlags write_flags)
+{
+    int ret;
+    BlockDriverState *bs;
+
+    blk_wait_while_drained(blk);
+
+    /* Call blk_bs() only after waiting, the graph may have changed */
+    bs = blk_bs(blk);
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_inc_in_flight(bs);
+
+    /* throttling disk I/O */
+    if (blk->public.throttle_group_member.throttle_state) {
+        throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
+                bytes, true);
+    }
+
+    ret = bdrv_co_copy_range(src, src_offset, blk->root, offset, bytes,
+                             read_flags, write_flags);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
+/*
+ * Like blk_co_copy_range(), but for callers that read from a node through
+ * their own BdrvChild, like block jobs do.  The request is accounted to
+ * @blk like a write.
+ */
+int coroutine_fn blk_co_copy_range_to(BdrvChild *src, int64_t src_offset,
+                                      BlockBackend *blk, int64_t offset,
+                                      int bytes, BdrvRequestFlags read_flags,
+                                      BdrvRequestFlags write_flags)
+{
+    int ret;
+
+    blk_inc_in_flight(blk);
+    ret = blk_do_copy_range_to(src, src_offset, blk, offset, bytes,
+                               read_flags, write_flags);
+    blk_dec_in_flight(blk);
+
+    return ret;
+}
+
 int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                                    BlockBackend *blk_out, int64_t off_out,
                                    int bytes, BdrvRequestFlags read_flags,
                                    BdrvRequestFlags write_flags)
 {
     int r;
+
+    blk_inc_in_flight(blk_in);
+    blk_wait_while_drained(blk_in);
+
     r = blk_check_byte_request(blk_in, off_in, bytes);
-    if (r) {
-        return r;
+    if (r == 0) {
+        r = blk_co_copy_range_to(blk_in->root, off_in, blk_out, off_out,
+                                 bytes, read_flags, write_flags);
     }
-    r = blk_check_byte_request(blk_out, off_out, bytes);
-    if (r) {
-        return r;
+
+    blk_dec_in_flight(blk_in);
+    return r;
+}
+
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 int64_t bytes, QIOChannelSocket *sioc,
+                                 const void *header, size_t header_len)
+{
+    BlockDriverState *bs;
+    int ret;
+
+    blk_inc_in_flight(blk);
+
+    /*
+     * Unlike other requests, don't wait for a drained section to end.  The
+     * caller typically holds a lock around the whole reply, which must not
+     * be held while waiting; a normal read, which the caller falls back to,
+     * waits without it.
+     */
+    if (blk->quiesce_counter && !blk->disable_request_queuing) {
+        ret = -ENOTSUP;
+        goto out;
+    }
+
+    bs = blk_bs(blk);
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /*
+     * Throttling accounts requests as they are issued; rather than teaching
+     * it about a request that may still fall back to a normal read, leave
+     * throttled backends on the normal path.
+     */
+    if (blk->public.throttle_group_member.throttle_state) {
+        ret = -ENOTSUP;
+        goto out;
     }
-    return bdrv_co_copy_range(blk_in->root, off_in,
-                              blk_out->root, off_out,
-                              bytes, read_flags, write_flags);
+
+    bdrv_inc_in_flight(bs);
+    ret = bdrv_co_sendfile(blk->root, offset, bytes, sioc,
+                           header, header_len);
+    bdrv_dec_in_flight(bs);
+
+out:
+    blk_dec_in_flight(blk);
+    return ret;
 }
 
 const BdrvChild *blk_root(BlockBackend *blk)
@@ -28,6 +28,12 @@
 #define BLOCK_COPY_MAX_WORKERS 64
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 
+/* Adaptive mode: upper bound for buffered requests, measurement period */
+#define BLOCK_COPY_MAX_ADAPT_BUFFER (16 * MiB)
+#define BLOCK_COPY_ADAPT_PERIOD 200000000LL /* ns */
+/* Throughput loss in percent after which a change is considered worse */
+#define BLOCK_COPY_ADAPT_TOLERANCE 5
+
 static coroutine_fn int block_copy_task_entry(AioTask *task);
 
 typedef struct BlockCopyCallState {
@@ -38,6 +44,9 @@ typedef struct BlockCopyCallState {
     int max_workers;
     int64_t max_chunk;
     bool ignore_ratelimit;
+    /* Started by block_copy_async(), only these calls are measured */
+    bool background;
+    bool adaptive;
     BlockCopyAsyncCallbackFunc cb;
     void *cb_opaque;
 
@@ -74,6 +83,46 @@ static int64_t task_end(BlockCopyTask *task)
     return task->offset + task->bytes;
 }
 
+typedef enum BlockCopyAdaptKnob {
+    BLOCK_COPY_ADAPT_NONE,
+    BLOCK_COPY_ADAPT_CHUNK,
+    BLOCK_COPY_ADAPT_WORKERS,
+} BlockCopyAdaptKnob;
+
+/*
+ * Throughput measurement and, in adaptive mode, the state of the search for
+ * the request length and number of workers that give the best throughput.
+ * See block_copy_adapt().
+ */
+typedef struct BlockCopyAdaptState {
+    /* Limits of the background copy call, chunk and workers within them */
+    int max_workers;
+    int64_t max_chunk;
+    int workers;
+    int64_t chunk;
+
+    /* Current measurement period */
+    int64_t period_start_ns;
+    uint64_t period_bytes;
+    uint64_t period_requests;
+    uint64_t period_latency_ns;
+
+    /* Knob changed at the start of the current period, its old values */
+    BlockCopyAdaptKnob knob;
+    int prev_workers;
+    int64_t prev_chunk;
+    bool shrink_workers;
+    bool shrink_chunk;
+    /* Throughput and latency the current period is compared to */
+    uint64_t reference;
+    uint64_t reference_latency_ns;
+
+    /* Results of the last period, and total number of requests */
+    uint64_t throughput;
+    uint64_t latency_ns;
+    uint64_t requests;
+} BlockCopyAdaptState;
+
 typedef struct BlockCopyState {
     /*
      * BdrvChild objects are not owned or managed by block-copy. They are
@@ -115,6 +164,9 @@ typedef struct BlockCopyState {
 
     uint64_t speed;
     RateLimit rate_limit;
+
+    bool adaptive;
+    BlockCopyAdaptState adapt;
 } BlockCopyState;
 
 static BlockCopyTask *find_conflicting_task(BlockCopyState *s,
@@ -149,6 +201,193 @@ static bool coroutine_fn block_copy_wait_one(BlockCopyState *s, int64_t offset,
     return true;
 }
 
+static uint32_t block_copy_max_transfer(BdrvChild *source, BdrvChild *target)
+{
+    return MIN_NON_ZERO(INT_MAX,
+                        MIN_NON_ZERO(source->bs->bl.max_transfer,
+                                     target->bs->bl.max_transfer));
+}
+
+/* Upper bound for the request length of the adaptive background copy */
+static int64_t block_copy_adapt_max_chunk(BlockCopyState *s)
+{
+    int64_t limit;
+
+    if ((s->write_flags & BDRV_REQ_WRITE_COMPRESSED) ||
+        block_copy_max_transfer(s->source, s->target) < s->cluster_size)
+    {
+        /* Same reasons as in block_copy_state_new() */
+        return s->cluster_size;
+    }
+
+    /*
+     * copy_size is the limit for copy_range. Buffered requests are split by
+     * the block layer according to max_transfer, but larger ones still save
+     * round trips through the dirty bitmap and the task list.
+     */
+    limit = s->use_copy_range ? s->copy_size :
+            MAX(s->cluster_size, BLOCK_COPY_MAX_ADAPT_BUFFER);
+    limit = MIN_NON_ZERO(limit, s->adapt.max_chunk);
+
+    if (s->speed) {
+        /* Don't exceed what the rate limit allows in one slice */
+        limit = MIN(limit, QEMU_ALIGN_DOWN(s->speed / (NANOSECONDS_PER_SECOND /
+                                                       BLOCK_COPY_SLICE_TIME),
+                                           s->cluster_size));
+    }
+
+    return MAX(limit, s->cluster_size);
+}
+
+static int64_t block_copy_chunk(BlockCopyState *s,
+                                BlockCopyCallState *call_state)
+{
+    if (call_state->adaptive) {
+        return MIN(s->adapt.chunk, block_copy_adapt_max_chunk(s));
+    }
+
+    return MIN_NON_ZERO(s->copy_size, call_state->max_chunk);
+}
+
+static int block_copy_workers(BlockCopyState *s,
+                              BlockCopyCallState *call_state)
+{
+    if (call_state->adaptive) {
+        return s->adapt.workers;
+    }
+
+    return call_state->max_workers;
+}
+
+/*
+ * Double or halve @val in the direction given by @shrink, turning around at
+ * the bounds.
+ */
+static int64_t block_copy_adapt_next(int64_t val, bool *shrink,
+                                     int64_t min, int64_t max)
+{
+    int64_t next = *shrink ? val / 2 : val * 2;
+
+    if (next < min || next > max) {
+        *shrink = !*shrink;
+        next = *shrink ? val / 2 : val * 2;
+    }
+
+    return MIN(MAX(next, min), max);
+}
+
+/*
+ * Whether the change of @knob made at the start of the period that just
+ * ended made things worse, given the results of that period in @a.
+ */
+static bool block_copy_adapt_worse(BlockCopyAdaptState *a,
+                                   BlockCopyAdaptKnob knob)
+{
+    uint64_t min = a->reference / 100 * (100 - BLOCK_COPY_ADAPT_TOLERANCE);
+    uint64_t max = a->reference / 100 * (100 + BLOCK_COPY_ADAPT_TOLERANCE);
+    uint64_t max_latency_ns = a->reference_latency_ns / 100 *
+                              (100 + BLOCK_COPY_ADAPT_TOLERANCE);
+
+    if (a->throughput < min) {
+        return true;
+    }
+
+    /*
+     * Additional workers that don't raise throughput only queue up in the
+     * source or target, which shows as longer requests of the same length.
+     * They slow down guest requests to the same devices, so drop them.
+     */
+    return knob == BLOCK_COPY_ADAPT_WORKERS &&
+           a->workers > a->prev_workers &&
+           a->throughput <= max && a->latency_ns > max_latency_ns;
+}
+
+/*
+ * Called at the end of every measurement period.  In adaptive mode, this
+ * is one step of a hill climbing search: alternately the request length
+ * and the number of workers are doubled or halved.  If throughput during
+ * the next period drops, or more workers only add latency, the change is
+ * reverted and the next change of the same knob goes the other way.  The
+ * search never stops, so that it follows the load of source and target.
+ */
+static void block_copy_adapt(BlockCopyState *s, int64_t now)
+{
+    BlockCopyAdaptState *a = &s->adapt;
+    int64_t elapsed_us = MAX((now - a->period_start_ns) / SCALE_US, 1);
+    uint64_t throughput = a->period_bytes * 1000000 / elapsed_us;
+    BlockCopyAdaptKnob knob = a->knob;
+
+    a->throughput = throughput;
+    a->latency_ns = a->period_latency_ns / a->period_requests;
+    a->period_start_ns = now;
+    a->period_bytes = 0;
+    a->period_requests = 0;
+    a->period_latency_ns = 0;
+
+    if (!s->adaptive) {
+        return;
+    }
+
+    a->knob = BLOCK_COPY_ADAPT_NONE;
+    if (knob != BLOCK_COPY_ADAPT_NONE && block_copy_adapt_worse(a, knob)) {
+        /*
+         * Revert, and don't change anything else before having measured the
+         * old setting again: the drop may also come from a change in load.
+         */
+        if (knob == BLOCK_COPY_ADAPT_CHUNK) {
+            a->chunk = a->prev_chunk;
+            a->shrink_chunk = !a->shrink_chunk;
+        } else {
+            a->workers = a->prev_workers;
+            a->shrink_workers = !a->shrink_workers;
+        }
+        goto out;
+    }
+
+    a->reference = throughput;
+    a->reference_latency_ns = a->latency_ns;
+
+    if (s->speed && throughput >= s->speed / 100 * 90) {
+        /* Limited by the configured speed, nothing to gain */
+        goto out;
+    }
+
+    a->prev_chunk = a->chunk;
+    a->prev_workers = a->workers;
+    if (knob == BLOCK_COPY_ADAPT_CHUNK) {
+        a->knob = BLOCK_COPY_ADAPT_WORKERS;
+        a->workers = block_copy_adapt_next(a->workers, &a->shrink_workers,
+                                           1, a->max_workers);
+    } else {
+        a->knob = BLOCK_COPY_ADAPT_CHUNK;
+        a->chunk = block_copy_adapt_next(MIN(a->chunk,
+                                             block_copy_adapt_max_chunk(s)),
+                                         &a->shrink_chunk, s->cluster_size,
+                                         block_copy_adapt_max_chunk(s));
+        a->chunk = QEMU_ALIGN_DOWN(a->chunk, s->cluster_size);
+    }
+
+out:
+    trace_block_copy_adapt(s, throughput, a->latency_ns, a->chunk,
+                           a->workers);
+}
+
+static void block_copy_account(BlockCopyState *s, int64_t bytes,
+                               int64_t start_ns)
+{
+    BlockCopyAdaptState *a = &s->adapt;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    a->period_bytes += bytes;
+    a->period_requests++;
+    a->period_latency_ns += now - start_ns;
+    a->requests++;
+
+    if (now - a->period_start_ns >= BLOCK_COPY_ADAPT_PERIOD) {
+        block_copy_adapt(s, now);
+    }
+}
+
 /*
  * Search for the first dirty area in offset/bytes range and create task at
  * the beginning of it.
@@ -158,7 +397,7 @@ static BlockCopyTask *block_copy_task_create(BlockCopyState *s,
                                              int64_t offset, int64_t bytes)
 {
     BlockCopyTask *task;
-    int64_t max_chunk = MIN_NON_ZERO(s->copy_size, call_state->max_chunk);
+    int64_t max_chunk = block_copy_chunk(s, call_state);
 
     if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
                                            offset, offset + bytes,
@@ -235,13 +474,6 @@ void block_copy_state_free(BlockCopyState *s)
     g_free(s);
 }
 
-static uint32_t block_copy_max_transfer(BdrvChild *source, BdrvChild *target)
-{
-    return MIN_NON_ZERO(INT_MAX,
-                        MIN_NON_ZERO(source->bs->bl.max_transfer,
-                                     target->bs->bl.max_transfer));
-}
-
 BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
                                      int64_t cluster_size, bool use_copy_range,
                                      BdrvRequestFlags write_flags, Error **errp)
@@ -432,6 +664,7 @@ out:
 static coroutine_fn int block_copy_task_entry(AioTask *task)
 {
     BlockCopyTask *t = container_of(task, BlockCopyTask, task);
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     bool error_is_read = false;
     int ret;
 
@@ -443,6 +676,9 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     } else {
         progress_work_done(t->s->progress, t->bytes);
     }
+    if (ret >= 0 && t->call_state->background) {
+        block_copy_account(t->s, t->bytes, start_ns);
+    }
     co_put_to_shres(t->s->mem, t->bytes);
     block_copy_task_end(t, ret);
 
@@ -640,7 +876,10 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         bytes = end - offset;
 
         if (!aio && bytes) {
-            aio = aio_task_pool_new(call_state->max_workers);
+            aio = aio_task_pool_new(block_copy_workers(s, call_state));
+        } else if (aio && call_state->adaptive) {
+            aio_task_pool_set_max_busy_tasks(aio,
+                                             block_copy_workers(s, call_state));
         }
 
         ret = block_copy_task_run(aio, task);
@@ -748,6 +987,7 @@ BlockCopyCallState *block_copy_async(BlockCopyState *s,
                                      void *cb_opaque)
 {
     BlockCopyCallState *call_state = g_new(BlockCopyCallState, 1);
+    BlockCopyAdaptState *a = &s->adapt;
 
     *call_state = (BlockCopyCallState) {
         .s = s,
@@ -755,12 +995,33 @@ BlockCopyCallState *block_copy_async(BlockCopyState *s,
         .bytes = bytes,
         .max_workers = max_workers,
         .max_chunk = max_chunk,
+        .background = true,
+        .adaptive = s->adaptive,
         .cb = cb,
         .cb_opaque = cb_opaque,
 
         .co = qemu_coroutine_create(block_copy_async_co_entry, call_state),
     };
 
+    /*
+     * Start from the fixed settings, or keep what was found by an earlier
+     * call (e.g. before the job was paused), within the new limits.  Measure
+     * from scratch in any case.
+     */
+    if (!a->workers || max_workers != a->max_workers ||
+        max_chunk != a->max_chunk)
+    {
+        a->workers = max_workers;
+        a->chunk = MIN_NON_ZERO(s->copy_size, max_chunk);
+    }
+    a->max_workers = max_workers;
+    a->max_chunk = max_chunk;
+    a->knob = BLOCK_COPY_ADAPT_NONE;
+    a->period_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    a->period_bytes = 0;
+    a->period_requests = 0;
+    a->period_latency_ns = 0;
+
     qemu_coroutine_enter(call_state->co);
 
     return call_state;
@@ -823,6 +1084,26 @@ void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip)
     s->skip_unallocated = skip;
 }
 
+void block_copy_set_adaptive(BlockCopyState *s, bool adaptive)
+{
+    s->adaptive = adaptive;
+}
+
+void block_copy_get_stats(BlockCopyState *s, JobCopyStats *stats)
+{
+    BlockCopyAdaptState *a = &s->adapt;
+
+    *stats = (JobCopyStats) {
+        .chunk_size = s->adaptive ?
+                      MIN(a->chunk, block_copy_adapt_max_chunk(s)) :
+                      MIN_NON_ZERO(s->copy_size, a->max_chunk),
+        .workers    = a->workers,
+        .requests   = a->requests,
+        .throughput = a->throughput,
+        .latency_ns = a->latency_ns,
+    };
+}
+
 void block_copy_set_speed(BlockCopyState *s, uint64_t speed)
 {
     s->speed = speed;
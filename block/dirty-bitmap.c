@@ -94,10 +94,11 @@ BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs, const char *name)
 }
 
 /* Called with BQL taken.  */
-BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
-                                          uint32_t granularity,
-                                          const char *name,
-                                          Error **errp)
+static BdrvDirtyBitmap *bdrv_do_create_dirty_bitmap(BlockDriverState *bs,
+                                                    uint32_t granularity,
+                                                    const char *name,
+                                                    bool sparse,
+                                                    Error **errp)
 {
     int64_t bitmap_size;
     BdrvDirtyBitmap *bitmap;
@@ -122,7 +123,9 @@ BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
     }
     bitmap = g_new0(BdrvDirtyBitmap, 1);
     bitmap->bs = bs;
-    bitmap->bitmap = hbitmap_alloc(bitmap_size, ctz32(granularity));
+    bitmap->bitmap = sparse ?
+        hbitmap_alloc_sparse(bitmap_size, ctz32(granularity)) :
+        hbitmap_alloc(bitmap_size, ctz32(granularity));
     bitmap->size = bitmap_size;
     bitmap->name = g_strdup(name);
     bitmap->disabled = false;
@@ -132,6 +135,24 @@ BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
     return bitmap;
 }
 
+/* Called with BQL taken.  */
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          uint32_t granularity,
+                                          const char *name,
+                                          Error **errp)
+{
+    return bdrv_do_create_dirty_bitmap(bs, granularity, name, false, errp);
+}
+
+/* Like bdrv_create_dirty_bitmap(), but using the sparse representation */
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap_sparse(BlockDriverState *bs,
+                                                 uint32_t granularity,
+                                                 const char *name,
+                                                 Error **errp)
+{
+    return bdrv_do_create_dirty_bitmap(bs, granularity, name, true, errp);
+}
+
 int64_t bdrv_dirty_bitmap_size(const BdrvDirtyBitmap *bitmap)
 {
     return bitmap->size;
@@ -222,7 +243,9 @@ int bdrv_dirty_bitmap_create_successor(BdrvDirtyBitmap *bitmap, Error **errp)
 
     /* Create an anonymous successor */
     granularity = bdrv_dirty_bitmap_granularity(bitmap);
-    child = bdrv_create_dirty_bitmap(bitmap->bs, granularity, NULL, errp);
+    child = bdrv_do_create_dirty_bitmap(bitmap->bs, granularity, NULL,
+                                        hbitmap_is_sparse(bitmap->bitmap),
+                                        errp);
     if (!child) {
         return -1;
     }
@@ -654,6 +677,15 @@ void bdrv_reset_dirty_bitmap(BdrvDirtyBitmap *bitmap,
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
 }
 
+/* Allocate an empty HBitmap with the same granularity and layout as @hb */
+static HBitmap *bdrv_dirty_bitmap_alloc_like(uint64_t size, const HBitmap *hb)
+{
+    if (hbitmap_is_sparse(hb)) {
+        return hbitmap_alloc_sparse(size, hbitmap_granularity(hb));
+    }
+    return hbitmap_alloc(size, hbitmap_granularity(hb));
+}
+
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
 {
     assert(!bdrv_dirty_bitmap_readonly(bitmap));
@@ -662,8 +694,7 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
         hbitmap_reset_all(bitmap->bitmap);
     } else {
         HBitmap *backup = bitmap->bitmap;
-        bitmap->bitmap = hbitmap_alloc(bitmap->size,
-                                       hbitmap_granularity(backup));
+        bitmap->bitmap = bdrv_dirty_bitmap_alloc_like(bitmap->size, backup);
         *out = backup;
     }
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
@@ -812,6 +843,22 @@ void bdrv_dirty_bitmap_set_persistence(BdrvDirtyBitmap *bitmap, bool persistent)
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
 }
 
+/* Called with BQL taken. */
+void bdrv_dirty_bitmap_set_sparse(BdrvDirtyBitmap *bitmap, bool sparse)
+{
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    hbitmap_set_sparse(bitmap->bitmap, sparse);
+    if (bitmap->successor) {
+        hbitmap_set_sparse(bitmap->successor->bitmap, sparse);
+    }
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+}
+
+bool bdrv_dirty_bitmap_get_sparse(const BdrvDirtyBitmap *bitmap)
+{
+    return hbitmap_is_sparse(bitmap->bitmap);
+}
+
 /* Called with BQL taken. */
 void bdrv_dirty_bitmap_set_inconsistent(BdrvDirtyBitmap *bitmap)
 {
@@ -942,7 +989,7 @@ bool bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
 
     if (backup) {
         *backup = dest->bitmap;
-        dest->bitmap = hbitmap_alloc(dest->size, hbitmap_granularity(*backup));
+        dest->bitmap = bdrv_dirty_bitmap_alloc_like(dest->size, *backup);
         ret = hbitmap_merge(*backup, src->bitmap, dest->bitmap);
     } else {
         ret = hbitmap_merge(dest->bitmap, src->bitmap, dest->bitmap);
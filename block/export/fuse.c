@@ -26,6 +26,7 @@
 #include "block/qapi.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
+#include "qemu/coroutine.h"
 #include "sysemu/block-backend.h"
 
 #include <fuse.h>
@@ -35,18 +36,41 @@
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/*
+ * Number of asynchronous requests (reads, and direct I/O issued with AIO)
+ * the kernel may have pending.  The kernel default is 12.
+ */
+#define FUSE_MAX_BACKGROUND 64
+
+
+typedef struct FuseExport FuseExport;
 
-typedef struct FuseExport {
+/*
+ * A request received from the kernel.  Every request is processed in a
+ * coroutine of its own and needs its own buffer, because a write request
+ * refers to the data in there until it has been completed.  Buffers are
+ * kept for reuse after the request is done.
+ */
+typedef struct FuseRequest {
+    FuseExport *exp;
+    struct fuse_buf fuse_buf;
+    QSLIST_ENTRY(FuseRequest) next;
+} FuseRequest;
+
+struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
+    QSLIST_HEAD(, FuseRequest) free_requests;
     bool mounted, fd_handler_set_up;
 
+    /* Serializes checking the length and resizing the export */
+    CoMutex resize_lock;
+
     char *mountpoint;
     bool writable;
     bool growable;
-} FuseExport;
+};
 
 static GHashTable *exports;
 static const struct fuse_lowlevel_ops fuse_ops;
@@ -117,6 +141,7 @@ static int fuse_export_create(BlockExport *blk_exp,
     exp->mountpoint = g_strdup(args->mountpoint);
     exp->writable = blk_exp_args->writable;
     exp->growable = args->growable;
+    qemu_co_mutex_init(&exp->resize_lock);
 
     ret = setup_fuse_export(exp, args->mountpoint, errp);
     if (ret < 0) {
@@ -193,6 +218,40 @@ fail:
     return ret;
 }
 
+static FuseRequest *fuse_request_get(FuseExport *exp)
+{
+    FuseRequest *req = QSLIST_FIRST(&exp->free_requests);
+
+    if (req) {
+        QSLIST_REMOVE_HEAD(&exp->free_requests, next);
+    } else {
+        req = g_new0(FuseRequest, 1);
+        req->exp = exp;
+    }
+
+    return req;
+}
+
+static void fuse_request_put(FuseRequest *req)
+{
+    QSLIST_INSERT_HEAD(&req->exp->free_requests, req, next);
+}
+
+/**
+ * Process one request.  The fuse_ops callbacks run in this coroutine, so
+ * they can wait for I/O without blocking other requests.
+ */
+static void coroutine_fn fuse_co_process_request(void *opaque)
+{
+    FuseRequest *req = opaque;
+    FuseExport *exp = req->exp;
+
+    fuse_session_process_buf(exp->fuse_session, &req->fuse_buf);
+
+    fuse_request_put(req);
+    blk_exp_unref(&exp->common);
+}
+
 /**
  * Callback to be invoked when the FUSE session FD can be read from.
  * (This is basically the FUSE event loop.)
@@ -200,21 +259,21 @@ fail:
 static void read_from_fuse_export(void *opaque)
 {
     FuseExport *exp = opaque;
+    FuseRequest *req = fuse_request_get(exp);
+    Coroutine *co;
     int ret;
 
-    blk_exp_ref(&exp->common);
-
     do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
+        ret = fuse_session_receive_buf(exp->fuse_session, &req->fuse_buf);
     } while (ret == -EINTR);
-    if (ret < 0) {
-        goto out;
+    if (ret <= 0) {
+        fuse_request_put(req);
+        return;
     }
 
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
-
-out:
-    blk_exp_unref(&exp->common);
+    blk_exp_ref(&exp->common);
+    co = qemu_coroutine_create(fuse_co_process_request, req);
+    qemu_coroutine_enter(co);
 }
 
 static void fuse_export_shutdown(BlockExport *blk_exp)
@@ -244,6 +303,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    FuseRequest *req, *next_req;
 
     if (exp->fuse_session) {
         if (exp->mounted) {
@@ -253,7 +313,10 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
+    QSLIST_FOREACH_SAFE(req, &exp->free_requests, next, next_req) {
+        free(req->fuse_buf.mem);
+        g_free(req);
+    }
     g_free(exp->mountpoint);
 }
 
@@ -295,6 +358,16 @@ static void fuse_init(void *userdata, struct fuse_conn_info *conn)
     conn->max_read = FUSE_MAX_BOUNCE_BYTES;
 
     conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
+
+    /* Requests are processed in parallel, so let the kernel send more */
+    conn->max_background = FUSE_MAX_BACKGROUND;
+    conn->congestion_threshold = FUSE_MAX_BACKGROUND * 3 / 4;
+
+    /*
+     * libfuse receives spliced requests through a pipe per thread, which
+     * would be shared by all requests in flight here.
+     */
+    conn->want &= ~FUSE_CAP_SPLICE_READ;
 }
 
 /**
@@ -353,8 +426,13 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_attr(req, &statbuf, 1.);
 }
 
-static int fuse_do_truncate(const FuseExport *exp, int64_t size,
-                            bool req_zero_write, PreallocMode prealloc)
+/**
+ * Resize the export.  Must be called with exp->resize_lock held, which
+ * also protects the temporary change of permissions.
+ */
+static int coroutine_fn fuse_do_truncate(const FuseExport *exp, int64_t size,
+                                         bool req_zero_write,
+                                         PreallocMode prealloc)
 {
     uint64_t blk_perm, blk_shared_perm;
     BdrvRequestFlags truncate_flags = 0;
@@ -389,8 +467,9 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
 /**
  * Let clients set file attributes.  Only resizing is supported.
  */
-static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
-                         int to_set, struct fuse_file_info *fi)
+static void coroutine_fn fuse_setattr(fuse_req_t req, fuse_ino_t inode,
+                                      struct stat *statbuf, int to_set,
+                                      struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int ret;
@@ -405,7 +484,9 @@ static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
         return;
     }
 
+    qemu_co_mutex_lock(&exp->resize_lock);
     ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF);
+    qemu_co_mutex_unlock(&exp->resize_lock);
     if (ret < 0) {
         fuse_reply_err(req, -ret);
         return;
@@ -473,8 +554,9 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
 /**
  * Handle client writes to the exported image.
  */
-static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
-                       size_t size, off_t offset, struct fuse_file_info *fi)
+static void coroutine_fn fuse_write(fuse_req_t req, fuse_ino_t inode,
+                                    const char *buf, size_t size, off_t offset,
+                                    struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
@@ -493,10 +575,13 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 
     /**
      * Clients will expect short writes at EOF, so we have to limit
-     * offset+size to the image length.
+     * offset+size to the image length.  Concurrent writes must not
+     * shrink the export again, so check and grow under the lock.
      */
+    qemu_co_mutex_lock(&exp->resize_lock);
     length = blk_getlength(exp->common.blk);
     if (length < 0) {
+        qemu_co_mutex_unlock(&exp->resize_lock);
         fuse_reply_err(req, -length);
         return;
     }
@@ -505,6 +590,7 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
         if (exp->growable) {
             ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
+                qemu_co_mutex_unlock(&exp->resize_lock);
                 fuse_reply_err(req, -ret);
                 return;
             }
@@ -512,6 +598,7 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
             size = length - offset;
         }
     }
+    qemu_co_mutex_unlock(&exp->resize_lock);
 
     ret = blk_pwrite(exp->common.blk, offset, buf, size, 0);
     if (ret >= 0) {
@@ -524,9 +611,9 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 /**
  * Let clients perform various fallocate() operations.
  */
-static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
-                           off_t offset, off_t length,
-                           struct fuse_file_info *fi)
+static void coroutine_fn fuse_fallocate(fuse_req_t req, fuse_ino_t inode,
+                                        int mode, off_t offset, off_t length,
+                                        struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int64_t blk_len;
@@ -537,17 +624,31 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         return;
     }
 
+    /*
+     * Like in fuse_write(), the length must not change between checking
+     * it and growing the export, so hold the lock for both.
+     */
+    qemu_co_mutex_lock(&exp->resize_lock);
     blk_len = blk_getlength(exp->common.blk);
     if (blk_len < 0) {
+        qemu_co_mutex_unlock(&exp->resize_lock);
         fuse_reply_err(req, -blk_len);
         return;
     }
 
     if (mode & FALLOC_FL_KEEP_SIZE) {
         length = MIN(length, blk_len - offset);
+        if (length <= 0) {
+            /* Nothing to do beyond the EOF */
+            qemu_co_mutex_unlock(&exp->resize_lock);
+            fuse_reply_err(req, 0);
+            return;
+        }
     }
 
     if (mode & FALLOC_FL_PUNCH_HOLE) {
+        qemu_co_mutex_unlock(&exp->resize_lock);
+
         if (!(mode & FALLOC_FL_KEEP_SIZE)) {
             fuse_reply_err(req, EINVAL);
             return;
@@ -561,15 +662,18 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
             length -= size;
         } while (ret == 0 && length > 0);
     } else if (mode & FALLOC_FL_ZERO_RANGE) {
+        /* Only ever grow, a concurrent request may have grown further */
         if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > blk_len) {
             /* No need for zeroes, we are going to write them ourselves */
             ret = fuse_do_truncate(exp, offset + length, false,
                                    PREALLOC_MODE_OFF);
             if (ret < 0) {
+                qemu_co_mutex_unlock(&exp->resize_lock);
                 fuse_reply_err(req, -ret);
                 return;
             }
         }
+        qemu_co_mutex_unlock(&exp->resize_lock);
 
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
@@ -582,6 +686,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     } else if (!mode) {
         /* We can only fallocate at the EOF with a truncate */
         if (offset < blk_len) {
+            qemu_co_mutex_unlock(&exp->resize_lock);
             fuse_reply_err(req, EOPNOTSUPP);
             return;
         }
@@ -590,6 +695,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
             /* No preallocation needed here */
             ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
+                qemu_co_mutex_unlock(&exp->resize_lock);
                 fuse_reply_err(req, -ret);
                 return;
             }
@@ -597,7 +703,9 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
 
         ret = fuse_do_truncate(exp, offset + length, true,
                                PREALLOC_MODE_FALLOC);
+        qemu_co_mutex_unlock(&exp->resize_lock);
     } else {
+        qemu_co_mutex_unlock(&exp->resize_lock);
         ret = -EOPNOTSUPP;
     }
 
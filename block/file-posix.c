@@ -40,6 +40,7 @@
 
 #include "scsi/pr-manager.h"
 #include "scsi/constants.h"
+#include "io/channel-socket.h"
 
 #if defined(__APPLE__) && (__MACH__)
 #include <paths.h>
@@ -61,6 +62,7 @@
 #ifdef __linux__
 #include <sys/ioctl.h>
 #include <sys/param.h>
+#include <sys/sendfile.h>
 #include <sys/syscall.h>
 #include <sys/vfs.h>
 #include <linux/cdrom.h>
@@ -209,6 +211,11 @@ typedef struct RawPosixAIOData {
             PreallocMode prealloc;
             Error **errp;
         } truncate;
+        struct {
+            int sockfd;
+            const char *header;
+            size_t header_len;
+        } sendfile;
     };
 } RawPosixAIOData;
 
@@ -1132,6 +1139,23 @@ out:
     return ret;
 }
 
+/*
+ * A registered file stays open until it is unregistered, and its slot would
+ * be reused by a new file with the same descriptor number.  Unregister s->fd
+ * before it is closed or the node moves to another AioContext.
+ */
+static void raw_unregister_io_uring_fd(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring && s->fd >= 0) {
+        luring_unregister_file(aio_get_linux_io_uring(bdrv_get_aio_context(bs)),
+                               s->fd);
+    }
+#endif
+}
+
 static void raw_reopen_commit(BDRVReopenState *state)
 {
     BDRVRawReopenState *rs = state->opaque;
@@ -1141,6 +1165,7 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->check_cache_dropped = rs->check_cache_dropped;
     s->open_flags = rs->open_flags;
 
+    raw_unregister_io_uring_fd(state->bs);
     qemu_close(s->fd);
     s->fd = rs->fd;
 
@@ -1771,6 +1796,123 @@ static int handle_aiocb_copy_range(void *opaque)
     return 0;
 }
 
+#ifdef __linux__
+/*
+ * Send as much of the header and data as the socket takes without blocking.
+ * The progress is recorded in @aiocb, so that raw_co_sendfile() can submit
+ * the request again once the socket is writable.
+ *
+ * Returns 0 when everything was sent and -EAGAIN if the socket is full.
+ */
+static int handle_aiocb_sendfile(void *opaque)
+{
+    static const char zero_buf[4096];
+    RawPosixAIOData *aiocb = opaque;
+    int sockfd = aiocb->sendfile.sockfd;
+    ssize_t len;
+
+    while (aiocb->sendfile.header_len) {
+        len = send(sockfd, aiocb->sendfile.header, aiocb->sendfile.header_len,
+                   MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        aiocb->sendfile.header += len;
+        aiocb->sendfile.header_len -= len;
+    }
+
+    while (aiocb->aio_nbytes) {
+        off_t offset = aiocb->aio_offset;
+
+        len = sendfile(sockfd, aiocb->aio_fildes, &offset,
+                       MIN(aiocb->aio_nbytes, SSIZE_MAX));
+        trace_file_sendfile(aiocb->bs, aiocb->aio_fildes, aiocb->aio_offset,
+                            sockfd, aiocb->aio_nbytes, len);
+
+        if (len == 0) {
+            /*
+             * The file was shrunk under our feet; like a read, return
+             * zeroes for the part beyond EOF.  The header is already on
+             * the wire, so the reply has to be completed either way.
+             */
+            len = send(sockfd, zero_buf,
+                       MIN(aiocb->aio_nbytes, sizeof(zero_buf)),
+                       MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        if (len < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EINVAL:
+            case ENOSYS:
+            case ENOTSUP:
+                /*
+                 * Part of the reply may already have been sent, so the
+                 * caller must not fall back to the normal path any more.
+                 */
+                return -EIO;
+            default:
+                return -errno;
+            }
+        }
+        aiocb->aio_offset += len;
+        aiocb->aio_nbytes -= len;
+    }
+    return 0;
+}
+
+static int coroutine_fn raw_co_sendfile(BlockDriverState *bs,
+                                        int64_t offset, int64_t bytes,
+                                        QIOChannelSocket *sioc,
+                                        const void *header,
+                                        size_t header_len)
+{
+    BDRVRawState *s = bs->opaque;
+    RawPosixAIOData acb;
+    int ret;
+
+    /*
+     * sendfile() goes through the page cache, which would bypass the
+     * coherency that O_DIRECT users ask for.
+     */
+    if (s->open_flags & O_DIRECT) {
+        return -ENOTSUP;
+    }
+    if (fd_open(bs) < 0) {
+        return -EIO;
+    }
+
+    acb = (RawPosixAIOData) {
+        .bs             = bs,
+        .aio_type       = QEMU_AIO_SENDFILE,
+        .aio_fildes     = s->fd,
+        .aio_offset     = offset,
+        .aio_nbytes     = bytes,
+        .sendfile       = {
+            .sockfd         = sioc->fd,
+            .header         = header,
+            .header_len     = header_len,
+        },
+    };
+
+    /*
+     * Reading the file may block, so sendfile() runs in the thread pool.
+     * Waiting for the socket must not tie up a worker, though: the worker
+     * gives up when the socket is full and the coroutine waits here.
+     */
+    for (;;) {
+        ret = raw_thread_pool_submit(bs, handle_aiocb_sendfile, &acb);
+        if (ret != -EAGAIN) {
+            return ret;
+        }
+        qio_channel_yield(QIO_CHANNEL(sioc), G_IO_OUT);
+    }
+}
+#endif
+
 static int handle_aiocb_discard(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -2108,6 +2250,11 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
     return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
 }
 
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    raw_unregister_io_uring_fd(bs);
+}
+
 static void raw_aio_attach_aio_context(BlockDriverState *bs,
                                        AioContext *new_context)
 {
@@ -2139,6 +2286,7 @@ static void raw_close(BlockDriverState *bs)
     BDRVRawState *s = bs->opaque;
 
     if (s->fd >= 0) {
+        raw_unregister_io_uring_fd(bs);
         qemu_close(s->fd);
         s->fd = -1;
     }
@@ -2898,6 +3046,30 @@ static void raw_account_discard(BDRVRawState *s, uint64_t nbytes, int ret)
     }
 }
 
+#if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
+/*
+ * Run fallocate() on a regular file through io_uring instead of the thread
+ * pool.  -ENOTSUP means that either io_uring or the file system cannot do
+ * it; callers then go through the thread pool, whose handlers know about
+ * all fallbacks and remember what the file system does not support.
+ */
+static int coroutine_fn raw_co_io_uring_fallocate(BlockDriverState *bs,
+                                                  int mode, int64_t offset,
+                                                  int64_t len)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        return translate_err(luring_co_fallocate(bs, aio, s->fd, mode,
+                                                 offset, len));
+    }
+#endif
+    return -ENOTSUP;
+}
+#endif
+
 static coroutine_fn int
 raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int bytes, bool blkdev)
 {
@@ -2917,7 +3089,16 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int bytes, bool blkdev)
         acb.aio_type |= QEMU_AIO_BLKDEV;
     }
 
-    ret = raw_thread_pool_submit(bs, handle_aiocb_discard, &acb);
+    ret = -ENOTSUP;
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    if (!blkdev && s->has_discard) {
+        ret = raw_co_io_uring_fallocate(bs, FALLOC_FL_PUNCH_HOLE |
+                                        FALLOC_FL_KEEP_SIZE, offset, bytes);
+    }
+#endif
+    if (ret == -ENOTSUP) {
+        ret = raw_thread_pool_submit(bs, handle_aiocb_discard, &acb);
+    }
     raw_account_discard(s, bytes, ret);
     return ret;
 }
@@ -2992,6 +3173,34 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int bytes,
         handler = handle_aiocb_write_zeroes;
     }
 
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+    /* The common cases of the handlers above, without the thread pool */
+    if (!blkdev && s->has_write_zeroes) {
+        int ret = -ENOTSUP;
+
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+        if (flags & BDRV_REQ_MAY_UNMAP) {
+            ret = raw_co_io_uring_fallocate(bs, FALLOC_FL_PUNCH_HOLE |
+                                            FALLOC_FL_KEEP_SIZE,
+                                            offset, bytes);
+            if (ret != -ENOTSUP && ret != -EINVAL && ret != -EBUSY) {
+                return ret;
+            }
+        }
+#endif
+
+        ret = raw_co_io_uring_fallocate(bs, FALLOC_FL_ZERO_RANGE,
+                                        offset, bytes);
+        if (ret == -EINVAL) {
+            /* Fall back to pwrite for unaligned ranges, like the handler */
+            return -ENOTSUP;
+        }
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+#endif
+
     return raw_thread_pool_submit(bs, handler, &acb);
 }
 
@@ -3141,6 +3350,7 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_unregister_io_uring_fd(bs);
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3239,9 +3449,13 @@ BlockDriver bdrv_file = {
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef __linux__
+    .bdrv_co_sendfile       = raw_co_sendfile,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
@@ -3616,6 +3830,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
@@ -3740,6 +3955,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
@@ -3870,6 +4086,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
@@ -707,6 +707,7 @@ static void tracked_request_end(BdrvTrackedRequest *req)
 
     qemu_co_mutex_lock(&req->bs->reqs_lock);
     QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->bs->tracked_reqs_tree, &req->overlap_node);
     qemu_co_queue_restart_all(&req->wait_queue);
     qemu_co_mutex_unlock(&req->bs->reqs_lock);
 }
@@ -731,63 +732,64 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
         .serialising    = false,
         .overlap_offset = offset,
         .overlap_bytes  = bytes,
+        .overlap_node   = {
+            .start      = offset,
+            .end        = offset + bytes,
+        },
     };
 
     qemu_co_queue_init(&req->wait_queue);
 
     qemu_co_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    interval_tree_insert(&bs->tracked_reqs_tree, &req->overlap_node);
     qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
-static bool tracked_request_overlaps(BdrvTrackedRequest *req,
-                                     int64_t offset, int64_t bytes)
+/*
+ * Called for each tracked request whose overlap range intersects the one
+ * of @opaque, the request looking for conflicts.
+ */
+static bool tracked_request_conflicts(IntervalTreeNode *node, void *opaque)
 {
-    bdrv_check_request(offset, bytes, &error_abort);
+    BdrvTrackedRequest *self = opaque;
+    BdrvTrackedRequest *req = container_of(node, BdrvTrackedRequest,
+                                           overlap_node);
 
-    /*        aaaa   bbbb */
-    if (offset >= req->overlap_offset + req->overlap_bytes) {
+    if (req == self || (!req->serialising && !self->serialising)) {
         return false;
     }
-    /* bbbb   aaaa        */
-    if (req->overlap_offset >= offset + bytes) {
-        return false;
-    }
-    return true;
+
+    /*
+     * Hitting this means there was a reentrant request, for
+     * example, a block driver issuing nested requests.  This must
+     * never happen since it means deadlock.
+     */
+    assert(qemu_coroutine_self() != req->co);
+
+    /*
+     * If the request is already (indirectly) waiting for us, or
+     * will wait for us as soon as it wakes up, then just go on
+     * (instead of producing a deadlock in the former case).
+     */
+    return !req->waiting_for;
 }
 
 /* Called with self->bs->reqs_lock held */
 static BdrvTrackedRequest *
 bdrv_find_conflicting_request(BdrvTrackedRequest *self)
 {
-    BdrvTrackedRequest *req;
+    IntervalTreeNode *node;
 
-    QLIST_FOREACH(req, &self->bs->tracked_requests, list) {
-        if (req == self || (!req->serialising && !self->serialising)) {
-            continue;
-        }
-        if (tracked_request_overlaps(req, self->overlap_offset,
-                                     self->overlap_bytes))
-        {
-            /*
-             * Hitting this means there was a reentrant request, for
-             * example, a block driver issuing nested requests.  This must
-             * never happen since it means deadlock.
-             */
-            assert(qemu_coroutine_self() != req->co);
+    bdrv_check_request(self->overlap_offset, self->overlap_bytes,
+                       &error_abort);
 
-            /*
-             * If the request is already (indirectly) waiting for us, or
-             * will wait for us as soon as it wakes up, then just go on
-             * (instead of producing a deadlock in the former case).
-             */
-            if (!req->waiting_for) {
-                return req;
-            }
-        }
-    }
+    node = interval_tree_find(&self->bs->tracked_reqs_tree,
+                              self->overlap_offset,
+                              self->overlap_offset + self->overlap_bytes,
+                              tracked_request_conflicts, self);
 
-    return NULL;
+    return node ? container_of(node, BdrvTrackedRequest, overlap_node) : NULL;
 }
 
 /* Called with self->bs->reqs_lock held */
@@ -822,8 +824,20 @@ static void tracked_request_set_serialising(BdrvTrackedRequest *req,
         req->serialising = true;
     }
 
-    req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
-    req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    overlap_offset = MIN(req->overlap_offset, overlap_offset);
+    overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    if (overlap_offset == req->overlap_offset &&
+        overlap_bytes == req->overlap_bytes) {
+        return;
+    }
+
+    /* The tree is keyed by the overlap range, so move the request */
+    interval_tree_remove(&req->bs->tracked_reqs_tree, &req->overlap_node);
+    req->overlap_offset = overlap_offset;
+    req->overlap_bytes = overlap_bytes;
+    req->overlap_node.start = overlap_offset;
+    req->overlap_node.end = overlap_offset + overlap_bytes;
+    interval_tree_insert(&req->bs->tracked_reqs_tree, &req->overlap_node);
 }
 
 /**
@@ -1766,6 +1780,15 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
     return bdrv_co_preadv_part(child, offset, bytes, qiov, 0, flags);
 }
 
+/* Account a request to @bs that started at @start_ns */
+static void bdrv_account_latency(BlockDriverState *bs, enum BlockAcctType type,
+                                 int64_t start_ns)
+{
+    block_latency_log_account(&bs->latency_log[type],
+                              qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                              start_ns);
+}
+
 int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     int64_t offset, int64_t bytes,
     QEMUIOVector *qiov, size_t qiov_offset,
@@ -1774,6 +1797,7 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     BlockDriverState *bs = child->bs;
     BdrvTrackedRequest req;
     BdrvRequestPadding pad;
+    int64_t start_ns;
     int ret;
 
     trace_bdrv_co_preadv_part(bs, offset, bytes, flags);
@@ -1800,6 +1824,7 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     }
 
     bdrv_inc_in_flight(bs);
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     /* Don't do copy-on-read if we read data before write operation */
     if (qatomic_read(&bs->copy_on_read)) {
@@ -1817,6 +1842,7 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
                               bs->bl.request_alignment,
                               qiov, qiov_offset, flags);
     tracked_request_end(&req);
+    bdrv_account_latency(bs, BLOCK_ACCT_READ, start_ns);
     bdrv_dec_in_flight(bs);
 
     bdrv_padding_destroy(&pad);
@@ -2001,6 +2027,12 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, int64_t bytes,
     bdrv_check_request(offset, bytes, &error_abort);
 
     qatomic_inc(&bs->write_gen);
+    if (req->type == BDRV_TRACKED_TRUNCATE) {
+        /* The driver may have changed anything after the new end */
+        bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
+    } else {
+        bdrv_bsc_invalidate_range(bs, offset, bytes);
+    }
 
     /*
      * Discard cannot extend the image, but in error handling cases, such as
@@ -2201,6 +2233,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     BdrvTrackedRequest req;
     uint64_t align = bs->bl.request_alignment;
     BdrvRequestPadding pad;
+    int64_t start_ns;
     int ret;
     bool padded = false;
 
@@ -2248,6 +2281,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     }
 
     bdrv_inc_in_flight(bs);
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
 
     if (flags & BDRV_REQ_ZERO_WRITE) {
@@ -2274,6 +2308,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
 
 out:
     tracked_request_end(&req);
+    bdrv_account_latency(bs, BLOCK_ACCT_WRITE, start_ns);
     bdrv_dec_in_flight(bs);
 
     return ret;
@@ -2325,6 +2360,97 @@ int bdrv_flush_all(void)
     return result;
 }
 
+void bdrv_bsc_invalidate_range(BlockDriverState *bs,
+                               int64_t offset, int64_t bytes)
+{
+    int64_t end = bytes > INT64_MAX - offset ? INT64_MAX : offset + bytes;
+    int i;
+
+    QEMU_LOCK_GUARD(&bs->bsc_lock);
+    bs->bsc_gen++;
+    for (i = 0; i < BDRV_BLOCK_STATUS_CACHE_SIZE; i++) {
+        BdrvBlockStatusCacheEntry *e = &bs->bsc[i];
+
+        if (e->start < end && offset < e->end) {
+            e->start = e->end = 0;
+        }
+    }
+}
+
+/*
+ * Look up @offset in the block status cache of @bs.  On a hit, copy the
+ * cached entry to @entry, with its start moved to @offset.
+ */
+static bool bdrv_bsc_lookup(BlockDriverState *bs, int64_t offset,
+                            BdrvBlockStatusCacheEntry *entry)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&bs->bsc_lock);
+    for (i = 0; i < BDRV_BLOCK_STATUS_CACHE_SIZE; i++) {
+        BdrvBlockStatusCacheEntry *e = &bs->bsc[i];
+
+        if (e->start <= offset && offset < e->end) {
+            *entry = *e;
+            entry->start = offset;
+            entry->map += offset - e->start;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Remember the status @ret that the driver returned for [@offset, @offset +
+ * @bytes), if it is a data range.  Nothing is cached if an invalidation
+ * happened since @gen was read, because the result may predate a write
+ * that changed it.
+ */
+static void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          int ret, int64_t map, BlockDriverState *file,
+                          unsigned int gen)
+{
+    BdrvBlockStatusCacheEntry *e;
+    int i;
+
+    /*
+     * Zero ranges are not cached: the node may change behind our back
+     * (other users of a network or shared storage, or a driver reporting
+     * something other than allocation), and reporting data as zeroes would
+     * make callers skip it.  A stale data range is harmless.  Ranges passed
+     * through to another node are cheap to query and are not cached either.
+     */
+    if (!(ret & BDRV_BLOCK_DATA) ||
+        (ret & (BDRV_BLOCK_ZERO | BDRV_BLOCK_RAW))) {
+        return;
+    }
+    if ((ret & BDRV_BLOCK_OFFSET_VALID) && !file) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&bs->bsc_lock);
+    if (gen != bs->bsc_gen) {
+        return;
+    }
+
+    for (i = 0; i < BDRV_BLOCK_STATUS_CACHE_SIZE; i++) {
+        e = &bs->bsc[i];
+        if (e->start < offset + bytes && offset < e->end) {
+            e->start = e->end = 0;
+        }
+    }
+
+    e = &bs->bsc[bs->bsc_next];
+    bs->bsc_next = (bs->bsc_next + 1) % BDRV_BLOCK_STATUS_CACHE_SIZE;
+    *e = (BdrvBlockStatusCacheEntry) {
+        .start = offset,
+        .end = offset + bytes,
+        .map = map,
+        .file = file,
+        .ret = ret & ~BDRV_BLOCK_EOF,
+    };
+}
+
 /*
  * Returns the allocation status of the specified sectors.
  * Drivers not implementing the functionality are assumed to not support
@@ -2414,9 +2540,32 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
     aligned_bytes = ROUND_UP(offset + bytes, align) - aligned_offset;
 
     if (bs->drv->bdrv_co_block_status) {
-        ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
-                                            aligned_bytes, pnum, &local_map,
-                                            &local_file);
+        /*
+         * Format drivers walk their metadata and protocol drivers may ask
+         * the host (for example with lseek(SEEK_DATA)) for every query,
+         * while mirror, NBD and qemu-img map query the same ranges over and
+         * over.  Cache data ranges.  Results without want_zero may be less
+         * precise and are not cached, but a cached precise result is good
+         * for both kinds of queries.
+         */
+        unsigned int gen = qatomic_read(&bs->bsc_gen);
+        BdrvBlockStatusCacheEntry entry;
+
+        if (bdrv_bsc_lookup(bs, aligned_offset, &entry) &&
+            QEMU_IS_ALIGNED(entry.end - entry.start, align)) {
+            *pnum = entry.end - entry.start;
+            local_map = entry.map;
+            local_file = entry.file;
+            ret = entry.ret;
+        } else {
+            ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
+                                                aligned_bytes, pnum,
+                                                &local_map, &local_file);
+            if (want_zero && ret >= 0) {
+                bdrv_bsc_fill(bs, aligned_offset, *pnum, ret, local_map,
+                              local_file, gen);
+            }
+        }
     } else {
         /* Default code for filters */
 
@@ -2821,6 +2970,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
     BdrvChild *primary_child = bdrv_primary_child(bs);
     BdrvChild *child;
     int current_gen;
+    int64_t start_ns;
     int ret = 0;
 
     bdrv_inc_in_flight(bs);
@@ -2830,6 +2980,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
         goto early_exit;
     }
 
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     qemu_co_mutex_lock(&bs->reqs_lock);
     current_gen = qatomic_read(&bs->write_gen);
 
@@ -2933,6 +3084,7 @@ out:
     /* Return value is ignored - it's ok if wait queue is empty */
     qemu_co_queue_next(&bs->flush_queue);
     qemu_co_mutex_unlock(&bs->reqs_lock);
+    bdrv_account_latency(bs, BLOCK_ACCT_FLUSH, start_ns);
 
 early_exit:
     bdrv_dec_in_flight(bs);
@@ -3318,6 +3470,48 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
                                    bytes, read_flags, write_flags);
 }
 
+int coroutine_fn bdrv_co_sendfile(BdrvChild *child, int64_t offset,
+                                  int64_t bytes, QIOChannelSocket *sioc,
+                                  const void *header, size_t header_len)
+{
+    BlockDriverState *bs = child->bs;
+    BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
+    int ret;
+
+    trace_bdrv_co_sendfile(bs, offset, bytes, header_len);
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_request32(offset, bytes, NULL, 0);
+    if (ret) {
+        return ret;
+    }
+
+    /*
+     * The data bypasses the block layer, so anything that needs to look at
+     * or modify it on the way (copy-on-read, encryption, unaligned access
+     * emulation) rules out sendfile.
+     */
+    if (!drv->bdrv_co_sendfile || bs->encrypted ||
+        qatomic_read(&bs->copy_on_read) ||
+        !QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment)) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    bdrv_wait_serialising_requests(&req);
+
+    ret = drv->bdrv_co_sendfile(bs, offset, bytes, sioc, header, header_len);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 static void bdrv_parent_cb_resize(BlockDriverState *bs)
 {
     BdrvChild *c;
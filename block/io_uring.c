@@ -17,11 +17,22 @@
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/units.h"
+#include "exec/ramlist.h"
+#include "exec/cpu-common.h"
+#include "exec/memory.h"
 #include "trace.h"
 
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Number of slots in the registered file table */
+#define MAX_FIXED_FILES 64
+
+/* The kernel refuses to register buffers larger than this */
+#define MAX_FIXED_BUFFER_SIZE (1 * GiB)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -56,6 +67,28 @@ typedef struct LuringState {
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /* Whether the kernel supports IORING_OP_FALLOCATE */
+    bool has_fallocate;
+
+    /*
+     * Registered file table, with -1 for unused slots, or NULL if the kernel
+     * does not support sparse file tables.  Files are registered the first
+     * time they are submitted and must be unregistered with
+     * luring_unregister_file() before they are closed.  Protected by
+     * AioContext lock.
+     */
+    int *fixed_files;
+
+    /*
+     * Guest RAM registered as fixed buffers, as an array of struct iovec
+     * sorted by address and split in chunks of at most
+     * MAX_FIXED_BUFFER_SIZE.  The index of a chunk is its buffer index in
+     * the ring.  Protected by AioContext lock.
+     */
+    bool use_fixed_buffers;
+    GArray *fixed_buffers;
+    RAMBlockNotifier ram_notifier;
 } LuringState;
 
 /**
@@ -207,6 +240,157 @@ end:
     qemu_bh_cancel(s->completion_bh);
 }
 
+/*
+ * Point slot @slot of the registered file table to @fd, or clear it if @fd
+ * is -1.  Returns the number of updated slots or a negative errno.
+ */
+static int luring_update_file(LuringState *s, int slot, int fd)
+{
+#ifdef CONFIG_LINUX_IO_URING_FILES_UPDATE
+    return io_uring_register_files_update(&s->ring, slot, &fd, 1);
+#else
+    return -ENOSYS;
+#endif
+}
+
+/**
+ * luring_get_fixed_file:
+ * @s: AIO state
+ * @fd: file descriptor
+ *
+ * Returns: the slot of @fd in the registered file table, registering it if
+ * there is room left, or -1 if it cannot be used as a fixed file
+ */
+static int luring_get_fixed_file(LuringState *s, int fd)
+{
+    int free_slot = -1;
+    int i, ret;
+
+    if (!s->fixed_files) {
+        return -1;
+    }
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_files[i] == fd) {
+            return i;
+        }
+        if (s->fixed_files[i] == -1 && free_slot == -1) {
+            free_slot = i;
+        }
+    }
+    if (free_slot == -1) {
+        return -1;
+    }
+
+    ret = luring_update_file(s, free_slot, fd);
+    trace_luring_register_file(s, fd, free_slot, ret);
+    if (ret != 1) {
+        return -1;
+    }
+
+    s->fixed_files[free_slot] = fd;
+    return free_slot;
+}
+
+void luring_unregister_file(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->fixed_files) {
+        return;
+    }
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_files[i] == fd) {
+            luring_update_file(s, i, -1);
+            s->fixed_files[i] = -1;
+            trace_luring_unregister_file(s, fd, i);
+            return;
+        }
+    }
+}
+
+static int luring_compare_fixed_buffer(const void *a, const void *b)
+{
+    const struct iovec *iov_a = a;
+    const struct iovec *iov_b = b;
+
+    if (iov_a->iov_base == iov_b->iov_base) {
+        return 0;
+    }
+    return iov_a->iov_base < iov_b->iov_base ? -1 : 1;
+}
+
+/**
+ * luring_get_fixed_buffer:
+ * @s: AIO state
+ * @buf: start of the buffer
+ * @len: length of the buffer
+ *
+ * Returns: the index of the registered buffer that contains all of
+ * [@buf, @buf + @len), or -1 if there is none
+ */
+static int luring_get_fixed_buffer(LuringState *s, void *buf, size_t len)
+{
+    struct iovec *iov = (struct iovec *)s->fixed_buffers->data;
+    int low = 0, high = s->fixed_buffers->len - 1;
+
+    /* Find the last buffer that starts at or before @buf */
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+
+        if (iov[mid].iov_base <= buf) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    if (high < 0 ||
+        buf + len > iov[high].iov_base + iov[high].iov_len) {
+        return -1;
+    }
+    return high;
+}
+
+/**
+ * luring_prep_fixed:
+ * @s: AIO state
+ * @sqe: sqe that is about to be submitted
+ *
+ * Switch @sqe to the registered file and buffer it refers to, if any.  This
+ * is done right before submission, so that indices never go stale while
+ * requests wait in submit_queue.
+ */
+static void luring_prep_fixed(LuringState *s, struct io_uring_sqe *sqe)
+{
+    struct iovec *iov;
+    int index;
+
+    index = luring_get_fixed_file(s, sqe->fd);
+    if (index >= 0) {
+        sqe->fd = index;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+
+    if (!s->use_fixed_buffers || sqe->len != 1 ||
+        (sqe->opcode != IORING_OP_READV && sqe->opcode != IORING_OP_WRITEV)) {
+        return;
+    }
+
+    iov = (struct iovec *)(uintptr_t)sqe->addr;
+    index = luring_get_fixed_buffer(s, iov->iov_base, iov->iov_len);
+    if (index < 0) {
+        return;
+    }
+
+    sqe->opcode = sqe->opcode == IORING_OP_READV ?
+                  IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+    sqe->addr = (__u64)(uintptr_t)iov->iov_base;
+    sqe->len = iov->iov_len;
+    sqe->buf_index = index;
+}
+
 static int ioq_submit(LuringState *s)
 {
     int ret = 0;
@@ -225,6 +409,7 @@ static int ioq_submit(LuringState *s)
             }
             /* Prep sqe for submission */
             *sqes = luringcb->sqeq;
+            luring_prep_fixed(s, sqes);
             QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
         }
         ret = io_uring_submit(&s->ring);
@@ -312,6 +497,34 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/**
+ * luring_queue_submit:
+ * @luringcb: AIO control block with a prepared sqe
+ * @s: AIO state
+ *
+ * Adds the request to the pending queue and submits it unless plugged
+ *
+ */
+static int luring_queue_submit(LuringAIOCB *luringcb, LuringState *s)
+{
+    int ret;
+
+    io_uring_sqe_set_data(&luringcb->sqeq, luringcb);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ret = ioq_submit(s);
+        trace_luring_do_submit_done(s, ret);
+        return ret;
+    }
+    return 0;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -326,7 +539,6 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
 static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                             uint64_t offset, int type)
 {
-    int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
 
     switch (type) {
@@ -346,20 +558,8 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
-    io_uring_sqe_set_data(sqes, luringcb);
 
-    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
-    s->io_q.in_queue++;
-    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
-                           s->io_q.in_queue, s->io_q.in_flight);
-    if (!s->io_q.blocked &&
-        (!s->io_q.plugged ||
-         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
-        ret = ioq_submit(s);
-        trace_luring_do_submit_done(s, ret);
-        return ret;
-    }
-    return 0;
+    return luring_queue_submit(luringcb, s);
 }
 
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
@@ -386,6 +586,38 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
     return luringcb.ret;
 }
 
+int coroutine_fn luring_co_fallocate(BlockDriverState *bs, LuringState *s,
+                                     int fd, int mode, uint64_t offset,
+                                     uint64_t len)
+{
+#ifdef CONFIG_LINUX_IO_URING_FALLOCATE
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+    };
+
+    if (!s->has_fallocate) {
+        return -ENOTSUP;
+    }
+
+    trace_luring_co_fallocate(bs, s, &luringcb, fd, mode, offset, len);
+    io_uring_prep_fallocate(&luringcb.sqeq, fd, mode, offset, len);
+    ret = luring_queue_submit(&luringcb, s);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
     aio_set_fd_handler(old_context, s->ring.ring_fd, false, NULL, NULL, NULL,
@@ -402,7 +634,194 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+/*
+ * Wait until all submitted requests have completed, including sqes that the
+ * SQPOLL thread has not consumed yet.  New requests stay in submit_queue
+ * until luring_resume_submission() is called.
+ */
+static int luring_wait_for_in_flight(LuringState *s)
+{
+    int ret;
+
+    s->io_q.plugged++;
+    s->io_q.blocked = true;
+
+    while (s->io_q.in_flight) {
+        /* Sleeps in the kernel, and wakes up the SQ thread if it went idle */
+        ret = io_uring_submit_and_wait(&s->ring, 1);
+        if (ret < 0 && ret != -EINTR) {
+            return ret;
+        }
+        luring_process_completions(s);
+    }
+    return 0;
+}
+
+static void luring_resume_submission(LuringState *s)
+{
+    s->io_q.blocked = false;
+    luring_io_unplug(NULL, s);
+}
+
+/**
+ * luring_register_buffers:
+ * @s: AIO state
+ *
+ * Replace the buffers registered with the ring by s->fixed_buffers.  Fixed
+ * buffers are disabled if the kernel refuses them, usually because guest RAM
+ * does not fit into RLIMIT_MEMLOCK.
+ */
+static void luring_register_buffers(LuringState *s)
+{
+    int ret;
+
+    /* Requests in flight may still be using the old buffers */
+    ret = luring_wait_for_in_flight(s);
+    if (ret < 0) {
+        /*
+         * Requests that did not complete may still refer to the old
+         * buffers, so leave them registered and stop using fixed buffers.
+         */
+        warn_report("io_uring: cannot wait for requests before replacing "
+                    "fixed buffers (%s)", strerror(-ret));
+        goto disable;
+    }
+
+    io_uring_unregister_buffers(&s->ring);
+    if (!s->fixed_buffers->len) {
+        goto out;
+    }
+
+    g_array_sort(s->fixed_buffers, luring_compare_fixed_buffer);
+    ret = io_uring_register_buffers(&s->ring,
+                                    (struct iovec *)s->fixed_buffers->data,
+                                    s->fixed_buffers->len);
+    trace_luring_register_buffers(s, s->fixed_buffers->len, ret);
+    if (ret < 0) {
+        warn_report("io_uring: cannot register guest RAM as fixed buffers "
+                    "(%s), check RLIMIT_MEMLOCK", strerror(-ret));
+        goto disable;
+    }
+    goto out;
+
+disable:
+    s->use_fixed_buffers = false;
+    g_array_set_size(s->fixed_buffers, 0);
+out:
+    luring_resume_submission(s);
+}
+
+static void luring_add_fixed_buffers(LuringState *s, void *host, size_t size)
+{
+    while (size) {
+        struct iovec iov = {
+            .iov_base = host,
+            .iov_len = MIN(size, MAX_FIXED_BUFFER_SIZE),
+        };
+
+        g_array_append_val(s->fixed_buffers, iov);
+        host += iov.iov_len;
+        size -= iov.iov_len;
+    }
+}
+
+static void luring_remove_fixed_buffers(LuringState *s, void *host,
+                                        size_t size)
+{
+    int i;
+
+    for (i = s->fixed_buffers->len - 1; i >= 0; i--) {
+        struct iovec *iov = &g_array_index(s->fixed_buffers, struct iovec, i);
+
+        if (iov->iov_base >= host && iov->iov_base < host + size) {
+            g_array_remove_index(s->fixed_buffers, i);
+        }
+    }
+}
+
+/*
+ * The RAMBlockNotifier stays registered for the whole lifetime of the ring,
+ * but the ring only has an AioContext between luring_attach_aio_context() and
+ * luring_detach_aio_context().  Outside of that window no requests can be in
+ * flight, and the notifier runs under the BQL like attach and detach, so the
+ * buffers can be replaced without taking any lock.
+ */
+static void luring_lock_buffers(LuringState *s)
+{
+    if (s->aio_context) {
+        aio_context_acquire(s->aio_context);
+    }
+}
+
+static void luring_unlock_buffers(LuringState *s)
+{
+    if (s->aio_context) {
+        aio_context_release(s->aio_context);
+    }
+}
+
+static void luring_ram_block_added(RAMBlockNotifier *n, void *host,
+                                   size_t size, size_t max_size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+
+    luring_lock_buffers(s);
+    if (s->use_fixed_buffers) {
+        luring_add_fixed_buffers(s, host, size);
+        luring_register_buffers(s);
+    }
+    luring_unlock_buffers(s);
+}
+
+static void luring_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                     size_t size, size_t max_size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+
+    if (!host) {
+        return;
+    }
+
+    luring_lock_buffers(s);
+    if (s->use_fixed_buffers) {
+        luring_remove_fixed_buffers(s, host, max_size);
+        luring_register_buffers(s);
+    }
+    luring_unlock_buffers(s);
+}
+
+/*
+ * Only the used part of a resizeable RAM block is registered, so that the
+ * kernel does not pin memory that the guest cannot see.  The host mapping
+ * covers the maximum size and stays in place, which means that requests
+ * in flight keep referring to valid memory while the buffers are replaced.
+ */
+static void luring_ram_block_resized(RAMBlockNotifier *n, void *host,
+                                     size_t old_size, size_t new_size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+
+    luring_lock_buffers(s);
+    if (s->use_fixed_buffers) {
+        luring_remove_fixed_buffers(s, host, old_size);
+        luring_add_fixed_buffers(s, host, new_size);
+        luring_register_buffers(s);
+    }
+    luring_unlock_buffers(s);
+}
+
+static int luring_init_ram_block(RAMBlock *rb, void *opaque)
+{
+    LuringState *s = opaque;
+    void *host = qemu_ram_get_host_addr(rb);
+
+    if (host) {
+        luring_add_fixed_buffers(s, host, qemu_ram_get_used_length(rb));
+    }
+    return 0;
+}
+
+LuringState *luring_init(bool sqpoll, bool fixed_buffers, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
@@ -410,20 +829,75 @@ LuringState *luring_init(Error **errp)
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    rc = io_uring_queue_init(MAX_ENTRIES, ring,
+                             sqpoll ? IORING_SETUP_SQPOLL : 0);
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring%s",
+                         sqpoll ? " with SQPOLL" : "");
         g_free(s);
         return NULL;
     }
 
+#ifdef CONFIG_LINUX_IO_URING_FALLOCATE
+    /* Without probing (Linux < 5.6) there is no IORING_OP_FALLOCATE either */
+    {
+        struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+
+        if (probe) {
+            s->has_fallocate = io_uring_opcode_supported(probe,
+                                                         IORING_OP_FALLOCATE);
+            free(probe);
+        }
+    }
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING_FILES_UPDATE
+    /* Fixed files are an optimization, go on without them on old kernels */
+    s->fixed_files = g_new(int, MAX_FIXED_FILES);
+    memset(s->fixed_files, -1, MAX_FIXED_FILES * sizeof(int));
+    rc = io_uring_register_files(ring, s->fixed_files, MAX_FIXED_FILES);
+    if (rc < 0) {
+        g_free(s->fixed_files);
+        s->fixed_files = NULL;
+    }
+#endif
+
+    s->fixed_buffers = g_array_new(false, false, sizeof(struct iovec));
+    if (fixed_buffers) {
+        /* Registered buffers are pinned, like memory mapped for VFIO */
+        if (ram_block_discard_disable(true)) {
+            error_setg(errp, "Cannot set discarding of RAM broken");
+            goto fail;
+        }
+
+        s->use_fixed_buffers = true;
+        s->ram_notifier.ram_block_added = luring_ram_block_added;
+        s->ram_notifier.ram_block_removed = luring_ram_block_removed;
+        s->ram_notifier.ram_block_resized = luring_ram_block_resized;
+        ram_block_notifier_add(&s->ram_notifier);
+        qemu_ram_foreach_block(luring_init_ram_block, s);
+        luring_register_buffers(s);
+    }
+
     ioq_init(&s->io_q);
     return s;
 
+fail:
+    g_array_free(s->fixed_buffers, true);
+    g_free(s->fixed_files);
+    io_uring_queue_exit(ring);
+    g_free(s);
+    return NULL;
 }
 
 void luring_cleanup(LuringState *s)
 {
+    if (s->ram_notifier.ram_block_added) {
+        ram_block_notifier_remove(&s->ram_notifier);
+        ram_block_discard_disable(false);
+    }
+    g_array_free(s->fixed_buffers, true);
+    g_free(s->fixed_files);
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
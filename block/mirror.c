@@ -78,6 +78,8 @@ typedef struct MirrorBlockJob {
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
     int ret;
     bool unmap;
+    /* Try to copy data with bdrv_co_copy_range() instead of buffers */
+    bool use_copy_range;
     int target_cluster_size;
     int max_iov;
     bool initial_zeroing_ongoing;
@@ -326,7 +328,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     MirrorOp *op = opaque;
     MirrorBlockJob *s = op->s;
     int nb_chunks;
-    uint64_t ret;
+    int ret;
     uint64_t max_bytes;
 
     max_bytes = s->granularity * s->max_iov;
@@ -351,6 +353,36 @@ static void coroutine_fn mirror_co_read(void *opaque)
     assert(QEMU_IS_ALIGNED(op->bytes, BDRV_SECTOR_SIZE));
     nb_chunks = DIV_ROUND_UP(op->bytes, s->granularity);
 
+    if (s->use_copy_range) {
+        /* The data does not pass through QEMU, so no buffer is needed */
+        s->in_flight++;
+        s->bytes_in_flight += op->bytes;
+        op->is_in_flight = true;
+        trace_mirror_one_iteration(s, op->offset, op->bytes);
+
+        ret = blk_co_copy_range_to(s->mirror_top_bs->backing, op->offset,
+                                   s->target, op->offset, op->bytes, 0, 0);
+        if (ret >= 0) {
+            mirror_write_complete(op, ret);
+            return;
+        }
+
+        /*
+         * Copy offloading is not supported for this pair of nodes, or
+         * failed for another reason.  Don't try again, and repeat the
+         * request with a buffer: if this was a real I/O error, it will
+         * be reported from there.  Other requests may have been offloaded
+         * concurrently; only the first failure disables offloading.
+         */
+        if (s->use_copy_range) {
+            trace_mirror_copy_range_fail(s, op->offset, ret);
+            s->use_copy_range = false;
+        }
+        s->in_flight--;
+        s->bytes_in_flight -= op->bytes;
+        op->is_in_flight = false;
+    }
+
     while (s->buf_free_count < nb_chunks) {
         trace_mirror_yield_in_flight(s, op->offset, s->in_flight);
         mirror_wait_for_free_in_flight_slot(s);
@@ -1011,6 +1043,15 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
                 continue;
             } else if (cnt != 0) {
                 delay_ns = mirror_iteration(s);
+                if (delay_ns == 0) {
+                    /*
+                     * Go on scanning the bitmap until the in-flight window
+                     * is full instead of going through the main loop for
+                     * every contiguous dirty area.  The check above still
+                     * yields at least once every BLOCK_JOB_SLICE_TIME.
+                     */
+                    continue;
+                }
             }
         }
 
@@ -1575,7 +1616,7 @@ static BlockJob *mirror_start_job(
                              bool is_none_mode, BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
                              bool is_mirror, MirrorCopyMode copy_mode,
-                             Error **errp)
+                             bool use_copy_range, Error **errp)
 {
     MirrorBlockJob *s;
     MirrorBDSOpaque *bs_opaque;
@@ -1737,6 +1778,7 @@ static BlockJob *mirror_start_job(
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->use_copy_range = use_copy_range;
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -1848,7 +1890,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp)
+                  MirrorCopyMode copy_mode, bool use_copy_range,
+                  Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -1865,7 +1908,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                      speed, granularity, buf_size, backing_mode, zero_target,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
-                     filter_node_name, true, copy_mode, errp);
+                     filter_node_name, true, copy_mode, use_copy_range,
+                     errp);
 }
 
 BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -1892,7 +1936,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
                      filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
-                     errp);
+                     false, errp);
     if (!job) {
         goto error_restore_flags;
     }
@@ -87,6 +87,7 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
                                 bool has_persistent, bool persistent,
                                 bool has_disabled, bool disabled,
+                                bool has_sparse, bool sparse,
                                 Error **errp)
 {
     BlockDriverState *bs;
@@ -131,7 +132,11 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         goto out;
     }
 
-    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (has_sparse && sparse) {
+        bitmap = bdrv_create_dirty_bitmap_sparse(bs, granularity, name, errp);
+    } else {
+        bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    }
     if (bitmap == NULL) {
         goto out;
     }
@@ -266,8 +271,13 @@ BdrvDirtyBitmap *block_dirty_bitmap_merge(const char *node, const char *target,
         return NULL;
     }
 
-    anon = bdrv_create_dirty_bitmap(bs, bdrv_dirty_bitmap_granularity(dst),
-                                    NULL, errp);
+    if (bdrv_dirty_bitmap_get_sparse(dst)) {
+        anon = bdrv_create_dirty_bitmap_sparse(
+            bs, bdrv_dirty_bitmap_granularity(dst), NULL, errp);
+    } else {
+        anon = bdrv_create_dirty_bitmap(bs, bdrv_dirty_bitmap_granularity(dst),
+                                        NULL, errp);
+    }
     if (!anon) {
         return NULL;
     }
@@ -424,6 +424,40 @@ static void bdrv_latency_histogram_stats(BlockLatencyHistogram *hist,
     }
 }
 
+static void bdrv_latency_percentiles(BlockLatencyLogHistogram *hist,
+                                     bool *not_null,
+                                     BlockLatencyPercentiles **info)
+{
+    /* Device statistics replace those of the root node */
+    qapi_free_BlockLatencyPercentiles(*info);
+    *info = NULL;
+
+    *not_null = hist->count > 0;
+    if (*not_null) {
+        *info = g_new0(BlockLatencyPercentiles, 1);
+
+        (*info)->count = hist->count;
+        (*info)->overflow = hist->buckets[BLOCK_LATENCY_LOG_OVERFLOW];
+        (*info)->p50 = block_latency_log_percentile(hist, 50);
+        (*info)->p99 = block_latency_log_percentile(hist, 99);
+        (*info)->p999 = block_latency_log_percentile(hist, 99.9);
+    }
+}
+
+static void bdrv_latency_percentiles_stats(BlockDeviceStats *ds,
+                                           BlockLatencyLogHistogram *hists)
+{
+    bdrv_latency_percentiles(&hists[BLOCK_ACCT_READ],
+                             &ds->has_rd_latency_percentiles,
+                             &ds->rd_latency_percentiles);
+    bdrv_latency_percentiles(&hists[BLOCK_ACCT_WRITE],
+                             &ds->has_wr_latency_percentiles,
+                             &ds->wr_latency_percentiles);
+    bdrv_latency_percentiles(&hists[BLOCK_ACCT_FLUSH],
+                             &ds->has_flush_latency_percentiles,
+                             &ds->flush_latency_percentiles);
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -502,6 +536,10 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_FLUSH],
                                  &ds->has_flush_latency_histogram,
                                  &ds->flush_latency_histogram);
+
+    qemu_mutex_lock(&stats->lock);
+    bdrv_latency_percentiles_stats(ds, stats->latency_log);
+    qemu_mutex_unlock(&stats->lock);
 }
 
 static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
@@ -531,6 +569,7 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
     }
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
+    bdrv_latency_percentiles_stats(s->stats, bs->latency_log);
 
     s->driver_specific = bdrv_get_specific_stats(bs);
     if (s->driver_specific) {
@@ -26,11 +26,33 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are found through a hash table keyed by their offset,
+ * whose chains are threaded through the entries themselves.  The buckets
+ * are split into shards, each protected by a spinlock that covers the
+ * chains of its buckets as well as the reference count and the access
+ * bits of the entries hashed into them.  This is what allows
+ * qcow2_cache_lookup() to be called without s->lock.
+ *
+ * Everything else still requires s->lock: in particular only its holder
+ * may change the offset of an entry, so it can read offsets without
+ * taking any shard lock.  Entries with an offset of 0 are not hashed and
+ * are only ever touched by the holder of s->lock.
+ *
+ * Replacement uses the CLOCK algorithm: qcow2_cache_put() sets the
+ * referenced bit of an entry, and the hand clears it when it sweeps past
+ * an unused entry, evicting it on the next sweep if it has not been used
+ * in the meantime.
+ */
+#define QCOW2_CACHE_SHARDS 16
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
-    uint64_t lru_counter;
+    int      next;          /* next entry in the same bucket, or -1 */
     int      ref;
     bool     dirty;
+    bool     referenced;    /* used since the clock hand last passed */
+    bool     used;          /* used since the last qcow2_cache_clean_unused() */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -40,8 +62,10 @@ struct Qcow2Cache {
     int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
-    uint64_t                lru_counter;
-    uint64_t                cache_clean_lru_counter;
+    int                    *buckets;
+    int                     hash_bits;
+    int                     clock_hand;
+    QemuSpin                shard_lock[QCOW2_CACHE_SHARDS];
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -69,6 +93,91 @@ static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
     }
 }
 
+static inline int qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t table = offset / c->table_size;
+
+    return (table * 0x9e3779b97f4a7c15ULL) >> (64 - c->hash_bits);
+}
+
+static inline QemuSpin *qcow2_cache_bucket_lock(Qcow2Cache *c, int bucket)
+{
+    return &c->shard_lock[bucket % QCOW2_CACHE_SHARDS];
+}
+
+/* Must be called with the lock of the shard containing @offset held */
+static int qcow2_cache_hash_find(Qcow2Cache *c, int bucket, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[bucket]; i != -1; i = c->entries[i].next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Must be called with the lock of the shard containing the entry held */
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int bucket, int i)
+{
+    int *p = &c->buckets[bucket];
+
+    while (*p != i) {
+        assert(*p != -1);
+        p = &c->entries[*p].next;
+    }
+    *p = c->entries[i].next;
+    c->entries[i].next = -1;
+    c->entries[i].offset = 0;
+}
+
+/*
+ * Look up @offset and take a reference to its table if it is cached.
+ * Returns the index of the entry, or -1 on a cache miss.
+ */
+static int qcow2_cache_ref_offset(Qcow2Cache *c, uint64_t offset)
+{
+    int bucket = qcow2_cache_bucket(c, offset);
+    QemuSpin *lock = qcow2_cache_bucket_lock(c, bucket);
+    int i;
+
+    qemu_spin_lock(lock);
+    i = qcow2_cache_hash_find(c, bucket, offset);
+    if (i != -1) {
+        c->entries[i].ref++;
+    }
+    qemu_spin_unlock(lock);
+
+    return i;
+}
+
+/* Unhash entry @i unless somebody holds a reference to it */
+static bool qcow2_cache_try_unhash(Qcow2Cache *c, int i, bool if_unused)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    int bucket;
+    QemuSpin *lock;
+    bool ret = false;
+
+    if (t->offset == 0) {
+        return true;
+    }
+
+    bucket = qcow2_cache_bucket(c, t->offset);
+    lock = qcow2_cache_bucket_lock(c, bucket);
+    qemu_spin_lock(lock);
+    if (t->ref == 0 && !(if_unused && (t->dirty || t->used))) {
+        qcow2_cache_hash_remove(c, bucket, i);
+        ret = true;
+    } else if (if_unused) {
+        t->used = false;
+    }
+    qemu_spin_unlock(lock);
+
+    return ret;
+}
+
 static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 {
 /* Using MADV_DONTNEED to discard memory is a Linux-specific feature */
@@ -84,38 +193,29 @@ static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 #endif
 }
 
-static inline bool can_clean_entry(Qcow2Cache *c, int i)
-{
-    Qcow2CachedTable *t = &c->entries[i];
-    return t->ref == 0 && !t->dirty && t->offset != 0 &&
-        t->lru_counter <= c->cache_clean_lru_counter;
-}
-
 void qcow2_cache_clean_unused(Qcow2Cache *c)
 {
-    int i = 0;
-    while (i < c->size) {
-        int to_clean = 0;
-
-        /* Skip the entries that we don't need to clean */
-        while (i < c->size && !can_clean_entry(c, i)) {
-            i++;
-        }
+    int to_clean = 0;
+    int i;
 
-        /* And count how many we can clean in a row */
-        while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
-            i++;
+    for (i = 0; i < c->size; i++) {
+        /* Drop the entries that were not used since the last call */
+        if (c->entries[i].offset != 0 &&
+            qcow2_cache_try_unhash(c, i, true)) {
             to_clean++;
+            continue;
         }
 
+        /* And release the memory of each run of entries we dropped */
         if (to_clean > 0) {
             qcow2_cache_table_release(c, i - to_clean, to_clean);
+            to_clean = 0;
         }
     }
 
-    c->cache_clean_lru_counter = c->lru_counter;
+    if (to_clean > 0) {
+        qcow2_cache_table_release(c, i - to_clean, to_clean);
+    }
 }
 
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
@@ -123,6 +223,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -132,15 +233,28 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->table_size = table_size;
+    c->hash_bits = ctz64(pow2ceil(MAX(num_tables, QCOW2_CACHE_SHARDS)));
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, 1 << c->hash_bits);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].next = -1;
+    }
+    for (i = 0; i < 1 << c->hash_bits; i++) {
+        c->buckets[i] = -1;
+    }
+    for (i = 0; i < QCOW2_CACHE_SHARDS; i++) {
+        qemu_spin_init(&c->shard_lock[i]);
     }
 
     return c;
@@ -153,8 +267,12 @@ int qcow2_cache_destroy(Qcow2Cache *c)
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
     }
+    for (i = 0; i < QCOW2_CACHE_SHARDS; i++) {
+        qemu_spin_destroy(&c->shard_lock[i]);
+    }
 
     qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -304,27 +422,82 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        bool unhashed = qcow2_cache_try_unhash(c, i, false);
+        assert(unhashed);
     }
 
     qcow2_cache_table_release(c, 0, c->size);
 
-    c->lru_counter = 0;
+    c->clock_hand = 0;
 
     return 0;
 }
 
+/* Hash entry @i under @offset and take a reference to it */
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i, uint64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    int bucket = qcow2_cache_bucket(c, offset);
+    QemuSpin *lock = qcow2_cache_bucket_lock(c, bucket);
+
+    assert(t->offset == 0);
+
+    qemu_spin_lock(lock);
+    assert(qcow2_cache_hash_find(c, bucket, offset) == -1);
+    t->offset = offset;
+    t->ref = 1;
+    t->referenced = false;
+    t->used = false;
+    t->next = c->buckets[bucket];
+    c->buckets[bucket] = i;
+    qemu_spin_unlock(lock);
+}
+
+/* Advance the clock hand to an entry that can be replaced */
+static int qcow2_cache_find_victim(Qcow2Cache *c)
+{
+    int n;
+
+    /*
+     * After one full turn every referenced bit is clear, so a second one
+     * finds an entry unless all of them are in use.
+     */
+    for (n = 0; n < 2 * c->size; n++) {
+        int i = c->clock_hand;
+        Qcow2CachedTable *t = &c->entries[i];
+        QemuSpin *lock;
+        bool found;
+
+        if (++c->clock_hand == c->size) {
+            c->clock_hand = 0;
+        }
+
+        if (t->offset == 0) {
+            return i;
+        }
+
+        lock = qcow2_cache_bucket_lock(c, qcow2_cache_bucket(c, t->offset));
+        qemu_spin_lock(lock);
+        found = t->ref == 0 && !t->referenced;
+        t->referenced = false;
+        qemu_spin_unlock(lock);
+
+        if (found) {
+            return i;
+        }
+    }
+
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
+}
+
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -339,40 +512,27 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
-
-    if (min_lru_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+    i = qcow2_cache_ref_offset(c, offset);
+    if (i != -1) {
+        goto found;
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
-    trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
-                                        c == s->l2_table_cache, i);
+    do {
+        i = qcow2_cache_find_victim(c);
+        trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
+                                            c == s->l2_table_cache, i);
 
-    ret = qcow2_cache_entry_flush(bs, c, i);
-    if (ret < 0) {
-        return ret;
-    }
+        ret = qcow2_cache_entry_flush(bs, c, i);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* qcow2_cache_lookup() may have taken a reference meanwhile */
+    } while (!qcow2_cache_try_unhash(c, i, false));
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -386,11 +546,10 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i, offset);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -411,18 +570,31 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+void *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i = qcow2_cache_ref_offset(c, offset);
+
+    return i != -1 ? qcow2_cache_get_table_addr(c, i) : NULL;
+}
+
 void qcow2_cache_put(Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(c, *table);
+    Qcow2CachedTable *t = &c->entries[i];
+    QemuSpin *lock;
 
-    c->entries[i].ref--;
-    *table = NULL;
+    /* The offset cannot change while we hold a reference */
+    assert(t->offset != 0);
+    lock = qcow2_cache_bucket_lock(c, qcow2_cache_bucket(c, t->offset));
 
-    if (c->entries[i].ref == 0) {
-        c->entries[i].lru_counter = ++c->lru_counter;
-    }
+    qemu_spin_lock(lock);
+    assert(t->ref > 0);
+    t->ref--;
+    t->referenced = true;
+    t->used = true;
+    qemu_spin_unlock(lock);
 
-    assert(c->entries[i].ref >= 0);
+    *table = NULL;
 }
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
@@ -434,24 +606,23 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
+    int bucket = qcow2_cache_bucket(c, offset);
+    QemuSpin *lock = qcow2_cache_bucket_lock(c, bucket);
     int i;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
-    }
-    return NULL;
+    qemu_spin_lock(lock);
+    i = qcow2_cache_hash_find(c, bucket, offset);
+    qemu_spin_unlock(lock);
+
+    return i != -1 ? qcow2_cache_get_table_addr(c, i) : NULL;
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
+    bool unhashed = qcow2_cache_try_unhash(c, i, false);
 
-    assert(c->entries[i].ref == 0);
-
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    assert(unhashed);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
@@ -0,0 +1,334 @@
+/*
+ * Map of the backing chain layers that own the clusters of a qcow2 image
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Reading a cluster that is unallocated in a qcow2 image goes to the backing
+ * file, which looks the cluster up in its own L2 table and possibly defers to
+ * its own backing file, and so on.  With chains that are dozens of images
+ * deep, every such read turns into dozens of nested requests and L2 lookups.
+ *
+ * The chain map remembers, for every cluster of the top image, the depth of
+ * the layer that owns it, as found by bdrv_co_common_block_status_above().
+ * Later reads of the cluster go to that layer directly.  The map is filled
+ * lazily while reading and only for clusters that belong to a single layer
+ * as a whole.
+ *
+ * Writes to the top image do not affect the map: it is only consulted for
+ * clusters that are unallocated in the top image.  Any write to a lower layer
+ * and any change to the block graph make the whole map invalid; this is
+ * detected by comparing the graph generation and the write generation of
+ * every layer with the values the map was built for.
+ *
+ * Reading from the owning layer directly skips all layers in between, so
+ * the map is only used if all of them are plain qcow2 or raw format nodes.
+ * Filters like throttle or copy-on-read must see every request.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "block/coroutines.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/* Entries of the map */
+#define QCOW2_CHAIN_MAP_UNKNOWN 0
+/* 1 .. QCOW2_CHAIN_MAP_MAX_DEPTH: depth of the owning layer */
+#define QCOW2_CHAIN_MAP_MAX_DEPTH 254
+/* No layer owns the cluster, it reads as zeroes */
+#define QCOW2_CHAIN_MAP_NONE 255
+
+/* Shallow chains are fast enough without the map */
+#define QCOW2_CHAIN_MAP_MIN_DEPTH 8
+
+/* The map is allocated in pages of 4096 entries */
+#define QCOW2_CHAIN_MAP_PAGE_BITS 12
+#define QCOW2_CHAIN_MAP_PAGE_SIZE (1 << QCOW2_CHAIN_MAP_PAGE_BITS)
+
+struct Qcow2ChainMap {
+    /* Value of BDRVQcow2State.chain_map_epoch when the map was created */
+    uint64_t epoch;
+    /* State of the backing chain the map was built for */
+    unsigned int graph_gen;
+    int depth;
+    unsigned int *write_gens;
+
+    uint64_t nb_pages;
+    uint8_t **pages;
+};
+
+/* The depth of the backing chain below @bs */
+static int qcow2_chain_map_depth(BlockDriverState *bs)
+{
+    BlockDriverState *p;
+    int depth = 0;
+
+    for (p = bdrv_filter_or_cow_bs(bs); p; p = bdrv_filter_or_cow_bs(p)) {
+        depth++;
+    }
+
+    return depth;
+}
+
+/* Whether the backing chain of @bs is still the one @map was built for */
+static bool qcow2_chain_map_is_current(BlockDriverState *bs,
+                                       Qcow2ChainMap *map)
+{
+    BlockDriverState *p;
+    int i = 0;
+
+    if (map->graph_gen != bdrv_get_graph_generation()) {
+        return false;
+    }
+
+    for (p = bdrv_filter_or_cow_bs(bs); p; p = bdrv_filter_or_cow_bs(p)) {
+        if (i >= map->depth ||
+            map->write_gens[i] != qatomic_read(&p->write_gen))
+        {
+            return false;
+        }
+        i++;
+    }
+
+    return i == map->depth;
+}
+
+/* Whether all layers below @bs may be skipped when reading */
+static bool qcow2_chain_map_chain_is_plain(BlockDriverState *bs)
+{
+    BlockDriverState *p;
+
+    for (p = bdrv_filter_or_cow_bs(bs); p; p = bdrv_filter_or_cow_bs(p)) {
+        if (p->drv != &bdrv_qcow2 && p->drv != &bdrv_raw) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void qcow2_chain_map_free(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ChainMap *map = s->chain_map;
+    uint64_t i;
+
+    if (!map) {
+        return;
+    }
+
+    for (i = 0; i < map->nb_pages; i++) {
+        g_free(map->pages[i]);
+    }
+    g_free(map->pages);
+    g_free(map->write_gens);
+    g_free(map);
+    s->chain_map = NULL;
+}
+
+/*
+ * Make sure s->chain_map is valid for the current backing chain, creating
+ * an empty one if needed.  Return false if the map should not be used.
+ */
+static bool qcow2_chain_map_check(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_clusters = DIV_ROUND_UP(bs->total_sectors * BDRV_SECTOR_SIZE,
+                                        s->cluster_size);
+    uint64_t nb_pages = DIV_ROUND_UP(nb_clusters, QCOW2_CHAIN_MAP_PAGE_SIZE);
+    BlockDriverState *p;
+    int depth, i;
+
+    depth = qcow2_chain_map_depth(bs);
+    if (depth < QCOW2_CHAIN_MAP_MIN_DEPTH ||
+        depth > QCOW2_CHAIN_MAP_MAX_DEPTH ||
+        !qcow2_chain_map_chain_is_plain(bs))
+    {
+        qcow2_chain_map_free(bs);
+        return false;
+    }
+
+    if (s->chain_map && s->chain_map->nb_pages == nb_pages &&
+        qcow2_chain_map_is_current(bs, s->chain_map))
+    {
+        return true;
+    }
+
+    qcow2_chain_map_free(bs);
+    s->chain_map = g_new(Qcow2ChainMap, 1);
+    *s->chain_map = (Qcow2ChainMap) {
+        .epoch      = ++s->chain_map_epoch,
+        .graph_gen  = bdrv_get_graph_generation(),
+        .depth      = depth,
+        .write_gens = g_new(unsigned int, depth),
+        .nb_pages   = nb_pages,
+        .pages      = g_new0(uint8_t *, nb_pages),
+    };
+
+    i = 0;
+    for (p = bdrv_filter_or_cow_bs(bs); p; p = bdrv_filter_or_cow_bs(p)) {
+        s->chain_map->write_gens[i++] = qatomic_read(&p->write_gen);
+    }
+    trace_qcow2_chain_map_reset(bs, depth);
+
+    return true;
+}
+
+static uint8_t qcow2_chain_map_get(Qcow2ChainMap *map, uint64_t cluster)
+{
+    uint64_t page = cluster >> QCOW2_CHAIN_MAP_PAGE_BITS;
+
+    if (page >= map->nb_pages || !map->pages[page]) {
+        return QCOW2_CHAIN_MAP_UNKNOWN;
+    }
+    return map->pages[page][cluster & (QCOW2_CHAIN_MAP_PAGE_SIZE - 1)];
+}
+
+static void qcow2_chain_map_set(Qcow2ChainMap *map, uint64_t cluster,
+                                uint64_t nb_clusters, uint8_t entry)
+{
+    while (nb_clusters) {
+        uint64_t page = cluster >> QCOW2_CHAIN_MAP_PAGE_BITS;
+        uint64_t index = cluster & (QCOW2_CHAIN_MAP_PAGE_SIZE - 1);
+        uint64_t n = MIN(nb_clusters, QCOW2_CHAIN_MAP_PAGE_SIZE - index);
+
+        if (page >= map->nb_pages) {
+            return;
+        }
+        if (!map->pages[page]) {
+            map->pages[page] = g_malloc0(QCOW2_CHAIN_MAP_PAGE_SIZE);
+        }
+        memset(map->pages[page] + index, entry, n);
+
+        cluster += n;
+        nb_clusters -= n;
+    }
+}
+
+/*
+ * Find the layer that owns the data at @offset and reduce *bytes so that
+ * [@offset, @offset + *bytes) belongs to that layer as a whole.
+ *
+ * Returns the depth of the layer, 1 being the backing file of @bs, or
+ * 0 if no layer owns the data, or -errno.
+ */
+static int coroutine_fn qcow2_chain_map_find(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t *bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster = offset >> s->cluster_bits;
+    uint64_t end = offset + *bytes;
+    uint64_t epoch = s->chain_map->epoch;
+    uint64_t first, last, run_end;
+    int64_t pnum;
+    uint8_t entry;
+    int depth;
+    int ret;
+
+    entry = qcow2_chain_map_get(s->chain_map, cluster);
+    if (entry != QCOW2_CHAIN_MAP_UNKNOWN) {
+        run_end = (cluster + 1) << s->cluster_bits;
+        while (run_end < end &&
+               qcow2_chain_map_get(s->chain_map,
+                                   run_end >> s->cluster_bits) == entry)
+        {
+            run_end += s->cluster_size;
+        }
+        *bytes = MIN(end, run_end) - offset;
+        return entry == QCOW2_CHAIN_MAP_NONE ? 0 : entry;
+    }
+
+    ret = bdrv_co_common_block_status_above(bdrv_filter_or_cow_bs(bs), NULL,
+                                            false, false, offset, *bytes,
+                                            &pnum, NULL, NULL, &depth);
+    if (ret < 0) {
+        return ret;
+    }
+    if (pnum == 0) {
+        /* Beyond the end of the backing file, which reads as zeroes */
+        return 1;
+    }
+    if (!(ret & BDRV_BLOCK_ALLOCATED)) {
+        depth = 0;
+    }
+    *bytes = pnum;
+
+    /*
+     * Only record clusters that are covered as a whole, and only if the
+     * chain did not change while we were waiting for the block status.
+     */
+    if (!s->chain_map || s->chain_map->epoch != epoch ||
+        !qcow2_chain_map_is_current(bs, s->chain_map))
+    {
+        return depth;
+    }
+
+    first = DIV_ROUND_UP(offset, s->cluster_size);
+    last = (offset + pnum) >> s->cluster_bits;
+    if (last > first) {
+        qcow2_chain_map_set(s->chain_map, first, last - first,
+                            depth ? depth : QCOW2_CHAIN_MAP_NONE);
+    }
+
+    return depth;
+}
+
+/* The child through which the layer at @depth below @bs is read */
+static BdrvChild *qcow2_chain_map_child(BlockDriverState *bs, int depth)
+{
+    BdrvChild *child = bdrv_filter_or_cow_child(bs);
+
+    while (--depth > 0) {
+        child = bdrv_filter_or_cow_child(child->bs);
+    }
+
+    return child;
+}
+
+/*
+ * Read data that is unallocated in @bs from the backing chain, going to the
+ * owning layers directly if the chain is deep enough for this to pay off.
+ */
+int coroutine_fn qcow2_co_read_backing(BlockDriverState *bs,
+                                       uint64_t offset, uint64_t bytes,
+                                       QEMUIOVector *qiov, size_t qiov_offset)
+{
+    int ret;
+
+    while (bytes) {
+        uint64_t cur_bytes = bytes;
+        int depth;
+
+        if (!qcow2_chain_map_check(bs)) {
+            return bdrv_co_preadv_part(bs->backing, offset, bytes,
+                                       qiov, qiov_offset, 0);
+        }
+
+        depth = qcow2_chain_map_find(bs, offset, &cur_bytes);
+        if (depth < 0) {
+            /* Let the normal read path report the error, if any */
+            return bdrv_co_preadv_part(bs->backing, offset, bytes,
+                                       qiov, qiov_offset, 0);
+        }
+
+        trace_qcow2_chain_map_read(bs, offset, cur_bytes, depth);
+        if (depth == 0) {
+            qemu_iovec_memset(qiov, qiov_offset, 0, cur_bytes);
+        } else {
+            ret = bdrv_co_preadv_part(qcow2_chain_map_child(bs, depth),
+                                      offset, cur_bytes, qiov, qiov_offset, 0);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        offset += cur_bytes;
+        bytes -= cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    return 0;
+}
@@ -28,6 +28,7 @@
 #include "qapi/error.h"
 #include "qcow2.h"
 #include "qemu/bswap.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 
 int qcow2_shrink_l1_table(BlockDriverState *bs, uint64_t exact_size)
@@ -80,12 +81,24 @@ fail:
     return ret;
 }
 
+typedef struct Qcow2OldL1Table {
+    struct rcu_head rcu;
+    uint64_t *l1_table;
+} Qcow2OldL1Table;
+
+static void qcow2_free_old_l1_table(Qcow2OldL1Table *old)
+{
+    qemu_vfree(old->l1_table);
+    g_free(old);
+}
+
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size)
 {
     BDRVQcow2State *s = bs->opaque;
     int new_l1_size2, ret, i;
     uint64_t *new_l1_table;
+    Qcow2OldL1Table *old;
     int64_t old_l1_table_offset, old_l1_size;
     int64_t new_l1_table_offset, new_l1_size;
     uint8_t data[12];
@@ -174,12 +187,19 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     if (ret < 0) {
         goto fail;
     }
-    qemu_vfree(s->l1_table);
+
+    /*
+     * qcow2_get_host_offset_lockless() may still be reading the old table,
+     * and must not see the new size before the new table.
+     */
+    old = g_new(Qcow2OldL1Table, 1);
+    old->l1_table = s->l1_table;
     old_l1_table_offset = s->l1_table_offset;
     s->l1_table_offset = new_l1_table_offset;
-    s->l1_table = new_l1_table;
+    qatomic_rcu_set(&s->l1_table, new_l1_table);
     old_l1_size = s->l1_size;
-    s->l1_size = new_l1_size;
+    qatomic_store_release(&s->l1_size, new_l1_size);
+    call_rcu(old, qcow2_free_old_l1_table, rcu);
     qcow2_free_clusters(bs, old_l1_table_offset, old_l1_size * L1E_SIZE,
                         QCOW2_DISCARD_OTHER);
     return 0;
@@ -353,7 +373,8 @@ static int l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* update the L1 entry */
     trace_qcow2_l2_allocate_write_l1(bs, l1_index);
-    s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
+    qcow2_set_table_entry(&s->l1_table[l1_index],
+                          l2_offset | QCOW_OFLAG_COPIED);
     ret = qcow2_write_l1_entry(bs, l1_index);
     if (ret < 0) {
         goto fail;
@@ -367,7 +388,7 @@ fail:
     if (l2_slice != NULL) {
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
     }
-    s->l1_table[l1_index] = old_l2_offset;
+    qcow2_set_table_entry(&s->l1_table[l1_index], old_l2_offset);
     if (l2_offset > 0) {
         qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
@@ -728,6 +749,128 @@ fail:
     return ret;
 }
 
+/*
+ * qcow2_get_host_offset_lockless
+ *
+ * Like qcow2_get_host_offset(), but for the lockless data path: this may
+ * be called without s->lock and only maps clusters that are already
+ * allocated (QCOW2_SUBCLUSTER_NORMAL).  If @write is true, the clusters
+ * must also have QCOW_OFLAG_COPIED set, so that they can be overwritten
+ * in place, and must not overlap with metadata.
+ *
+ * This neither does I/O nor yields: the L2 slice must already be in the
+ * cache.  The L1 table is read under RCU because another thread may grow
+ * it, and the L2 slice is pinned by its cache reference.
+ *
+ * On success, *bytes is reduced to the number of bytes that are stored
+ * contiguously in the image file starting at *host_offset.
+ *
+ * L1 and L2 entries are read with atomic 64-bit loads, as the holder of
+ * s->lock may update them at the same time.  Hosts without 64-bit atomics
+ * always take the locked path.
+ *
+ * Returns 0 on success, or -EAGAIN if the caller must fall back to
+ * taking s->lock.  Corruptions are left for the locked path to report.
+ */
+#ifdef CONFIG_ATOMIC64
+static uint64_t get_l2_entry_lockless(BDRVQcow2State *s, uint64_t *l2_slice,
+                                      int idx)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(qatomic_read__nocheck(&l2_slice[idx]));
+}
+
+int qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                                   unsigned int *bytes, uint64_t *host_offset,
+                                   bool write)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned int offset_in_cluster = offset_into_cluster(s, offset);
+    uint64_t l1_index, l2_offset, *l1_table, *l2_slice;
+    uint64_t host_cluster_offset = 0;
+    int l1_size, l2_index, start_of_slice, nb_clusters, i;
+
+    if (!s->lockless_data_path || has_subclusters(s)) {
+        return -EAGAIN;
+    }
+    if (write && !has_data_file(bs) &&
+        (s->overlap_check & ~QCOW2_OL_CONSTANT)) {
+        /* The other checks look at tables that may change under us */
+        return -EAGAIN;
+    }
+
+    l1_index = offset_to_l1_index(s, offset);
+    WITH_RCU_READ_LOCK_GUARD() {
+        l1_size = qatomic_load_acquire(&s->l1_size);
+        l1_table = qatomic_rcu_read(&s->l1_table);
+        if (l1_index >= l1_size) {
+            return -EAGAIN;
+        }
+        l2_offset = qatomic_read__nocheck(&l1_table[l1_index]) &
+                    L1E_OFFSET_MASK;
+    }
+
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return -EAGAIN;
+    }
+
+    l2_index = offset_to_l2_slice_index(s, offset);
+    start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - l2_index);
+    l2_slice = qcow2_cache_lookup(s->l2_table_cache,
+                                  l2_offset + start_of_slice);
+    if (!l2_slice) {
+        return -EAGAIN;
+    }
+
+    nb_clusters = MIN(size_to_clusters(s, (uint64_t) *bytes +
+                                          offset_in_cluster),
+                      s->l2_slice_size - l2_index);
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry_lockless(s, l2_slice, l2_index + i);
+        uint64_t cluster_offset = l2_entry & L2E_OFFSET_MASK;
+
+        if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL ||
+            (write && !(l2_entry & QCOW_OFLAG_COPIED))) {
+            break;
+        }
+        if (i == 0) {
+            host_cluster_offset = cluster_offset;
+        } else if (cluster_offset !=
+                   host_cluster_offset + ((uint64_t) i << s->cluster_bits)) {
+            break;
+        }
+    }
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    if (i == 0 || offset_into_cluster(s, host_cluster_offset)) {
+        return -EAGAIN;
+    }
+    if (has_data_file(bs) &&
+        host_cluster_offset != offset - offset_in_cluster) {
+        return -EAGAIN;
+    }
+
+    *bytes = MIN(*bytes, ((uint64_t) i << s->cluster_bits) -
+                         offset_in_cluster);
+    *host_offset = host_cluster_offset + offset_in_cluster;
+
+    if (write && !has_data_file(bs) &&
+        qcow2_check_metadata_overlap(bs, 0, *host_offset, *bytes) != 0) {
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+#else
+int qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                                   unsigned int *bytes, uint64_t *host_offset,
+                                   bool write)
+{
+    return -EAGAIN;
+}
+#endif
+
 /*
  * get_cluster_table
  *
@@ -927,7 +1070,11 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m)
     /* First we read the existing data from both COW regions. We
      * either read the whole region in one go, or the start and end
      * regions separately. */
-    if (merge_reads) {
+    if (m->cow_is_zero) {
+        /* Nothing to read, the regions are not allocated anywhere */
+        memset(start_buffer, 0, buffer_size);
+        ret = 0;
+    } else if (merge_reads) {
         qemu_iovec_add(&qiov, start_buffer, buffer_size);
         ret = do_perform_cow_read(bs, m->offset, start->offset, &qiov);
     } else {
@@ -1400,6 +1547,17 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
 
         if (end <= old_start || start >= old_end) {
             /* No intersection */
+        } else if (old_alloc->keep_old_clusters &&
+                   (end <= l2meta_cow_start(old_alloc) ||
+                    start >= l2meta_cow_end(old_alloc)))
+        {
+            /*
+             * The clusters intersect, but the request doesn't touch the
+             * subclusters that the running allocation writes to (including
+             * its COW regions).  As that allocation keeps its host cluster,
+             * both requests can proceed in parallel; the L2 bitmap update
+             * happens under s->lock anyway.
+             */
         } else {
             if (start < old_start) {
                 /* Stop at the start of a running allocation */
@@ -697,6 +697,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_LOCKLESS_DATA_PATH,
     NULL
 };
 
@@ -808,6 +809,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_LOCKLESS_DATA_PATH,
+            .type = QEMU_OPT_BOOL,
+            .help = "Map requests to allocated clusters without taking "
+                    "the image lock when their L2 table is cached",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -969,6 +976,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    bool lockless_data_path;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1139,6 +1147,9 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     r->discard_passthrough[QCOW2_DISCARD_OTHER] =
         qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
+    r->lockless_data_path =
+        qemu_opt_get_bool(opts, QCOW2_OPT_LOCKLESS_DATA_PATH, false);
+
     switch (s->crypt_method_header) {
     case QCOW_CRYPT_NONE:
         if (encryptfmt) {
@@ -1214,6 +1225,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
+    s->lockless_data_path = r->lockless_data_path;
 
     for (i = 0; i < QCOW2_DISCARD_MAX; i++) {
         s->discard_passthrough[i] = r->discard_passthrough[i];
@@ -2246,8 +2258,7 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
         assert(bs->backing); /* otherwise handled in qcow2_co_preadv_part */
 
         BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-        return bdrv_co_preadv_part(bs->backing, offset, bytes,
-                                   qiov, qiov_offset, 0);
+        return qcow2_co_read_backing(bs, offset, bytes, qiov, qiov_offset);
 
     case QCOW2_SUBCLUSTER_COMPRESSED:
         return qcow2_co_preadv_compressed(bs, host_offset,
@@ -2301,12 +2312,18 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
-        if (ret < 0) {
-            goto out;
+        ret = qcow2_get_host_offset_lockless(bs, offset, &cur_bytes,
+                                             &host_offset, false);
+        if (ret == 0) {
+            type = QCOW2_SUBCLUSTER_NORMAL;
+        } else {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto out;
+            }
         }
 
         if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
@@ -2426,12 +2443,17 @@ static int handle_alloc_space(BlockDriverState *bs, QCowL2Meta *l2meta)
 {
     BDRVQcow2State *s = bs->opaque;
     QCowL2Meta *m;
+    bool can_write_zeroes =
+        (s->data_file->bs->supported_zero_flags & BDRV_REQ_NO_FALLBACK) &&
+        !bs->encrypted;
 
-    if (!(s->data_file->bs->supported_zero_flags & BDRV_REQ_NO_FALLBACK)) {
-        return 0;
-    }
-
-    if (bs->encrypted) {
+    /*
+     * Without a backing file, is_zero_cow() only looks at the L2 entries of
+     * this image.  With one, it queries the whole backing chain, which
+     * costs about as much as reading the COW regions through it, so it only
+     * pays off if the regions can then be zeroed efficiently.
+     */
+    if (!can_write_zeroes && bs->backing) {
         return 0;
     }
 
@@ -2452,6 +2474,12 @@ static int handle_alloc_space(BlockDriverState *bs, QCowL2Meta *l2meta)
             continue;
         }
 
+        /* Even if we have to write the COW regions, we needn't read them */
+        m->cow_is_zero = true;
+        if (!can_write_zeroes) {
+            continue;
+        }
+
         /*
          * instead of writing zero COW buffers,
          * efficiently zero out the whole clusters
@@ -2539,6 +2567,11 @@ static coroutine_fn int qcow2_co_pwritev_task(BlockDriverState *bs,
         }
     }
 
+    /* Overwriting allocated clusters needs no metadata update */
+    if (!l2meta) {
+        goto out;
+    }
+
     qemu_co_mutex_lock(&s->lock);
 
     ret = qcow2_handle_l2meta(bs, &l2meta, true);
@@ -2551,6 +2584,7 @@ out_locked:
     qcow2_handle_l2meta(bs, &l2meta, false);
     qemu_co_mutex_unlock(&s->lock);
 
+out:
     qemu_vfree(crypt_buf);
 
     return ret;
@@ -2594,21 +2628,25 @@ static coroutine_fn int qcow2_co_pwritev_part(
                             - offset_in_cluster);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-
-        ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
-                                      &host_offset, &l2meta);
+        ret = qcow2_get_host_offset_lockless(bs, offset, &cur_bytes,
+                                             &host_offset, true);
         if (ret < 0) {
-            goto out_locked;
-        }
+            qemu_co_mutex_lock(&s->lock);
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, host_offset,
-                                            cur_bytes, true);
-        if (ret < 0) {
-            goto out_locked;
-        }
+            ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
+                                          &host_offset, &l2meta);
+            if (ret < 0) {
+                goto out_locked;
+            }
 
-        qemu_co_mutex_unlock(&s->lock);
+            ret = qcow2_pre_write_overlap_check(bs, 0, host_offset,
+                                                cur_bytes, true);
+            if (ret < 0) {
+                goto out_locked;
+            }
+
+            qemu_co_mutex_unlock(&s->lock);
+        }
 
         if (!aio && cur_bytes != bytes) {
             aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
@@ -2618,7 +2656,7 @@ static coroutine_fn int qcow2_co_pwritev_part(
                              cur_bytes, qiov, qiov_offset, l2meta);
         l2meta = NULL; /* l2meta is consumed by qcow2_co_pwritev_task() */
         if (ret < 0) {
-            goto fail_nometa;
+            goto out_nometa;
         }
 
         bytes -= cur_bytes;
@@ -2627,15 +2665,14 @@ static coroutine_fn int qcow2_co_pwritev_part(
         trace_qcow2_writev_done_part(qemu_coroutine_self(), cur_bytes);
     }
     ret = 0;
-
-    qemu_co_mutex_lock(&s->lock);
+    goto out_nometa;
 
 out_locked:
     qcow2_handle_l2meta(bs, &l2meta, false);
 
     qemu_co_mutex_unlock(&s->lock);
 
-fail_nometa:
+out_nometa:
     if (aio) {
         aio_task_pool_wait_all(aio);
         if (ret == 0) {
@@ -2698,6 +2735,7 @@ static void qcow2_close(BlockDriverState *bs)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_chain_map_free(bs);
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
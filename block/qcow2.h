@@ -150,6 +150,7 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_LOCKLESS_DATA_PATH "lockless-data-path"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -230,6 +231,7 @@ typedef struct QCowSnapshot {
 
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
+typedef struct Qcow2ChainMap Qcow2ChainMap;
 
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
@@ -323,6 +325,7 @@ typedef struct Qcow2BitmapHeaderExt {
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
 #define QCOW2_MAX_THREADS 4
+#define QCOW2_MAX_COMPRESS_THREADS 16
 
 typedef struct BDRVQcow2State {
     int cluster_bits;
@@ -387,6 +390,8 @@ typedef struct BDRVQcow2State {
     bool discard_passthrough[QCOW2_DISCARD_MAX];
 
     int overlap_check; /* bitmask of Qcow2MetadataOverlap values */
+    /* Map requests to allocated clusters without s->lock if possible */
+    bool lockless_data_path;
     bool signaled_corruption;
 
     uint64_t incompatible_features;
@@ -420,6 +425,11 @@ typedef struct BDRVQcow2State {
      * is to convert the image with the desired compression type set.
      */
     Qcow2CompressionType compression_type;
+
+    /* Backing layer owning each cluster, see qcow2-chain-map.c */
+    Qcow2ChainMap *chain_map;
+    /* Number of chain maps created so far */
+    uint64_t chain_map_epoch;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -478,6 +488,13 @@ typedef struct QCowL2Meta
      */
     bool skip_cow;
 
+    /**
+     * Indicates that the COW regions are known to read as zeroes (e.g.
+     * because they are unallocated in the whole backing chain), so they
+     * don't have to be read before being written.
+     */
+    bool cow_is_zero;
+
     /**
      * Indicates that this is not a normal write request but a preallocation.
      * If the image has extended L2 entries this means that no new individual
@@ -622,11 +639,25 @@ static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
     }
 }
 
+/*
+ * Store an L1 or L2 entry that qcow2_get_host_offset_lockless() may read
+ * at the same time.  Without 64-bit atomics, that function always falls
+ * back to s->lock.
+ */
+static inline void qcow2_set_table_entry(uint64_t *entry, uint64_t val)
+{
+#ifdef CONFIG_ATOMIC64
+    qatomic_set__nocheck(entry, val);
+#else
+    *entry = val;
+#endif
+}
+
 static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
                                 int idx, uint64_t entry)
 {
     idx *= l2_entry_size(s) / sizeof(uint64_t);
-    l2_slice[idx] = cpu_to_be64(entry);
+    qcow2_set_table_entry(&l2_slice[idx], cpu_to_be64(entry));
 }
 
 static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
@@ -907,6 +938,9 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
 int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                           unsigned int *bytes, uint64_t *host_offset,
                           QCow2SubclusterType *subcluster_type);
+int qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                                   unsigned int *bytes, uint64_t *host_offset,
+                                   bool write);
 int qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                             unsigned int *bytes, uint64_t *host_offset,
                             QCowL2Meta **m);
@@ -970,10 +1004,22 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+/*
+ * Like qcow2_cache_get(), but only returns tables that are already cached
+ * (NULL otherwise) and does not need s->lock.  The caller is responsible
+ * for not racing with updates to the table contents.
+ */
+void *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+/* qcow2-chain-map.c functions */
+void qcow2_chain_map_free(BlockDriverState *bs);
+int coroutine_fn qcow2_co_read_backing(BlockDriverState *bs,
+                                       uint64_t offset, uint64_t bytes,
+                                       QEMUIOVector *qiov, size_t qiov_offset);
+
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                   void **refcount_table,
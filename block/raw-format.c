@@ -568,6 +568,23 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
                                  read_flags, write_flags);
 }
 
+static int coroutine_fn raw_co_sendfile(BlockDriverState *bs,
+                                        int64_t offset, int64_t bytes,
+                                        QIOChannelSocket *sioc,
+                                        const void *header,
+                                        size_t header_len)
+{
+    uint64_t file_offset = offset;
+    int ret;
+
+    ret = raw_adjust_offset(bs, &file_offset, bytes, false);
+    if (ret) {
+        return ret;
+    }
+    return bdrv_co_sendfile(bs->file, file_offset, bytes, sioc,
+                            header, header_len);
+}
+
 static const char *const raw_strong_runtime_opts[] = {
     "offset",
     "size",
@@ -597,6 +614,7 @@ BlockDriver bdrv_raw = {
     .bdrv_co_block_status = &raw_co_block_status,
     .bdrv_co_copy_range_from = &raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = &raw_co_copy_range_to,
+    .bdrv_co_sendfile     = &raw_co_sendfile,
     .bdrv_co_truncate     = &raw_co_truncate,
     .bdrv_getlength       = &raw_getlength,
     .is_format            = true,
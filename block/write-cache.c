@@ -0,0 +1,686 @@
+/*
+ * write-cache block driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The driver keeps written data in memory and completes write requests
+ * immediately.  Cached data is kept in extents, ranges of the image that
+ * do not overlap each other; a write that overlaps or touches an extent
+ * is merged into it, so that many small sequential writes reach the child
+ * as few large ones.
+ *
+ * Extents are written back to the child in least recently written order
+ * when more than max-dirty bytes are cached, and all of them on flush.
+ * Reads are served from memory if the whole range is cached; otherwise
+ * the cached part is written back first and the child is read.  Requests
+ * that are not worth caching (FUA, zero writes, discards and writes larger
+ * than max-extent) write back the range they touch and go to the child.
+ *
+ * Until it is flushed, cached data is lost if QEMU exits abnormally, just
+ * like data in a volatile disk cache.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/interval-tree.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+typedef struct WriteCacheOpts {
+    uint64_t max_dirty;
+    uint64_t max_extent;
+} WriteCacheOpts;
+
+typedef struct WriteCacheExtent {
+    IntervalTreeNode node;
+    uint8_t *buf;
+    uint64_t capacity;
+
+    /* Being written back; the extent must not change until this is done */
+    bool writing;
+
+    /* In BDRVWriteCacheState.lru, unless @writing */
+    QTAILQ_ENTRY(WriteCacheExtent) next;
+} WriteCacheExtent;
+
+typedef struct BDRVWriteCacheState {
+    WriteCacheOpts opts;
+
+    /* All extents; they never overlap */
+    IntervalTreeRoot extents;
+
+    /* Extents that are not being written back, least recently written first */
+    QTAILQ_HEAD(, WriteCacheExtent) lru;
+
+    /* Sum of the lengths of all extents */
+    uint64_t dirty_bytes;
+
+    /*
+     * Highest end of an extent since the last truncate.  Data up to here
+     * is either cached or was written to the child, so this is a lower
+     * bound for the length of the image.
+     */
+    uint64_t cached_end;
+
+    /* Woken whenever a write back finishes */
+    CoQueue writeback_queue;
+
+    uint64_t cached_writes;
+    uint64_t coalesced_writes;
+    uint64_t direct_writes;
+    uint64_t read_hits;
+    uint64_t read_misses;
+    uint64_t writebacks;
+    uint64_t writeback_bytes;
+} BDRVWriteCacheState;
+
+#define WRITE_CACHE_OPT_MAX_DIRTY "max-dirty"
+#define WRITE_CACHE_OPT_MAX_EXTENT "max-extent"
+static QemuOptsList runtime_opts = {
+    .name = "write-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = WRITE_CACHE_OPT_MAX_DIRTY,
+            .type = QEMU_OPT_SIZE,
+            .help = "how much data to keep in memory at most, default 64M",
+        },
+        {
+            .name = WRITE_CACHE_OPT_MAX_EXTENT,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the largest request written back at once, "
+                "default 1M",
+        },
+        { /* end of list */ }
+    },
+};
+
+static bool write_cache_absorb_opts(WriteCacheOpts *dest, QDict *options,
+                                    Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return false;
+    }
+
+    dest->max_dirty =
+        qemu_opt_get_size(opts, WRITE_CACHE_OPT_MAX_DIRTY, 64 * MiB);
+    dest->max_extent =
+        qemu_opt_get_size(opts, WRITE_CACHE_OPT_MAX_EXTENT, 1 * MiB);
+
+    qemu_opts_del(opts);
+
+    if (dest->max_extent == 0 || dest->max_extent > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, "max-extent parameter of write-cache must be "
+                   "between 1 and %" PRIu64, (uint64_t)BDRV_REQUEST_MAX_BYTES);
+        return false;
+    }
+
+    if (dest->max_dirty < dest->max_extent) {
+        error_setg(errp, "max-dirty parameter of write-cache must not be "
+                   "smaller than max-extent");
+        return false;
+    }
+
+    return true;
+}
+
+static int write_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                            Error **errp)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_DATA | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    if (!write_cache_absorb_opts(&s->opts, options, errp)) {
+        return -EINVAL;
+    }
+
+    QTAILQ_INIT(&s->lru);
+    qemu_co_queue_init(&s->writeback_queue);
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+/* Drop @ext from the cache; the caller must have taken it off the LRU list */
+static void write_cache_free_extent(BDRVWriteCacheState *s,
+                                    WriteCacheExtent *ext)
+{
+    assert(!ext->writing);
+
+    interval_tree_remove(&s->extents, &ext->node);
+    s->dirty_bytes -= ext->node.end - ext->node.start;
+
+    g_free(ext->buf);
+    g_free(ext);
+}
+
+static void write_cache_close(BlockDriverState *bs)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    IntervalTreeNode *node;
+    WriteCacheExtent *ext;
+
+    /*
+     * bdrv_close() has drained @bs, so no write back is in flight, and it
+     * has flushed, so anything left over could not be written back.
+     */
+    if (s->dirty_bytes) {
+        error_report("write-cache: losing %" PRIu64 " bytes of written data "
+                     "that could not be written back to '%s'",
+                     s->dirty_bytes, bdrv_get_node_name(bs->file->bs));
+    }
+
+    while ((node = interval_tree_find(&s->extents, 0, UINT64_MAX,
+                                      NULL, NULL))) {
+        ext = container_of(node, WriteCacheExtent, node);
+        assert(!ext->writing);
+        QTAILQ_REMOVE(&s->lru, ext, next);
+        write_cache_free_extent(s, ext);
+    }
+    assert(s->dirty_bytes == 0);
+}
+
+/*
+ * Inactivation is preceded by a flush.  If that could not write back all
+ * data, the destination of a migration would not see it, so refuse.
+ */
+static int write_cache_inactivate(BlockDriverState *bs)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+
+    if (s->dirty_bytes) {
+        error_report("write-cache: %" PRIu64 " bytes of written data could "
+                     "not be written back to '%s'",
+                     s->dirty_bytes, bdrv_get_node_name(bs->file->bs));
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int write_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                      BlockReopenQueue *queue, Error **errp)
+{
+    WriteCacheOpts *opts = g_new0(WriteCacheOpts, 1);
+
+    if (!write_cache_absorb_opts(opts, reopen_state->options, errp)) {
+        g_free(opts);
+        return -EINVAL;
+    }
+
+    reopen_state->opaque = opts;
+
+    return 0;
+}
+
+/*
+ * Extents larger than the new max-extent stay as they are; they are only
+ * written back, never grown further.
+ */
+static void write_cache_reopen_commit(BDRVReopenState *state)
+{
+    BDRVWriteCacheState *s = state->bs->opaque;
+
+    s->opts = *(WriteCacheOpts *)state->opaque;
+
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static void write_cache_reopen_abort(BDRVReopenState *state)
+{
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static bool extent_is_writing(IntervalTreeNode *node, void *opaque)
+{
+    return container_of(node, WriteCacheExtent, node)->writing;
+}
+
+static bool extent_is_idle(IntervalTreeNode *node, void *opaque)
+{
+    return !container_of(node, WriteCacheExtent, node)->writing;
+}
+
+static WriteCacheExtent *write_cache_find(BDRVWriteCacheState *s,
+                                          uint64_t start, uint64_t end,
+                                          IntervalTreeMatchFunc *match)
+{
+    IntervalTreeNode *node = interval_tree_find(&s->extents, start, end,
+                                                match, NULL);
+
+    return node ? container_of(node, WriteCacheExtent, node) : NULL;
+}
+
+/*
+ * Write @ext to the child and drop it from the cache.  On failure, the
+ * extent stays cached and will be retried on the next flush.
+ */
+static int coroutine_fn write_cache_writeback(BlockDriverState *bs,
+                                              WriteCacheExtent *ext)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    uint64_t bytes = ext->node.end - ext->node.start;
+    int ret;
+
+    assert(!ext->writing);
+    ext->writing = true;
+    QTAILQ_REMOVE(&s->lru, ext, next);
+
+    trace_write_cache_writeback(bs, ext->node.start, bytes);
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+    ret = bdrv_co_pwrite(bs->file, ext->node.start, bytes, ext->buf, 0);
+
+    ext->writing = false;
+    if (ret < 0) {
+        QTAILQ_INSERT_HEAD(&s->lru, ext, next);
+    } else {
+        s->writebacks++;
+        s->writeback_bytes += bytes;
+        write_cache_free_extent(s, ext);
+    }
+
+    qemu_co_queue_restart_all(&s->writeback_queue);
+
+    return ret < 0 ? ret : 0;
+}
+
+/* Write back all cached data in [@start, @end) */
+static int coroutine_fn write_cache_writeback_range(BlockDriverState *bs,
+                                                    uint64_t start,
+                                                    uint64_t end)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    WriteCacheExtent *ext;
+    int ret;
+
+    while ((ext = write_cache_find(s, start, end, NULL))) {
+        if (ext->writing) {
+            qemu_co_queue_wait(&s->writeback_queue, NULL);
+            continue;
+        }
+
+        ret = write_cache_writeback(bs, ext);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Return the range covered by [@offset, @end) and the idle extents in
+ * [@search_start, @search_end).
+ */
+static void write_cache_merged_range(BDRVWriteCacheState *s,
+                                     uint64_t offset, uint64_t end,
+                                     uint64_t search_start,
+                                     uint64_t search_end,
+                                     uint64_t *merged_start,
+                                     uint64_t *merged_end)
+{
+    WriteCacheExtent *ext;
+    uint64_t pos = search_start;
+
+    *merged_start = offset;
+    *merged_end = end;
+    while ((ext = write_cache_find(s, pos, search_end, extent_is_idle))) {
+        *merged_start = MIN(*merged_start, ext->node.start);
+        *merged_end = MAX(*merged_end, ext->node.end);
+        pos = ext->node.end;
+    }
+}
+
+static int coroutine_fn write_cache_co_cached_write(BlockDriverState *bs,
+                                                    uint64_t offset,
+                                                    uint64_t bytes,
+                                                    QEMUIOVector *qiov,
+                                                    size_t qiov_offset)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    uint64_t search_start, search_end, merged_start, merged_end;
+    WriteCacheExtent *base, *ext;
+    bool coalesced = false;
+    int ret;
+
+    for (;;) {
+        /*
+         * Make room first.  Merging never grows the cache by more than
+         * @bytes.  If writing back fails, the request fails without
+         * being cached, so that the cache cannot grow beyond max-dirty
+         * and the guest is not told about an error for data that will
+         * still be written later.
+         */
+        if (s->dirty_bytes + bytes > s->opts.max_dirty) {
+            ext = QTAILQ_FIRST(&s->lru);
+            if (!ext) {
+                qemu_co_queue_wait(&s->writeback_queue, NULL);
+                continue;
+            }
+
+            ret = write_cache_writeback(bs, ext);
+            if (ret < 0) {
+                return ret;
+            }
+            continue;
+        }
+
+        /* Extents that are being written back must not change */
+        if (write_cache_find(s, offset, end, extent_is_writing)) {
+            qemu_co_queue_wait(&s->writeback_queue, NULL);
+            continue;
+        }
+
+        /* Merge with the extents that overlap or touch the request */
+        search_start = offset ? offset - 1 : 0;
+        search_end = end + 1;
+        write_cache_merged_range(s, offset, end, search_start, search_end,
+                                 &merged_start, &merged_end);
+        if (merged_end - merged_start <= s->opts.max_extent) {
+            break;
+        }
+
+        /* Too large: only merge with the extents that overlap */
+        search_start = offset;
+        search_end = end;
+        write_cache_merged_range(s, offset, end, search_start, search_end,
+                                 &merged_start, &merged_end);
+        if (merged_end - merged_start <= s->opts.max_extent) {
+            break;
+        }
+
+        ret = write_cache_writeback_range(bs, offset, end);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* Reuse the buffer of the first extent if the data does not move */
+    base = write_cache_find(s, search_start, search_end, extent_is_idle);
+    if (base && base->node.start == merged_start) {
+        interval_tree_remove(&s->extents, &base->node);
+        QTAILQ_REMOVE(&s->lru, base, next);
+        s->dirty_bytes -= base->node.end - base->node.start;
+        if (base->capacity < merged_end - merged_start) {
+            base->capacity = MIN(MAX(merged_end - merged_start,
+                                     base->capacity * 2),
+                                 s->opts.max_extent);
+            base->buf = g_realloc(base->buf, base->capacity);
+        }
+        coalesced = true;
+    } else {
+        base = g_new0(WriteCacheExtent, 1);
+        base->capacity = merged_end - merged_start;
+        base->buf = g_malloc(base->capacity);
+    }
+
+    while ((ext = write_cache_find(s, search_start, search_end,
+                                   extent_is_idle))) {
+        memcpy(base->buf + (ext->node.start - merged_start), ext->buf,
+               ext->node.end - ext->node.start);
+        QTAILQ_REMOVE(&s->lru, ext, next);
+        write_cache_free_extent(s, ext);
+        coalesced = true;
+    }
+
+    qemu_iovec_to_buf(qiov, qiov_offset, base->buf + (offset - merged_start),
+                      bytes);
+
+    base->node.start = merged_start;
+    base->node.end = merged_end;
+    interval_tree_insert(&s->extents, &base->node);
+    QTAILQ_INSERT_TAIL(&s->lru, base, next);
+    s->dirty_bytes += merged_end - merged_start;
+    s->cached_end = MAX(s->cached_end, merged_end);
+
+    s->cached_writes++;
+    if (coalesced) {
+        s->coalesced_writes++;
+    }
+    assert(s->dirty_bytes <= s->opts.max_dirty);
+
+    return 0;
+}
+
+static int coroutine_fn write_cache_co_pwritev_part(BlockDriverState *bs,
+                                                    uint64_t offset,
+                                                    uint64_t bytes,
+                                                    QEMUIOVector *qiov,
+                                                    size_t qiov_offset,
+                                                    int flags)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    int ret;
+
+    if (!(flags & BDRV_REQ_FUA) && bytes <= s->opts.max_extent) {
+        return write_cache_co_cached_write(bs, offset, bytes,
+                                           qiov, qiov_offset);
+    }
+
+    ret = write_cache_writeback_range(bs, offset, offset + bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->direct_writes++;
+    return bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                flags);
+}
+
+static int coroutine_fn write_cache_co_pwrite_zeroes(BlockDriverState *bs,
+        int64_t offset, int bytes, BdrvRequestFlags flags)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    int ret;
+
+    ret = write_cache_writeback_range(bs, offset, offset + bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->direct_writes++;
+    return bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+}
+
+static int coroutine_fn write_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    int ret;
+
+    ret = write_cache_writeback_range(bs, offset, offset + bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->direct_writes++;
+    return bdrv_co_pdiscard(bs->file, offset, bytes);
+}
+
+static int coroutine_fn write_cache_co_preadv_part(BlockDriverState *bs,
+                                                   uint64_t offset,
+                                                   uint64_t bytes,
+                                                   QEMUIOVector *qiov,
+                                                   size_t qiov_offset,
+                                                   int flags)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    uint64_t pos = offset;
+    WriteCacheExtent *ext;
+    int ret;
+
+    while (pos < end) {
+        ext = write_cache_find(s, pos, end, NULL);
+        if (!ext || ext->node.start > pos) {
+            break;
+        }
+        qemu_iovec_from_buf(qiov, qiov_offset + (pos - offset),
+                            ext->buf + (pos - ext->node.start),
+                            MIN(end, ext->node.end) - pos);
+        pos = ext->node.end;
+    }
+
+    if (pos >= end) {
+        s->read_hits++;
+        return 0;
+    }
+
+    s->read_misses++;
+    ret = write_cache_writeback_range(bs, offset, end);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+}
+
+static int coroutine_fn write_cache_co_flush_to_os(BlockDriverState *bs)
+{
+    return write_cache_writeback_range(bs, 0, UINT64_MAX);
+}
+
+static int coroutine_fn
+write_cache_co_truncate(BlockDriverState *bs, int64_t offset,
+                        bool exact, PreallocMode prealloc,
+                        BdrvRequestFlags flags, Error **errp)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    int ret;
+
+    ret = write_cache_writeback_range(bs, 0, UINT64_MAX);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write back cached data");
+        return ret;
+    }
+    s->cached_end = 0;
+
+    return bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+}
+
+static int64_t write_cache_getlength(BlockDriverState *bs)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    int64_t ret = bdrv_getlength(bs->file->bs);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    return MAX(ret, s->cached_end);
+}
+
+static int coroutine_fn write_cache_co_block_status(BlockDriverState *bs,
+                                                    bool want_zero,
+                                                    int64_t offset,
+                                                    int64_t bytes,
+                                                    int64_t *pnum,
+                                                    int64_t *map,
+                                                    BlockDriverState **file)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    WriteCacheExtent *ext = write_cache_find(s, offset, offset + bytes, NULL);
+
+    if (ext && ext->node.start <= offset) {
+        *pnum = MIN(offset + bytes, ext->node.end) - offset;
+        return BDRV_BLOCK_DATA;
+    }
+
+    *pnum = ext ? ext->node.start - offset : bytes;
+    *file = bs->file->bs;
+    *map = offset;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+}
+
+static void write_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+    BdrvChildRole role, BlockReopenQueue *reopen_queue,
+    uint64_t perm, uint64_t shared, uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    if (perm & BLK_PERM_WRITE) {
+        /* Writes by others would be overwritten by our write back */
+        *nshared &= ~BLK_PERM_WRITE;
+    }
+}
+
+static BlockStatsSpecific *write_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVWriteCacheState *s = bs->opaque;
+
+    stats->driver = BLOCKDEV_DRIVER_WRITE_CACHE;
+    stats->u.write_cache = (BlockStatsSpecificWriteCache) {
+        .cached_writes = s->cached_writes,
+        .coalesced_writes = s->coalesced_writes,
+        .direct_writes = s->direct_writes,
+        .read_hits = s->read_hits,
+        .read_misses = s->read_misses,
+        .writebacks = s->writebacks,
+        .writeback_bytes = s->writeback_bytes,
+        .dirty_bytes = s->dirty_bytes,
+    };
+
+    return stats;
+}
+
+static BlockDriver bdrv_write_cache = {
+    .format_name = "write-cache",
+    .instance_size = sizeof(BDRVWriteCacheState),
+
+    .bdrv_getlength = write_cache_getlength,
+    .bdrv_open = write_cache_open,
+    .bdrv_close = write_cache_close,
+    .bdrv_inactivate = write_cache_inactivate,
+
+    .bdrv_reopen_prepare  = write_cache_reopen_prepare,
+    .bdrv_reopen_commit   = write_cache_reopen_commit,
+    .bdrv_reopen_abort    = write_cache_reopen_abort,
+
+    .bdrv_co_preadv_part = write_cache_co_preadv_part,
+    .bdrv_co_pwritev_part = write_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes = write_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard = write_cache_co_pdiscard,
+    .bdrv_co_flush_to_os = write_cache_co_flush_to_os,
+    .bdrv_co_truncate = write_cache_co_truncate,
+    .bdrv_co_block_status = write_cache_co_block_status,
+
+    .bdrv_child_perm = write_cache_child_perm,
+    .bdrv_get_specific_stats = write_cache_get_specific_stats,
+
+    .has_variable_length = true,
+};
+
+static void bdrv_write_cache_init(void)
+{
+    bdrv_register(&bdrv_write_cache);
+}
+
+block_init(bdrv_write_cache_init);
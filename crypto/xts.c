@@ -99,6 +99,62 @@ static inline void xts_tweak_encdec(const void *ctx,
 }
 
 
+/* Number of blocks passed to the cipher function at once */
+#define XTS_BATCH_BLOCKS 32
+
+/**
+ * xts_tweak_encdec_blocks:
+ * @param ctxt: the cipher context
+ * @param func: the cipher function
+ * @src: buffer providing @nblocks blocks of input text
+ * @dst: buffer to output @nblocks blocks of output text
+ * @nblocks: the number of XTS_BLOCK_SIZE blocks to process
+ * @iv: the initialization vector tweak of XTS_BLOCK_SIZE bytes
+ *
+ * Encrypt/decrypt several consecutive blocks with a tweak, as if calling
+ * xts_tweak_encdec() on each of them.  The tweaks of up to XTS_BATCH_BLOCKS
+ * blocks are computed beforehand, so that @func is called once for the
+ * whole batch instead of once per block.  This lets the cipher backend
+ * pipeline the block cipher, which is what makes hardware AES fast.
+ *
+ * @src and @dst may be the same buffer and need not be aligned.
+ */
+static void xts_tweak_encdec_blocks(const void *ctx,
+                                    xts_cipher_func *func,
+                                    const uint8_t *src,
+                                    uint8_t *dst,
+                                    unsigned long nblocks,
+                                    xts_uint128 *iv)
+{
+    xts_uint128 buf[XTS_BATCH_BLOCKS];
+    xts_uint128 tweak[XTS_BATCH_BLOCKS];
+    unsigned long i, n;
+
+    while (nblocks > 0) {
+        n = MIN(nblocks, XTS_BATCH_BLOCKS);
+
+        for (i = 0; i < n; i++) {
+            tweak[i] = *iv;
+            xts_mult_x(iv);
+
+            memcpy(&buf[i], src + i * XTS_BLOCK_SIZE, XTS_BLOCK_SIZE);
+            xts_uint128_xor(&buf[i], &buf[i], &tweak[i]);
+        }
+
+        func(ctx, n * XTS_BLOCK_SIZE, buf[0].b, buf[0].b);
+
+        for (i = 0; i < n; i++) {
+            xts_uint128_xor(&buf[i], &buf[i], &tweak[i]);
+            memcpy(dst + i * XTS_BLOCK_SIZE, &buf[i], XTS_BLOCK_SIZE);
+        }
+
+        src += n * XTS_BLOCK_SIZE;
+        dst += n * XTS_BLOCK_SIZE;
+        nblocks -= n;
+    }
+}
+
+
 void xts_decrypt(const void *datactx,
                  const void *tweakctx,
                  xts_cipher_func *encfunc,
@@ -127,24 +183,9 @@ void xts_decrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T.b, iv);
 
-    if (QEMU_PTR_IS_ALIGNED(src, sizeof(uint64_t)) &&
-        QEMU_PTR_IS_ALIGNED(dst, sizeof(uint64_t))) {
-        xts_uint128 *S = (xts_uint128 *)src;
-        xts_uint128 *D = (xts_uint128 *)dst;
-        for (i = 0; i < lim; i++, S++, D++) {
-            xts_tweak_encdec(datactx, decfunc, S, D, &T);
-        }
-    } else {
-        xts_uint128 D;
-
-        for (i = 0; i < lim; i++) {
-            memcpy(&D, src, XTS_BLOCK_SIZE);
-            xts_tweak_encdec(datactx, decfunc, &D, &D, &T);
-            memcpy(dst, &D, XTS_BLOCK_SIZE);
-            src += XTS_BLOCK_SIZE;
-            dst += XTS_BLOCK_SIZE;
-        }
-    }
+    xts_tweak_encdec_blocks(datactx, decfunc, src, dst, lim, &T);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
@@ -203,25 +244,9 @@ void xts_encrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T.b, iv);
 
-    if (QEMU_PTR_IS_ALIGNED(src, sizeof(uint64_t)) &&
-        QEMU_PTR_IS_ALIGNED(dst, sizeof(uint64_t))) {
-        xts_uint128 *S = (xts_uint128 *)src;
-        xts_uint128 *D = (xts_uint128 *)dst;
-        for (i = 0; i < lim; i++, S++, D++) {
-            xts_tweak_encdec(datactx, encfunc, S, D, &T);
-        }
-    } else {
-        xts_uint128 D;
-
-        for (i = 0; i < lim; i++) {
-            memcpy(&D, src, XTS_BLOCK_SIZE);
-            xts_tweak_encdec(datactx, encfunc, &D, &D, &T);
-            memcpy(dst, &D, XTS_BLOCK_SIZE);
-
-            dst += XTS_BLOCK_SIZE;
-            src += XTS_BLOCK_SIZE;
-        }
-    }
+    xts_tweak_encdec_blocks(datactx, encfunc, src, dst, lim, &T);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
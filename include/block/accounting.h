@@ -78,6 +78,32 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
+/*
+ * Log-linear histogram of latencies in nanoseconds, from which latency
+ * percentiles are computed.  Unlike BlockLatencyHistogram it needs no
+ * configuration and is always maintained.
+ *
+ * All latencies below 2^BLOCK_LATENCY_LOG_MIN_BITS (about 1 us) share the
+ * first bucket.  Above that, every power of two is split into
+ * 2^BLOCK_LATENCY_LOG_SUB_BITS buckets of equal width, so that a bucket is
+ * never wider than 1/16 of its lower bound.  All latencies from
+ * 2^BLOCK_LATENCY_LOG_MAX_BITS (about 68 seconds) on are counted in the
+ * overflow bucket, which has no upper bound.
+ */
+#define BLOCK_LATENCY_LOG_SUB_BITS 4
+#define BLOCK_LATENCY_LOG_MIN_BITS 10
+#define BLOCK_LATENCY_LOG_MAX_BITS 36
+#define BLOCK_LATENCY_LOG_BUCKETS \
+    (((BLOCK_LATENCY_LOG_MAX_BITS - BLOCK_LATENCY_LOG_MIN_BITS) << \
+      BLOCK_LATENCY_LOG_SUB_BITS) + 2)
+#define BLOCK_LATENCY_LOG_OVERFLOW (BLOCK_LATENCY_LOG_BUCKETS - 1)
+
+typedef struct BlockLatencyLogHistogram {
+    uint64_t count;
+    /* BLOCK_LATENCY_LOG_BUCKETS entries, allocated by the first request */
+    uint64_t *buckets;
+} BlockLatencyLogHistogram;
+
 struct BlockAcctStats {
     QemuMutex lock;
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
@@ -91,6 +117,7 @@ struct BlockAcctStats {
     bool account_invalid;
     bool account_failed;
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
+    BlockLatencyLogHistogram latency_log[BLOCK_MAX_IOTYPE];
 };
 
 typedef struct BlockAcctCookie {
@@ -119,5 +146,10 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
+void block_latency_log_account(BlockLatencyLogHistogram *hist,
+                               int64_t latency_ns);
+void block_latency_log_clear(BlockLatencyLogHistogram *hist);
+uint64_t block_latency_log_percentile(const BlockLatencyLogHistogram *hist,
+                                      double percentile);
 
 #endif
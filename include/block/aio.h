@@ -211,6 +211,10 @@ struct AioContext {
      */
     struct LuringState *linux_io_uring;
 
+    /* Parameters for linux_io_uring, see aio_context_set_io_uring_params() */
+    bool linux_io_uring_sqpoll;
+    bool linux_io_uring_fixed_buffers;
+
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
@@ -727,4 +731,16 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_io_uring_params:
+ * @ctx: the aio context
+ * @sqpoll: let a kernel thread poll the submission queue
+ * @fixed_buffers: register guest RAM with the ring
+ *
+ * Configure the io_uring ring that aio_setup_linux_io_uring() creates for
+ * aio=io_uring.  This must be called before the ring is set up.
+ */
+void aio_context_set_io_uring_params(AioContext *ctx, bool sqpoll,
+                                     bool fixed_buffers, Error **errp);
+
 #endif
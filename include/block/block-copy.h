@@ -89,4 +89,17 @@ void block_copy_call_cancel(BlockCopyCallState *call_state);
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
 
+/*
+ * In adaptive mode, calls started with block_copy_async() adjust the request
+ * length and the number of parallel requests to the measured throughput.
+ * Their @max_workers and @max_chunk become upper bounds.
+ */
+void block_copy_set_adaptive(BlockCopyState *s, bool adaptive);
+
+/*
+ * Report the current limits of the background copy and the throughput
+ * measured for @s.
+ */
+void block_copy_get_stats(BlockCopyState *s, JobCopyStats *stats);
+
 #endif /* BLOCK_COPY_H */
@@ -32,8 +32,10 @@
 #include "qemu/stats64.h"
 #include "qemu/timer.h"
 #include "qemu/hbitmap.h"
+#include "qemu/interval-tree.h"
 #include "block/snapshot.h"
 #include "qemu/throttle.h"
+#include "io/channel-socket.h"
 
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
 
@@ -87,12 +89,30 @@ typedef struct BdrvTrackedRequest {
     int64_t overlap_bytes;
 
     QLIST_ENTRY(BdrvTrackedRequest) list;
+    /* [overlap_offset, overlap_offset + overlap_bytes) in tracked_reqs_tree */
+    IntervalTreeNode overlap_node;
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 
     struct BdrvTrackedRequest *waiting_for;
 } BdrvTrackedRequest;
 
+/* Number of ranges in the block status cache of a node */
+#define BDRV_BLOCK_STATUS_CACHE_SIZE 16
+
+/*
+ * A range for which the driver reported the data block status @ret.  If
+ * @ret has BDRV_BLOCK_OFFSET_VALID, @start maps to @map in @file.  Unused
+ * entries have @start == @end.
+ */
+typedef struct BdrvBlockStatusCacheEntry {
+    int64_t start;
+    int64_t end;
+    int64_t map;
+    BlockDriverState *file;
+    int ret;
+} BdrvBlockStatusCacheEntry;
+
 int bdrv_check_request(int64_t offset, int64_t bytes, Error **errp);
 
 struct BlockDriver {
@@ -332,6 +352,23 @@ struct BlockDriver {
                                               BdrvRequestFlags read_flags,
                                               BdrvRequestFlags write_flags);
 
+    /*
+     * Send @header_len bytes at @header, followed by the @bytes bytes of
+     * data at @offset, to the stream socket @sioc without copying the
+     * data through a user space buffer.  Format drivers map the range
+     * onto their child and call bdrv_co_sendfile() on it.
+     *
+     * Return -ENOTSUP without having sent anything if the request can't
+     * be handled that way; the caller then falls back to a normal read.
+     * Any other error means that part of the reply may have been sent.
+     * @sioc is non-blocking; drivers wait for it with qio_channel_yield().
+     */
+    int coroutine_fn (*bdrv_co_sendfile)(BlockDriverState *bs,
+                                         int64_t offset, int64_t bytes,
+                                         QIOChannelSocket *sioc,
+                                         const void *header,
+                                         size_t header_len);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -974,6 +1011,12 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /*
+     * Latencies of the requests this node received.  Only updated from the
+     * node's AioContext, so no locking is needed.
+     */
+    BlockLatencyLogHistogram latency_log[BLOCK_MAX_IOTYPE];
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
@@ -1003,6 +1046,7 @@ struct BlockDriverState {
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    IntervalTreeRoot tracked_reqs_tree;   /* Same, by overlap range */
     CoQueue flush_queue;                  /* Serializing flush queue */
     bool active_flush_req;                /* Flush request in flight? */
 
@@ -1011,6 +1055,19 @@ struct BlockDriverState {
 
     /* BdrvChild links to this node may never be frozen */
     bool never_freeze;
+
+    /*
+     * Recent data ranges reported by drv->bdrv_co_block_status(), so that
+     * repeated queries over the same range do not go to the driver again.
+     * Writes, discards and truncation invalidate the ranges they touch.
+     * Operations that change the node's metadata outside of the write path
+     * (snapshot apply, make_empty, amend, repairs, child changes) invalidate
+     * everything.  Protected by bsc_lock.
+     */
+    QemuMutex bsc_lock;
+    BdrvBlockStatusCacheEntry bsc[BDRV_BLOCK_STATUS_CACHE_SIZE];
+    unsigned int bsc_next;                /* Next entry to replace */
+    unsigned int bsc_gen;                 /* Incremented on invalidation */
 };
 
 struct BlockBackendRootState {
@@ -1247,6 +1304,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
  * driver that the mirror job inserts into the graph above @bs. NULL means that
  * a node name should be autogenerated.
  * @copy_mode: When to trigger writes to the target.
+ * @use_copy_range: Whether to try copy offloading for background copies.
  * @errp: Error object.
  *
  * Start a mirroring operation on @bs.  Clusters that are allocated
@@ -1263,7 +1321,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp);
+                  MirrorCopyMode copy_mode, bool use_copy_range,
+                  Error **errp);
 
 /*
  * backup_job_create:
@@ -1335,6 +1394,12 @@ int bdrv_child_refresh_perms(BlockDriverState *bs, BdrvChild *c, Error **errp);
 bool bdrv_recurse_can_replace(BlockDriverState *bs,
                               BlockDriverState *to_replace);
 
+/*
+ * Returns a counter that changes whenever a child of any node is replaced,
+ * which allows caching information about the graph.
+ */
+unsigned int bdrv_get_graph_generation(void);
+
 /*
  * Default implementation for BlockDriver.bdrv_child_perm() that can
  * be used by block filters and image formats, as long as they use the
@@ -1364,8 +1429,35 @@ bool bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
 void bdrv_inc_in_flight(BlockDriverState *bs);
 void bdrv_dec_in_flight(BlockDriverState *bs);
 
+/**
+ * bdrv_bsc_invalidate_range:
+ *
+ * Drop the cached block status of [@offset, @offset + @bytes), for changes
+ * to @bs that do not go through its write path.
+ */
+void bdrv_bsc_invalidate_range(BlockDriverState *bs,
+                               int64_t offset, int64_t bytes);
+
 void blockdev_close_all_bdrv_states(void);
 
+/**
+ * bdrv_co_sendfile:
+ *
+ * Send @header_len bytes at @header and then @bytes bytes of data read
+ * from @child at @offset to the non-blocking stream socket @sioc, letting
+ * the kernel move the data from the image file to the socket (sendfile(2))
+ * where the driver supports it.  The calling coroutine must be allowed to
+ * wait for @sioc with qio_channel_yield().
+ *
+ * Returns: 0 if succeeded; -ENOTSUP if nothing was sent because the request
+ * can't be offloaded, in which case the caller should read the data into a
+ * buffer and send it itself; other negative error codes if sending failed,
+ * possibly after part of the data was sent.
+ **/
+int coroutine_fn bdrv_co_sendfile(BdrvChild *child, int64_t offset,
+                                  int64_t bytes, QIOChannelSocket *sioc,
+                                  const void *header, size_t header_len);
+
 int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, int64_t src_offset,
                                          BdrvChild *dst, int64_t dst_offset,
                                          int64_t bytes,
@@ -59,6 +59,17 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /* Offset of this block's pages in the ram-file, on the source side */
+    uint64_t file_offset;
+
+    /*
+     * Pages of this block dirtied again since the last dirty rate update,
+     * and the resulting (smoothed) dirty rate in bytes per second.  Only
+     * maintained on the source during migration.
+     */
+    uint64_t dirty_pages_period;
+    uint64_t dirty_rate;
 };
 #endif
 #endif
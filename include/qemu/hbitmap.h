@@ -61,6 +61,45 @@ struct HBitmapIter {
  */
 HBitmap *hbitmap_alloc(uint64_t size, int granularity);
 
+/**
+ * hbitmap_alloc_sparse:
+ * @size: Number of bits in the bitmap.
+ * @granularity: Granularity of the bitmap, see hbitmap_alloc().
+ *
+ * Allocate a new HBitmap that only uses memory for the parts of the bitmap
+ * where set and clear bits are mixed.  Ranges that are entirely clear or
+ * entirely set cost almost nothing, at the price of slightly slower updates.
+ * This suits bitmaps of large disks that are mostly clean or mostly dirty.
+ */
+HBitmap *hbitmap_alloc_sparse(uint64_t size, int granularity);
+
+/**
+ * hbitmap_is_sparse:
+ * @hb: HBitmap to operate on.
+ *
+ * Return whether @hb was allocated with hbitmap_alloc_sparse() or converted
+ * with hbitmap_set_sparse().
+ */
+bool hbitmap_is_sparse(const HBitmap *hb);
+
+/**
+ * hbitmap_set_sparse:
+ * @hb: HBitmap to operate on.
+ * @sparse: Whether the bitmap should use the sparse representation.
+ *
+ * Convert @hb between the representations of hbitmap_alloc() and
+ * hbitmap_alloc_sparse().  The contents of the bitmap do not change.
+ */
+void hbitmap_set_sparse(HBitmap *hb, bool sparse);
+
+/**
+ * hbitmap_memory_usage:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bytes of memory used by @hb.
+ */
+uint64_t hbitmap_memory_usage(const HBitmap *hb);
+
 /**
  * hbitmap_truncate:
  * @hb: The bitmap to change the size of.
@@ -0,0 +1,94 @@
+/*
+ * Interval tree of possibly overlapping ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+/*
+ * An intrusive, balanced (AVL) binary tree of half-open ranges
+ * [start, end), ordered by start.  Every node also records the largest
+ * end within its subtree, so that the nodes overlapping a range can be
+ * found in O(log n + k) time, k being the number of overlapping nodes
+ * that had to be looked at.
+ *
+ * Unlike IOVATree, ranges may overlap and nodes are embedded in the
+ * caller's structures, so that inserting and removing never allocates.
+ * The start and end of a node must not be changed while it is in a
+ * tree; remove it, update it and insert it again instead.
+ *
+ * There is no locking: callers must serialise accesses to a tree.
+ */
+
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+struct IntervalTreeNode {
+    uint64_t start;
+    uint64_t end;
+
+    /* private */
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+    uint64_t subtree_end;
+    int height;
+};
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+} IntervalTreeRoot;
+
+/**
+ * IntervalTreeMatchFunc:
+ * @node: a node overlapping the range that was looked up
+ * @opaque: the opaque pointer passed to interval_tree_find()
+ *
+ * Returns: true if @node is the one interval_tree_find() should return
+ */
+typedef bool IntervalTreeMatchFunc(IntervalTreeNode *node, void *opaque);
+
+/**
+ * interval_tree_insert:
+ * @root: the tree
+ * @node: the node to insert, with its start and end set
+ *
+ * Insert @node into @root.  Nodes with the same start are allowed.
+ */
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/**
+ * interval_tree_remove:
+ * @root: the tree
+ * @node: a node that was inserted into @root
+ *
+ * Remove @node from @root.
+ */
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/**
+ * interval_tree_find:
+ * @root: the tree
+ * @start: start of the range to look up
+ * @end: end of the range to look up, exclusive
+ * @match: additional condition the node must satisfy, or NULL
+ * @opaque: passed to @match
+ *
+ * Look for a node overlapping [@start, @end), that is whose start is
+ * below @end and whose end is above @start, and for which @match
+ * returns true.  Nodes are considered in order of their start.
+ *
+ * Returns: the first such node, or NULL if there is none
+ */
+IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root,
+                                     uint64_t start, uint64_t end,
+                                     IntervalTreeMatchFunc *match,
+                                     void *opaque);
+
+static inline bool interval_tree_is_empty(IntervalTreeRoot *root)
+{
+    return root->root == NULL;
+}
+
+#endif /* QEMU_INTERVAL_TREE_H */
@@ -256,6 +256,12 @@ struct JobDriver {
      */
     void (*cancel)(Job *job);
 
+    /**
+     * If the callback is not NULL, it will be invoked by query-jobs to fill
+     * in the driver-specific fields of @info.  Called with the job's
+     * AioContext held.
+     */
+    void (*query)(Job *job, JobInfo *info);
 
     /** Called when the job is freed */
     void (*free)(Job *job);
@@ -15,6 +15,7 @@
 
 #include "qemu/iov.h"
 #include "block/throttle-groups.h"
+#include "io/channel-socket.h"
 
 /*
  * TODO Have to include block/block.h for a bunch of block layer
@@ -264,6 +265,14 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                                    BlockBackend *blk_out, int64_t off_out,
                                    int bytes, BdrvRequestFlags read_flags,
                                    BdrvRequestFlags write_flags);
+int coroutine_fn blk_co_copy_range_to(BdrvChild *src, int64_t src_offset,
+                                      BlockBackend *blk, int64_t offset,
+                                      int bytes, BdrvRequestFlags read_flags,
+                                      BdrvRequestFlags write_flags);
+
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 int64_t bytes, QIOChannelSocket *sioc,
+                                 const void *header, size_t header_len);
 
 const BdrvChild *blk_root(BlockBackend *blk);
 
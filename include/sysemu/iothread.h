@@ -37,6 +37,10 @@ struct IOThread {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* AioContext io_uring parameters, fixed once the iothread is running */
+    bool io_uring_sqpoll;
+    bool io_uring_fixed_buffers;
 };
 typedef struct IOThread IOThread;
 
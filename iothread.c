@@ -183,6 +183,12 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                                 iothread->poll_grow,
                                 iothread->poll_shrink,
                                 &local_error);
+    if (!local_error) {
+        aio_context_set_io_uring_params(iothread->ctx,
+                                        iothread->io_uring_sqpoll,
+                                        iothread->io_uring_fixed_buffers,
+                                        &local_error);
+    }
     if (local_error) {
         error_propagate(errp, local_error);
         aio_context_unref(iothread->ctx);
@@ -259,6 +265,42 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static bool iothread_get_io_uring_sqpoll(Object *obj, Error **errp)
+{
+    return IOTHREAD(obj)->io_uring_sqpoll;
+}
+
+static void iothread_set_io_uring_sqpoll(Object *obj, bool value,
+                                         Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread->ctx) {
+        error_setg(errp, "io-uring-sqpoll cannot be changed after the "
+                   "iothread was created");
+        return;
+    }
+    iothread->io_uring_sqpoll = value;
+}
+
+static bool iothread_get_io_uring_fixed_buffers(Object *obj, Error **errp)
+{
+    return IOTHREAD(obj)->io_uring_fixed_buffers;
+}
+
+static void iothread_set_io_uring_fixed_buffers(Object *obj, bool value,
+                                                Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread->ctx) {
+        error_setg(errp, "io-uring-fixed-buffers cannot be changed after "
+                   "the iothread was created");
+        return;
+    }
+    iothread->io_uring_fixed_buffers = value;
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -276,6 +318,12 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add_bool(klass, "io-uring-sqpoll",
+                                   iothread_get_io_uring_sqpoll,
+                                   iothread_set_io_uring_sqpoll);
+    object_class_property_add_bool(klass, "io-uring-fixed-buffers",
+                                   iothread_get_io_uring_fixed_buffers,
+                                   iothread_set_io_uring_fixed_buffers);
 }
 
 static const TypeInfo iothread_info = {
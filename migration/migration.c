@@ -57,6 +57,7 @@
 #include "net/announce.h"
 #include "qemu/queue.h"
 #include "multifd.h"
+#include "ram-file.h"
 #include "qemu/yank.h"
 #include "sysemu/cpus.h"
 
@@ -92,6 +93,14 @@
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
 #define DEFAULT_MIGRATE_MAX_CPU_THROTTLE 99
 
+/*
+ * Predictive convergence: number of further iterations accepted before
+ * the migration counts as not converging, and the dirty rate, as a
+ * fraction of the bandwidth, that throttling aims at.
+ */
+#define CONVERGENCE_MAX_ITERATIONS 30
+#define CONVERGENCE_THROTTLE_TARGET 0.5
+
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE (64 * 1024 * 1024)
 
@@ -109,6 +118,13 @@
  */
 #define DEFAULT_MIGRATE_MAX_POSTCOPY_BANDWIDTH 0
 
+/*
+ * Host pages requested after each postcopy fault, 0 means only the
+ * faulting page itself.
+ */
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_WINDOW 0
+#define MAX_POSTCOPY_PREFETCH_WINDOW 4096
+
 /*
  * Parameters for self_announce_delay giving a stream of RARP/ARP
  * packets after migration.
@@ -182,7 +198,8 @@ static int migration_maybe_pause(MigrationState *s,
                                  int new_state);
 static void migrate_fd_cancel(MigrationState *s);
 
-static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp)
+static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp,
+                                  gpointer unused)
 {
     uintptr_t a = (uintptr_t) ap, b = (uintptr_t) bp;
 
@@ -211,7 +228,8 @@ void migration_object_init(void)
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
     qemu_mutex_init(&current_incoming->page_request_mutex);
-    current_incoming->page_requested = g_tree_new(page_request_addr_cmp);
+    current_incoming->page_requested = g_tree_new_full(page_request_addr_cmp,
+                                                       NULL, NULL, g_free);
 
     if (!migration_object_check(current_migration, &err)) {
         error_report_err(err);
@@ -275,6 +293,10 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -351,11 +373,11 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
  *   Len: Length in bytes required - must be a multiple of pagesize
  */
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start)
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len)
 {
     uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
     size_t msglen = 12; /* start + len */
-    size_t len = qemu_ram_pagesize(rb);
     enum mig_rp_message_type msg_type;
     const char *rbname;
     int rbname_len;
@@ -398,10 +420,14 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         if (!received && !g_tree_lookup(mis->page_requested, aligned)) {
             /*
              * The page has not been received, and it's not yet in the page
-             * request list.  Queue it.  Set the value of element to 1, so that
-             * things like g_tree_lookup() will return TRUE (1) when found.
+             * request list.  Queue it.  The value of the element is the
+             * time of the fault, used to account for its latency once the
+             * page is placed.
              */
-            g_tree_insert(mis->page_requested, aligned, (gpointer)1);
+            int64_t *fault_time = g_new(int64_t, 1);
+
+            *fault_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+            g_tree_insert(mis->page_requested, aligned, fault_time);
             mis->page_requested_count++;
             trace_postcopy_page_req_add(aligned, mis->page_requested_count);
         }
@@ -415,7 +441,8 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         return 0;
     }
 
-    return migrate_send_rp_message_req_pages(mis, rb, start);
+    return migrate_send_rp_message_req_pages(mis, rb, start,
+                                             qemu_ram_pagesize(rb));
 }
 
 static bool migration_colo_enabled;
@@ -716,9 +743,15 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
 
         /*
          * Common migration only needs one channel, so we can start
-         * right now.  Multifd needs more than one channel, we wait.
+         * right now.  Multifd and postcopy-preempt need more than one
+         * channel, we wait.
          */
-        start_migration = !migrate_use_multifd();
+        start_migration = !migrate_use_multifd() &&
+                          !migrate_postcopy_preempt();
+    } else if (migrate_postcopy_preempt()) {
+        /* The second connection carries requested postcopy pages */
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        start_migration = true;
     } else {
         /* Multiple connections */
         assert(migrate_use_multifd());
@@ -746,6 +779,9 @@ bool migration_has_all_channels(void)
     bool all_channels;
 
     all_channels = multifd_recv_all_channels_created();
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
 
     return all_channels && mis->from_src_file != NULL;
 }
@@ -914,6 +950,12 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
                        s->parameters.block_bitmap_mapping);
     }
 
+    params->has_ram_file = true;
+    params->ram_file = g_strdup(s->parameters.ram_file ?
+                                s->parameters.ram_file : "");
+    params->has_postcopy_prefetch_window = true;
+    params->postcopy_prefetch_window = s->parameters.postcopy_prefetch_window;
+
     return params;
 }
 
@@ -1012,6 +1054,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->page_size = qemu_target_page_size();
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
     info->ram->pages_per_second = s->pages_per_second;
+    info->ram->file_bytes = ram_counters.file_bytes;
 
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
@@ -1048,6 +1091,33 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     }
 }
 
+static void populate_convergence_info(MigrationInfo *info, MigrationState *s)
+{
+    ConvergenceInfo *conv;
+
+    if (!migrate_predictive_convergence()) {
+        return;
+    }
+
+    conv = g_malloc0(sizeof(*conv));
+    conv->decision = s->convergence.decision;
+    conv->bandwidth = s->convergence.bandwidth * 1000;
+    conv->dirty_rate = s->convergence.dirty_rate;
+    conv->predicted_downtime = s->convergence.predicted_downtime;
+    if (s->convergence.iterations >= 0) {
+        conv->has_iterations = true;
+        conv->iterations = s->convergence.iterations;
+    }
+    if (s->convergence.completion_prediction >= 0) {
+        conv->has_completion_predicted_downtime = true;
+        conv->completion_predicted_downtime =
+            s->convergence.completion_prediction;
+    }
+
+    info->has_convergence = true;
+    info->convergence = conv;
+}
+
 static void populate_disk_info(MigrationInfo *info)
 {
     if (blk_mig_active()) {
@@ -1114,6 +1184,7 @@ static void fill_source_migration_info(MigrationInfo *info)
         /* TODO add some postcopy stats */
         populate_time_info(info, s);
         populate_ram_info(info, s);
+        populate_convergence_info(info, s);
         populate_disk_info(info);
         populate_vfio_info(info);
         break;
@@ -1124,6 +1195,7 @@ static void fill_source_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_COMPLETED:
         populate_time_info(info, s);
         populate_ram_info(info, s);
+        populate_convergence_info(info, s);
         populate_vfio_info(info);
         break;
     case MIGRATION_STATUS_FAILED:
@@ -1229,6 +1301,58 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_LAZY_RESTORE]) {
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "Lazy restore is not compatible with "
+                       "postcopy-ram or x-colo");
+            return false;
+        }
+        if (runstate_check(RUN_STATE_INMIGRATE) &&
+            !ram_file_lazy_restore_supported()) {
+            error_setg(errp, "Lazy restore is not supported by host kernel");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Postcopy preempt is not compatible with "
+                       "compress");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Postcopy preempt is not compatible with "
+                       "multifd");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_PREFAULT_RAM]) {
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_LAZY_RESTORE]) {
+            error_setg(errp, "Prefault RAM is not compatible with "
+                       "postcopy-ram or lazy-restore");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+        if (!cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Zero copy send requires multifd");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Zero copy send is not compatible with "
+                       "compress");
+            return false;
+        }
+    }
+
     if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
         WriteTrackingSupport wt_support;
         int idx;
@@ -1294,6 +1418,9 @@ static void fill_destination_migration_info(MigrationInfo *info)
         fill_destination_postcopy_migration_info(info);
         break;
     }
+    fill_destination_postcopy_latency_info(info);
+    fill_destination_lazy_restore_info(info);
+    fill_destination_multifd_info(info);
     info->status = mis->state;
 }
 
@@ -1423,6 +1550,15 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_postcopy_prefetch_window &&
+        params->postcopy_prefetch_window > MAX_POSTCOPY_PREFETCH_WINDOW) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_window",
+                   "a value between 0 and "
+                   stringify(MAX_POSTCOPY_PREFETCH_WINDOW));
+        return false;
+    }
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1576,6 +1712,15 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
         dest->has_block_bitmap_mapping = true;
         dest->block_bitmap_mapping = params->block_bitmap_mapping;
     }
+
+    if (params->has_ram_file) {
+        assert(params->ram_file->type == QTYPE_QSTRING);
+        dest->ram_file = params->ram_file->u.s;
+    }
+
+    if (params->has_postcopy_prefetch_window) {
+        dest->postcopy_prefetch_window = params->postcopy_prefetch_window;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1698,10 +1843,22 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
             QAPI_CLONE(BitmapMigrationNodeAliasList,
                        params->block_bitmap_mapping);
     }
+
+    if (params->has_ram_file) {
+        g_free(s->parameters.ram_file);
+        assert(params->ram_file->type == QTYPE_QSTRING);
+        s->parameters.ram_file = g_strdup(params->ram_file->u.s);
+    }
+
+    if (params->has_postcopy_prefetch_window) {
+        s->parameters.postcopy_prefetch_window =
+            params->postcopy_prefetch_window;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
 {
+    MigrationState *s = migrate_get_current();
     MigrationParameters tmp;
 
     /* TODO Rewrite "" to null instead */
@@ -1718,6 +1875,19 @@ void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
         params->tls_hostname->type = QTYPE_QSTRING;
         params->tls_hostname->u.s = strdup("");
     }
+    /* TODO Rewrite "" to null instead */
+    if (params->has_ram_file
+        && params->ram_file->type == QTYPE_QNULL) {
+        qobject_unref(params->ram_file->u.n);
+        params->ram_file->type = QTYPE_QSTRING;
+        params->ram_file->u.s = strdup("");
+    }
+
+    if (params->has_ram_file && migration_is_running(s->state)) {
+        error_setg(errp, "ram-file cannot be changed while migration "
+                   "is running");
+        return;
+    }
 
     migrate_params_test_apply(params, &tmp);
 
@@ -1818,6 +1988,7 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_mutex_lock_iothread();
 
         multifd_save_cleanup();
+        postcopy_preempt_shutdown_src(s);
         qemu_mutex_lock(&s->qemu_file_lock);
         tmp = s->to_dst_file;
         s->to_dst_file = NULL;
@@ -2037,6 +2208,13 @@ void migrate_init(MigrationState *s)
     s->pages_per_second = 0.0;
     s->downtime = 0;
     s->expected_downtime = 0;
+    s->convergence.decision = CONVERGENCE_DECISION_ITERATE;
+    s->convergence.bandwidth = 0;
+    s->convergence.dirty_rate = 0;
+    s->convergence.predicted_downtime = 0;
+    s->convergence.iterations = -1;
+    s->convergence.completion_prediction = -1;
+    s->convergence.throttle_sync_count = 0;
     s->setup_time = 0;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
@@ -2226,6 +2404,14 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
         return false;
     }
 
+    if (migrate_use_zero_copy_send() &&
+        (migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE ||
+         (s->parameters.tls_creds && *s->parameters.tls_creds))) {
+        error_setg(errp, "Zero copy send is only available for "
+                   "non-compressed non-TLS multifd migration");
+        return false;
+    }
+
     if (blk || blk_inc) {
         if (migrate_use_block() || migrate_use_block_incremental()) {
             error_setg(errp, "Command options are incompatible with "
@@ -2573,6 +2759,76 @@ bool migrate_background_snapshot(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
 }
 
+bool migrate_lazy_restore(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_LAZY_RESTORE];
+}
+
+const char *migrate_ram_file(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.ram_file;
+}
+
+bool migrate_use_ram_file(void)
+{
+    const char *path = migrate_ram_file();
+
+    return path && *path;
+}
+
+bool migrate_predictive_convergence(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PREDICTIVE_CONVERGENCE];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
+bool migrate_prefault_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PREFAULT_RAM];
+}
+
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+uint32_t migrate_postcopy_prefetch_window(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_window;
+}
+
 /* migration thread support */
 /*
  * Something bad happened to the RP stream, mark an error
@@ -3324,6 +3580,12 @@ static MigThrError postcopy_pause(MigrationState *s)
         qemu_file_shutdown(file);
         qemu_fclose(file);
 
+        /*
+         * The preempt channel is not re-established on recovery, the
+         * main channel carries requested pages from now on.
+         */
+        postcopy_preempt_shutdown_src(s);
+
         migrate_set_state(&s->state, s->state,
                           MIGRATION_STATUS_POSTCOPY_PAUSED);
 
@@ -3415,7 +3677,8 @@ static MigThrError migration_detect_error(MigrationState *s)
 /* How many bytes have we transferred since the beginning of the migration */
 static uint64_t migration_total_bytes(MigrationState *s)
 {
-    return qemu_ftell(s->to_dst_file) + ram_counters.multifd_bytes;
+    return qemu_ftell(s->to_dst_file) + ram_counters.multifd_bytes +
+           ram_counters.file_bytes;
 }
 
 static void migration_calculate_complete(MigrationState *s)
@@ -3433,6 +3696,11 @@ static void migration_calculate_complete(MigrationState *s)
         s->downtime = end_time - s->downtime_start;
     }
 
+    if (s->convergence.completion_prediction >= 0) {
+        trace_migration_convergence_downtime(
+            s->convergence.completion_prediction, s->downtime);
+    }
+
     transfer_time = s->total_time - s->setup_time;
     if (transfer_time) {
         s->mbps = ((double) bytes * 8.0) / transfer_time / 1000;
@@ -3466,6 +3734,7 @@ static void migration_update_counters(MigrationState *s,
     time_spent = current_time - s->iteration_start_time;
     bandwidth = (double)transferred / time_spent;
     s->threshold_size = bandwidth * s->parameters.downtime_limit;
+    s->convergence.bandwidth = bandwidth;
 
     s->mbps = (((double) transferred * 8.0) /
                ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
@@ -3498,6 +3767,106 @@ typedef enum {
     MIG_ITERATE_BREAK,          /* Break the loop */
 } MigIterateState;
 
+/*
+ * Simulate the next iterations: each one sends what is left at the
+ * measured bandwidth, while the guest dirties memory again at the rate
+ * of each RAMBlock.  Returns the number of iterations until what is left
+ * fits in the downtime limit, or -1 if it stops shrinking or needs more
+ * than CONVERGENCE_MAX_ITERATIONS.
+ */
+static int64_t migration_convergence_predict(MigrationState *s,
+                                             uint64_t pending)
+{
+    double bandwidth = s->convergence.bandwidth;
+    uint64_t remaining = pending;
+    int64_t i;
+
+    for (i = 0; i < CONVERGENCE_MAX_ITERATIONS; i++) {
+        uint64_t next;
+
+        if (remaining <= s->threshold_size) {
+            return i;
+        }
+        next = ram_predict_dirty_bytes(remaining / bandwidth);
+        /* Less than 10% progress per iteration is crawling, not converging */
+        if (next >= remaining - remaining / 10) {
+            return -1;
+        }
+        remaining = next;
+    }
+
+    return -1;
+}
+
+/*
+ * The predictive-convergence controller, run on every iteration of the
+ * migration thread while in precopy.  Updates the predictions and
+ * returns what to do next.
+ */
+static ConvergenceDecision migration_convergence_decide(MigrationState *s,
+                                                        uint64_t pending)
+{
+    double bandwidth = s->convergence.bandwidth;
+
+    if (bandwidth <= 0) {
+        /* Nothing measured yet, nothing to predict from */
+        return CONVERGENCE_DECISION_ITERATE;
+    }
+
+    s->convergence.dirty_rate = ram_dirty_rate();
+    s->convergence.predicted_downtime = pending / bandwidth;
+    s->convergence.iterations = migration_convergence_predict(s, pending);
+
+    if (pending < s->threshold_size) {
+        return CONVERGENCE_DECISION_COMPLETE;
+    }
+    /*
+     * Dirty rates are only known after the first pass over RAM, don't
+     * give up on converging before that.
+     */
+    if (s->convergence.iterations >= 0 ||
+        ram_counters.dirty_sync_count < 2) {
+        return CONVERGENCE_DECISION_ITERATE;
+    }
+    if (migrate_postcopy_ram()) {
+        return CONVERGENCE_DECISION_POSTCOPY;
+    }
+    if (migrate_auto_converge()) {
+        return CONVERGENCE_DECISION_THROTTLE;
+    }
+    return CONVERGENCE_DECISION_ITERATE;
+}
+
+static void migration_convergence_run(MigrationState *s, uint64_t pending)
+{
+    ConvergenceDecision decision = migration_convergence_decide(s, pending);
+
+    if (decision != s->convergence.decision) {
+        trace_migration_convergence_decision(
+            ConvergenceDecision_str(decision), pending,
+            s->convergence.predicted_downtime, s->convergence.iterations);
+    }
+    s->convergence.decision = decision;
+
+    switch (decision) {
+    case CONVERGENCE_DECISION_POSTCOPY:
+        qatomic_set(&s->start_postcopy, true);
+        break;
+    case CONVERGENCE_DECISION_THROTTLE:
+        /* Wait for the dirty rate measured under the current throttle */
+        if (s->convergence.throttle_sync_count !=
+            ram_counters.dirty_sync_count) {
+            s->convergence.throttle_sync_count = ram_counters.dirty_sync_count;
+            mig_throttle_guest_to_rate(s->convergence.dirty_rate,
+                                       s->convergence.bandwidth * 1000 *
+                                       CONVERGENCE_THROTTLE_TARGET);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
 /*
  * Return true if continue to the next iteration directly, false
  * otherwise.
@@ -3514,10 +3883,20 @@ static MigIterateState migration_iteration_run(MigrationState *s)
     trace_migrate_pending(pending_size, s->threshold_size,
                           pend_pre, pend_compat, pend_post);
 
+    if (!in_postcopy && migrate_predictive_convergence()) {
+        migration_convergence_run(s, pending_size);
+    }
+
     if (pending_size && pending_size >= s->threshold_size) {
         /* Still a significant amount to transfer */
         if (!in_postcopy && pend_pre <= s->threshold_size &&
             qatomic_read(&s->start_postcopy)) {
+            if (migrate_predictive_convergence() &&
+                s->convergence.bandwidth > 0) {
+                /* Only the non-postcopiable state is sent while stopped */
+                s->convergence.completion_prediction =
+                    (pend_pre + pend_compat) / s->convergence.bandwidth;
+            }
             if (postcopy_start(s)) {
                 error_report("%s: postcopy failed to start", __func__);
             }
@@ -3527,6 +3906,10 @@ static MigIterateState migration_iteration_run(MigrationState *s)
         qemu_savevm_state_iterate(s->to_dst_file, in_postcopy);
     } else {
         trace_migration_thread_low_pending(pending_size);
+        if (migrate_predictive_convergence()) {
+            s->convergence.completion_prediction =
+                s->convergence.predicted_downtime;
+        }
         migration_completion(s);
         return MIG_ITERATE_BREAK;
     }
@@ -3685,6 +4068,14 @@ static void *migration_thread(void *opaque)
     object_ref(OBJECT(s));
     update_iteration_initial_status(s);
 
+    /*
+     * The destination does not start loading until all channels are
+     * there; fail now rather than block on a full socket later.
+     */
+    if (postcopy_preempt_wait_channel(s)) {
+        qemu_file_set_error(s->to_dst_file, -ENOTCONN);
+    }
+
     qemu_savevm_state_header(s->to_dst_file);
 
     /*
@@ -4008,6 +4399,15 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         return;
     }
 
+    if (postcopy_preempt_setup(s, &local_err)) {
+        migrate_set_error(s, local_err);
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     if (migrate_background_snapshot()) {
         qemu_thread_create(&s->thread, "bg_snapshot",
                 bg_migration_thread, s, QEMU_THREAD_JOINABLE);
@@ -4101,6 +4501,9 @@ static Property migration_properties[] = {
     DEFINE_PROP_SIZE("max-postcopy-bandwidth", MigrationState,
                       parameters.max_postcopy_bandwidth,
                       DEFAULT_MIGRATE_MAX_POSTCOPY_BANDWIDTH),
+    DEFINE_PROP_UINT32("x-postcopy-prefetch-window", MigrationState,
+                      parameters.postcopy_prefetch_window,
+                      DEFAULT_MIGRATE_POSTCOPY_PREFETCH_WINDOW),
     DEFINE_PROP_UINT8("max-cpu-throttle", MigrationState,
                       parameters.max_cpu_throttle,
                       DEFAULT_MIGRATE_MAX_CPU_THROTTLE),
@@ -4132,6 +4535,14 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
     DEFINE_PROP_MIG_CAP("x-background-snapshot",
             MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
+    DEFINE_PROP_MIG_CAP("x-lazy-restore", MIGRATION_CAPABILITY_LAZY_RESTORE),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
+    DEFINE_PROP_MIG_CAP("x-predictive-convergence",
+            MIGRATION_CAPABILITY_PREDICTIVE_CONVERGENCE),
+    DEFINE_PROP_MIG_CAP("x-zero-copy-send",
+            MIGRATION_CAPABILITY_ZERO_COPY_SEND),
+    DEFINE_PROP_MIG_CAP("x-prefault-ram", MIGRATION_CAPABILITY_PREFAULT_RAM),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -4153,11 +4564,13 @@ static void migration_instance_finalize(Object *obj)
     qemu_mutex_destroy(&ms->qemu_file_lock);
     g_free(params->tls_hostname);
     g_free(params->tls_creds);
+    g_free(params->ram_file);
     qemu_sem_destroy(&ms->wait_unplug_sem);
     qemu_sem_destroy(&ms->rate_limit_sem);
     qemu_sem_destroy(&ms->pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     qemu_sem_destroy(&ms->rp_state.rp_sem);
     error_free(ms->error);
 }
@@ -4175,6 +4588,7 @@ static void migration_instance_init(Object *obj)
 
     params->tls_hostname = g_strdup("");
     params->tls_creds = g_strdup("");
+    params->ram_file = g_strdup("");
 
     /* Set has_* up only for parameter checks */
     params->has_compress_level = true;
@@ -4199,9 +4613,11 @@ static void migration_instance_init(Object *obj)
     params->has_announce_max = true;
     params->has_announce_rounds = true;
     params->has_announce_step = true;
+    params->has_postcopy_prefetch_window = true;
 
     qemu_sem_init(&ms->postcopy_pause_sem, 0);
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
     qemu_sem_init(&ms->wait_unplug_sem, 0);
@@ -45,6 +45,13 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * Buckets of the postcopy fault latency histogram: bucket N counts
+ * latencies from 2^N up to 2^(N+1) microseconds, the last one also
+ * everything slower.
+ */
+#define POSTCOPY_LATENCY_BUCKETS          20
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -77,8 +84,20 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
+    /* Last prefetch window requested, so that it is not asked twice */
+    RAMBlock *last_prefetch_rb;
+    ram_addr_t last_prefetch_end;
     void     *postcopy_tmp_page;
     void     *postcopy_tmp_zero_page;
+
+    /* Channel that carries pages we requested, with postcopy-preempt */
+    QEMUFile *postcopy_qemufile_dst;
+    bool      have_preempt_thread;
+    /* Set before the preempt channel is shut down on purpose */
+    bool      preempt_thread_quit;
+    QemuThread preempt_thread;
+    /* Temporary host page for the preempt channel */
+    void     *postcopy_preempt_tmp_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -122,6 +141,15 @@ struct MigrationIncomingState {
      * contains valid information.
      */
     QemuMutex page_request_mutex;
+
+    /*
+     * Time from fault to placement of the pages in page_requested, in
+     * microseconds.  Protected by page_request_mutex.
+     */
+    uint64_t postcopy_latency_hist[POSTCOPY_LATENCY_BUCKETS];
+    uint64_t postcopy_latency_count;
+    uint64_t postcopy_latency_total;
+    uint64_t postcopy_latency_max;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -130,6 +158,7 @@ void migration_incoming_state_destroy(void);
  * Functions to work with blocktime context
  */
 void fill_destination_postcopy_migration_info(MigrationInfo *info);
+void fill_destination_postcopy_latency_info(MigrationInfo *info);
 
 #define TYPE_MIGRATION "migration"
 
@@ -203,6 +232,24 @@ struct MigrationState {
     int64_t downtime_start;
     int64_t downtime;
     int64_t expected_downtime;
+
+    /* State of the predictive-convergence controller */
+    struct {
+        ConvergenceDecision decision;
+        /* Measured bandwidth in the last update, bytes/ms */
+        double bandwidth;
+        /* Sum of the RAMBlock dirty rates, bytes/s */
+        uint64_t dirty_rate;
+        /* Downtime if we completed now, ms */
+        int64_t predicted_downtime;
+        /* Iterations left until convergence, -1 if it doesn't converge */
+        int64_t iterations;
+        /* Prediction when the guest got stopped, -1 until then */
+        int64_t completion_prediction;
+        /* dirty_sync_count when we last throttled */
+        uint64_t throttle_sync_count;
+    } convergence;
+
     bool enabled_capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
     /*
@@ -261,6 +308,11 @@ struct MigrationState {
     /* Needed by postcopy-pause state */
     QemuSemaphore postcopy_pause_sem;
     QemuSemaphore postcopy_pause_rp_sem;
+
+    /* Channel for pages requested by the destination (postcopy-preempt) */
+    QEMUFile *postcopy_qemufile_src;
+    /* Posted once the preempt channel has connected, or failed to */
+    QemuSemaphore postcopy_qemufile_src_sem;
     /*
      * Whether we abort the migration if decompression errors are
      * detected at the destination. It is left at false for qemu
@@ -345,6 +397,14 @@ int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
 bool migrate_background_snapshot(void);
+bool migrate_lazy_restore(void);
+const char *migrate_ram_file(void);
+bool migrate_use_ram_file(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_predictive_convergence(void);
+bool migrate_use_zero_copy_send(void);
+bool migrate_prefault_ram(void);
+uint32_t migrate_postcopy_prefetch_window(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_shut(MigrationIncomingState *mis,
@@ -354,7 +414,8 @@ void migrate_send_rp_pong(MigrationIncomingState *mis,
 int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
                               ram_addr_t start, uint64_t haddr);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start);
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
@@ -12,6 +12,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -95,7 +96,10 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
 /**
  * nocomp_send_write: do the actual write of the data
  *
- * For no compression we just have to write the data.
+ * For no compression we just have to write the data.  With zero copy
+ * send the iovecs point straight at guest RAM and are handed to the
+ * kernel as they are; multifd_send_sync_main() waits for them to be
+ * sent before any page can be dirtied and queued again.
  *
  * Returns 0 for success or -1 for error
  *
@@ -105,7 +109,14 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
  */
 static int nocomp_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
 {
-    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+    int flags = 0;
+
+    if (migrate_use_zero_copy_send()) {
+        flags |= QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+    }
+
+    return qio_channel_writev_full_all(p->c, p->pages->iov, used,
+                                       NULL, 0, flags, errp);
 }
 
 /**
@@ -366,6 +377,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         }
         p->pages->iov[i].iov_base = block->host + offset;
         p->pages->iov[i].iov_len = qemu_target_page_size();
+        ramblock_recv_bitmap_set(block, p->pages->iov[i].iov_base);
     }
 
     return 0;
@@ -575,17 +587,17 @@ void multifd_save_cleanup(void)
     multifd_send_state = NULL;
 }
 
-void multifd_send_sync_main(QEMUFile *f)
+int multifd_send_sync_main(QEMUFile *f)
 {
     int i;
 
     if (!migrate_use_multifd()) {
-        return;
+        return 0;
     }
     if (multifd_send_state->pages->used) {
         if (multifd_send_pages(f) < 0) {
             error_report("%s: multifd_send_pages fail", __func__);
-            return;
+            return -1;
         }
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -598,7 +610,7 @@ void multifd_send_sync_main(QEMUFile *f)
         if (p->quit) {
             error_report("%s: channel %d has already quit", __func__, i);
             qemu_mutex_unlock(&p->mutex);
-            return;
+            return -1;
         }
 
         p->packet_num = multifd_send_state->packet_num++;
@@ -615,8 +627,33 @@ void multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        /*
+         * Pages are only requeued after the next bitmap sync, which
+         * follows this one, so waiting here for the zero copy sends
+         * guarantees that no page is still owned by the kernel when it
+         * gets dirtied and sent again.
+         */
+        if (migrate_use_zero_copy_send() && p->c) {
+            Error *err = NULL;
+            int ret = qio_channel_flush(p->c, &err);
+
+            if (ret < 0) {
+                /*
+                 * Pages may have been sent from memory that was changed
+                 * since, so the stream cannot be trusted any more.  This
+                 * also wakes up the threads whose sync we did not wait for.
+                 */
+                multifd_send_terminate_threads(err);
+                error_free(err);
+                return -1;
+            }
+            trace_multifd_send_sync_main_flush(p->id, ret == 1);
+        }
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
+
+    return 0;
 }
 
 static void *multifd_send_thread(void *opaque)
@@ -852,6 +889,13 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
         goto cleanup;
     } else {
         p->c = QIO_CHANNEL(sioc);
+        if (migrate_use_zero_copy_send() &&
+            !qio_channel_has_feature(p->c,
+                                     QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+            error_setg(&local_err, "multifd channel %d does not support "
+                       "zero copy send", p->id);
+            goto cleanup;
+        }
         qio_channel_set_delay(p->c, false);
         p->running = true;
         if (!multifd_channel_connect(p, sioc, local_err)) {
@@ -1043,6 +1087,36 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+void fill_destination_multifd_info(MigrationInfo *info)
+{
+    MultiFDRecvChannelInfoList **tail = &info->multifd_recv;
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+        MultiFDRecvChannelInfo *chan = g_new0(MultiFDRecvChannelInfo, 1);
+        int64_t elapsed = 0;
+
+        WITH_QEMU_LOCK_GUARD(&p->mutex) {
+            chan->id = p->id;
+            chan->packets = p->num_packets;
+            chan->pages = p->num_pages;
+            chan->bytes = p->num_bytes;
+            elapsed = p->last_packet_time - p->first_packet_time;
+        }
+        if (elapsed > 0) {
+            chan->throughput = muldiv64(chan->bytes,
+                                        NANOSECONDS_PER_SECOND, elapsed);
+        }
+        QAPI_LIST_APPEND(tail, chan);
+    }
+    info->has_multifd_recv = true;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1084,6 +1158,11 @@ static void *multifd_recv_thread(void *opaque)
                            p->next_packet_size);
         p->num_packets++;
         p->num_pages += used;
+        p->num_bytes += p->packet_len + p->next_packet_size;
+        p->last_packet_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (!p->first_packet_time) {
+            p->first_packet_time = p->last_packet_time;
+        }
         qemu_mutex_unlock(&p->mutex);
 
         if (used) {
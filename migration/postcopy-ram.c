@@ -20,6 +20,7 @@
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
+#include "qemu-file-channel.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
@@ -28,6 +29,10 @@
 #include "qemu/rcu.h"
 #include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/yank.h"
+#include "socket.h"
+#include "yank_functions.h"
 #include "trace.h"
 #include "hw/boards.h"
 
@@ -523,6 +528,14 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    /*
+     * The preempt thread places pages through the userfaultfd, so it has
+     * to be gone before the fd is closed.  Normally it has already been
+     * drained; if we get here with it still running, the migration
+     * failed and the remaining pages do not matter.
+     */
+    postcopy_preempt_stop(mis);
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -561,6 +574,10 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         munmap(mis->postcopy_tmp_page, mis->largest_page_size);
         mis->postcopy_tmp_page = NULL;
     }
+    if (mis->postcopy_preempt_tmp_page) {
+        munmap(mis->postcopy_preempt_tmp_page, mis->largest_page_size);
+        mis->postcopy_preempt_tmp_page = NULL;
+    }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
         mis->postcopy_tmp_zero_page = NULL;
@@ -842,6 +859,54 @@ static bool postcopy_pause_fault_thread(MigrationIncomingState *mis)
     return true;
 }
 
+/*
+ * Ask the source for the host pages following a fault, up to the
+ * postcopy-prefetch-window parameter, so that sequential access by the
+ * guest does not have to fault on every page.  The window stops at the
+ * first page we already have; the pages are not put on page_requested
+ * since nothing waits for them.
+ */
+static void postcopy_request_prefetch(MigrationIncomingState *mis,
+                                      RAMBlock *rb, ram_addr_t rb_offset)
+{
+    uint32_t window = migrate_postcopy_prefetch_window();
+    size_t pagesize = qemu_ram_pagesize(rb);
+    ram_addr_t start, end, pos;
+
+    if (!window) {
+        return;
+    }
+
+    start = rb_offset + pagesize;
+    end = MIN(start + (ram_addr_t)window * pagesize, rb->used_length);
+    /* Don't request the part of the previous window we are in again */
+    if (rb == mis->last_prefetch_rb && rb_offset < mis->last_prefetch_end &&
+        start < mis->last_prefetch_end) {
+        start = mis->last_prefetch_end;
+    }
+
+    while (start < end && ramblock_recv_bitmap_test_byte_offset(rb, start)) {
+        start += pagesize;
+    }
+    /* The request length is 32 bits on the wire */
+    end = MIN(end, start + (UINT32_MAX & ~(pagesize - 1)));
+    for (pos = start; pos < end; pos += pagesize) {
+        if (ramblock_recv_bitmap_test_byte_offset(rb, pos)) {
+            break;
+        }
+    }
+    if (pos == start) {
+        return;
+    }
+
+    trace_postcopy_request_prefetch(qemu_ram_get_idstr(rb), start,
+                                    pos - start);
+    if (!migrate_send_rp_message_req_pages(mis, rb, start, pos - start)) {
+        mis->last_prefetch_rb = rb;
+        mis->last_prefetch_end = pos;
+    }
+}
+
 /*
  * Handle faults detected by the USERFAULT markings
  */
@@ -989,6 +1054,7 @@ retry:
                     break;
                 }
             }
+            postcopy_request_prefetch(mis, rb, rb_offset);
         }
 
         /* Now handle any requests from external processes on shared memory */
@@ -1119,14 +1185,54 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     }
     memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
 
+    if (mis->postcopy_qemufile_dst) {
+        mis->postcopy_preempt_tmp_page = mmap(NULL, mis->largest_page_size,
+                                              PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS,
+                                              -1, 0);
+        if (mis->postcopy_preempt_tmp_page == MAP_FAILED) {
+            int e = errno;
+            mis->postcopy_preempt_tmp_page = NULL;
+            error_report("%s: Failed to map postcopy_preempt_tmp_page %s",
+                         __func__, strerror(e));
+            return -e;
+        }
+        qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                           postcopy_preempt_thread, mis,
+                           QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
 }
 
+/*
+ * Account the time from the fault on host_addr to its placement.
+ * Called with page_request_mutex held.
+ */
+static void postcopy_latency_account(MigrationIncomingState *mis,
+                                     void *host_addr, int64_t fault_time)
+{
+    int64_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    uint64_t us = now > fault_time ? now - fault_time : 0;
+    int bucket = 0;
+
+    if (us >= 2) {
+        bucket = MIN(63 - clz64(us), POSTCOPY_LATENCY_BUCKETS - 1);
+    }
+    mis->postcopy_latency_hist[bucket]++;
+    mis->postcopy_latency_count++;
+    mis->postcopy_latency_total += us;
+    mis->postcopy_latency_max = MAX(mis->postcopy_latency_max, us);
+    trace_postcopy_page_req_latency(host_addr, us);
+}
+
 static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
                                void *from_addr, uint64_t pagesize, RAMBlock *rb)
 {
+    int64_t *fault_time;
     int userfault_fd = mis->userfault_fd;
     int ret;
 
@@ -1152,7 +1258,9 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
          * If this page resolves a page fault for a previous recorded faulted
          * address, take a special note to maintain the requested page list.
          */
-        if (g_tree_lookup(mis->page_requested, host_addr)) {
+        fault_time = g_tree_lookup(mis->page_requested, host_addr);
+        if (fault_time) {
+            postcopy_latency_account(mis, host_addr, *fault_time);
             g_tree_remove(mis->page_requested, host_addr);
             mis->page_requested_count--;
             trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
@@ -1303,6 +1411,182 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * Populates MigrationInfo with the latency of the postcopy faults
+ * resolved so far, once the destination has started listening.
+ *
+ * @info: pointer to MigrationInfo to populate
+ */
+void fill_destination_postcopy_latency_info(MigrationInfo *info)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyLatencyInfo *lat;
+    int i;
+
+    if (!mis || postcopy_state_get() < POSTCOPY_INCOMING_LISTENING) {
+        return;
+    }
+
+    lat = g_new0(PostcopyLatencyInfo, 1);
+    qemu_mutex_lock(&mis->page_request_mutex);
+    lat->count = mis->postcopy_latency_count;
+    lat->average = mis->postcopy_latency_count ?
+                   mis->postcopy_latency_total / mis->postcopy_latency_count : 0;
+    lat->max = mis->postcopy_latency_max;
+    for (i = POSTCOPY_LATENCY_BUCKETS - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(lat->histogram, mis->postcopy_latency_hist[i]);
+    }
+    qemu_mutex_unlock(&mis->page_request_mutex);
+
+    info->has_postcopy_latency = true;
+    info->postcopy_latency = lat;
+}
+
+/*
+ * Loads the pages the source sends on the preempt channel, each host
+ * page being followed by an EOS marker.
+ */
+void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    QEMUFile *f = mis->postcopy_qemufile_dst;
+    int ret = 0;
+
+    rcu_register_thread();
+    trace_postcopy_preempt_thread_entry();
+
+    qemu_file_set_blocking(f, true);
+    while (!ret) {
+        /* Wait for the next page without holding the RCU read lock */
+        qemu_peek_byte(f, 0);
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            break;
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+        }
+    }
+
+    if (ret < 0 && !qatomic_read(&mis->preempt_thread_quit)) {
+        /*
+         * Pages the guest is waiting for may have been lost with the
+         * channel.  Break the main channel as well, so that the listen
+         * thread pauses postcopy (or fails it) and the pages are asked
+         * for again after recovery.
+         */
+        error_report("%s: postcopy preempt channel failed: %s", __func__,
+                     strerror(-ret));
+        if (mis->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+            qemu_file_shutdown(mis->from_src_file);
+        }
+    }
+
+    trace_postcopy_preempt_thread_exit(ret);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Wait until the source has ended the preempt channel and every page sent
+ * on it has been placed.  Called once the main channel has completed, so
+ * the end marker is already on its way.
+ */
+void postcopy_preempt_drain(MigrationIncomingState *mis)
+{
+    if (mis->have_preempt_thread) {
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+}
+
+/* Stop the preempt thread without waiting for the pages in flight */
+void postcopy_preempt_stop(MigrationIncomingState *mis)
+{
+    if (mis->have_preempt_thread) {
+        qatomic_set(&mis->preempt_thread_quit, true);
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+}
+
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    trace_postcopy_preempt_new_channel();
+    mis->postcopy_qemufile_dst = file;
+}
+
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        trace_postcopy_preempt_setup_failed(error_get_pretty(local_err));
+        migrate_set_error(s, local_err);
+        error_free(local_err);
+    } else {
+        trace_postcopy_preempt_new_channel_src();
+        yank_register_function(MIGRATION_YANK_INSTANCE,
+                               migration_yank_iochannel, ioc);
+        qio_channel_set_name(ioc, "migration-postcopy-preempt");
+        s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+    }
+    /* The QEMUFile holds its own reference */
+    object_unref(OBJECT(ioc));
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+}
+
+/*
+ * Start connecting the preempt channel on the source.  The migration
+ * thread waits for it with postcopy_preempt_wait_channel().
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    if (!socket_send_channel_available()) {
+        error_setg(errp, "Postcopy preempt requires a socket transport");
+        return -1;
+    }
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "Postcopy preempt does not support TLS");
+        return -1;
+    }
+
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+    return 0;
+}
+
+int postcopy_preempt_wait_channel(MigrationState *s)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+    return s->postcopy_qemufile_src ? 0 : -1;
+}
+
+void postcopy_preempt_shutdown_src(MigrationState *s)
+{
+    QEMUFile *file;
+
+    qemu_mutex_lock(&s->qemu_file_lock);
+    file = s->postcopy_qemufile_src;
+    s->postcopy_qemufile_src = NULL;
+    qemu_mutex_unlock(&s->qemu_file_lock);
+
+    if (file) {
+        qemu_file_shutdown(file);
+        qemu_fclose(file);
+    }
+}
+
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
@@ -179,4 +179,14 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd, uint64_t client_addr,
 int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                  uint64_t client_addr, uint64_t offset);
 
+/* Destination side of the postcopy-preempt channel */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+void *postcopy_preempt_thread(void *opaque);
+void postcopy_preempt_drain(MigrationIncomingState *mis);
+void postcopy_preempt_stop(MigrationIncomingState *mis);
+/* Source side of the postcopy-preempt channel */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+int postcopy_preempt_wait_channel(MigrationState *s);
+void postcopy_preempt_shutdown_src(MigrationState *s);
+
 #endif
@@ -0,0 +1,1026 @@
+/*
+ * Guest RAM stored at fixed offsets in a local file
+ *
+ * With the ram-file migration parameter set, every migratable RAMBlock
+ * gets its own slot in a local file and dirty pages are written to
+ * their slot instead of the migration stream.  The destination can
+ * read the file back in one go, or, with the lazy-restore capability,
+ * let the guest run straight away and fault pages in through
+ * userfaultfd while a background thread prefetches the rest.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "block/aio.h"
+#include "exec/target_page.h"
+#include "sysemu/runstate.h"
+#include "migration.h"
+#include "ram.h"
+#include "ram-file.h"
+#include "trace.h"
+
+#ifdef CONFIG_LINUX
+#include <poll.h>
+#include "qemu/event_notifier.h"
+#include "qemu/userfaultfd.h"
+#endif
+
+/* Every RAMBlock starts on a boundary of this size in the file */
+#define RAM_FILE_ALIGN              (1 * MiB)
+/* Largest single read when loading a block back eagerly */
+#define RAM_FILE_LOAD_CHUNK         (8 * MiB)
+/* Largest single read done by the lazy restore prefetcher */
+#define RAM_FILE_PREFETCH_CHUNK     (1 * MiB)
+/* How far past a fault the prefetcher reads before resuming its sweep */
+#define RAM_FILE_FAULT_WINDOW       (4 * MiB)
+/* Maximum number of userfaultfd messages read at once */
+#define RAM_FILE_MAX_EVENTS         16
+
+typedef struct RAMFileBlock {
+    RAMBlock *rb;
+    uint8_t *host;
+    uint64_t file_offset;
+    uint64_t length;
+    size_t page_size;
+    unsigned long nr_pages;
+    /* Pages already placed in guest memory (lazy restore only) */
+    unsigned long *placed;
+    /* UFFDIO_ZEROPAGE is available for this range */
+    bool zeroable;
+} RAMFileBlock;
+
+typedef struct RAMFileSaveState {
+    int fd;
+    /* End of the last slot handed out by ram_file_reserve() */
+    uint64_t size;
+    /* Target pages that hold data in the file; clear ones read as zero */
+    unsigned long *written;
+    unsigned long written_nbits;
+} RAMFileSaveState;
+
+typedef struct RAMFileLoadState {
+    int fd;
+    /* Blocks announced by the incoming stream, of RAMFileBlock */
+    GArray *blocks;
+} RAMFileLoadState;
+
+static RAMFileSaveState ram_file_save = { .fd = -1 };
+static RAMFileLoadState ram_file_load = { .fd = -1 };
+
+static int ram_file_pread(int fd, void *buf, size_t len, uint64_t pos)
+{
+    uint8_t *p = buf;
+
+    while (len) {
+        ssize_t ret = pread(fd, p, len, pos);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            /* Trailing zero pages are never written, so read as zeroes */
+            memset(p, 0, len);
+            return 0;
+        }
+        p += ret;
+        pos += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int ram_file_pwrite(int fd, const void *buf, size_t len, uint64_t pos)
+{
+    const uint8_t *p = buf;
+
+    while (len) {
+        ssize_t ret = pwrite(fd, p, len, pos);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        p += ret;
+        pos += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/*
+ * Capabilities that move pages outside the ram-file or leave RAMBlocks
+ * out of it; checked on both sides since either may have them set.
+ */
+static int ram_file_check_caps(Error **errp)
+{
+    if (migrate_postcopy_ram() || migrate_use_multifd() ||
+        migrate_use_compression() || migrate_use_xbzrle() ||
+        migrate_colo_enabled() || migrate_ignore_shared()) {
+        error_setg(errp, "ram-file is not compatible with postcopy-ram, "
+                   "multifd, compress, xbzrle, x-colo or x-ignore-shared");
+        return -1;
+    }
+    return 0;
+}
+
+static int ram_file_discard(int fd, uint64_t pos, size_t len)
+{
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  pos, len) == 0) {
+        return 0;
+    }
+#endif
+    {
+        g_autofree uint8_t *zeroes = g_malloc0(len);
+
+        return ram_file_pwrite(fd, zeroes, len, pos);
+    }
+}
+
+/**
+ * ram_file_save_setup: create the ram-file on the source
+ *
+ * Returns 0 for success or -1 on error
+ *
+ * @errp: pointer to an error
+ */
+int ram_file_save_setup(Error **errp)
+{
+    RAMFileSaveState *rf = &ram_file_save;
+    const char *path = migrate_ram_file();
+
+    if (ram_file_check_caps(errp)) {
+        return -1;
+    }
+    if (ram_file_lazy_restore_active()) {
+        error_setg(errp, "ram-file cannot be written while a lazy restore "
+                   "is reading from it");
+        return -1;
+    }
+
+    ram_file_save_cleanup();
+    rf->fd = qemu_open_old(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (rf->fd < 0) {
+        error_setg_errno(errp, errno, "Failed to create ram-file '%s'", path);
+        return -1;
+    }
+    trace_ram_file_save_setup(path);
+    return 0;
+}
+
+/**
+ * ram_file_reserve: hand out the file slot for a RAMBlock
+ *
+ * Returns the offset of the slot within the ram-file
+ *
+ * @length: used length of the RAMBlock
+ */
+uint64_t ram_file_reserve(ram_addr_t length)
+{
+    RAMFileSaveState *rf = &ram_file_save;
+    uint64_t offset = ROUND_UP(rf->size, RAM_FILE_ALIGN);
+    unsigned long nbits;
+
+    rf->size = offset + length;
+    nbits = DIV_ROUND_UP(rf->size, qemu_target_page_size());
+    rf->written = bitmap_zero_extend(rf->written, rf->written_nbits, nbits);
+    rf->written_nbits = nbits;
+    return offset;
+}
+
+/**
+ * ram_file_save_page: store a page in its ram-file slot
+ *
+ * Returns the number of bytes written to the file or negative errno
+ *
+ * @pos: position of the page within the ram-file
+ * @buf: page contents
+ * @len: length of the page, a multiple of the target page size
+ * @zero: the page is all zeroes
+ */
+int ram_file_save_page(uint64_t pos, const uint8_t *buf, size_t len,
+                       bool zero)
+{
+    RAMFileSaveState *rf = &ram_file_save;
+    unsigned long nr = pos >> qemu_target_page_bits();
+    unsigned long count = len >> qemu_target_page_bits();
+    int ret;
+
+    if (zero) {
+        /* Slots that never held data already read back as zeroes */
+        if (find_next_bit(rf->written, nr + count, nr) == nr + count) {
+            return 0;
+        }
+        ret = ram_file_discard(rf->fd, pos, len);
+        if (ret == 0) {
+            bitmap_clear(rf->written, nr, count);
+        }
+        return ret;
+    }
+
+    ret = ram_file_pwrite(rf->fd, buf, len, pos);
+    if (ret < 0) {
+        return ret;
+    }
+    bitmap_set(rf->written, nr, count);
+    return len;
+}
+
+/**
+ * ram_file_save_sync: make the ram-file complete and durable
+ *
+ * Called once all dirty pages have been written, before the
+ * destination is told it may read the file.
+ *
+ * Returns 0 for success or -1 on error
+ *
+ * @errp: pointer to an error
+ */
+int ram_file_save_sync(Error **errp)
+{
+    RAMFileSaveState *rf = &ram_file_save;
+
+    if (ftruncate(rf->fd, rf->size) < 0) {
+        error_setg_errno(errp, errno, "Failed to resize ram-file");
+        return -1;
+    }
+    if (qemu_fdatasync(rf->fd) < 0) {
+        error_setg_errno(errp, errno, "Failed to sync ram-file");
+        return -1;
+    }
+    trace_ram_file_save_sync(rf->size);
+    return 0;
+}
+
+void ram_file_save_cleanup(void)
+{
+    RAMFileSaveState *rf = &ram_file_save;
+
+    if (rf->fd >= 0) {
+        close(rf->fd);
+        rf->fd = -1;
+    }
+    g_free(rf->written);
+    rf->written = NULL;
+    rf->written_nbits = 0;
+    rf->size = 0;
+}
+
+static void ram_file_load_blocks_free(GArray *blocks)
+{
+    guint i;
+
+    if (!blocks) {
+        return;
+    }
+    for (i = 0; i < blocks->len; i++) {
+        g_free(g_array_index(blocks, RAMFileBlock, i).placed);
+    }
+    g_array_free(blocks, true);
+}
+
+static int ram_file_load_eager(RAMFileLoadState *rf, Error **errp)
+{
+    guint i;
+
+    for (i = 0; i < rf->blocks->len; i++) {
+        RAMFileBlock *blk = &g_array_index(rf->blocks, RAMFileBlock, i);
+        uint64_t done;
+
+        for (done = 0; done < blk->length; done += RAM_FILE_LOAD_CHUNK) {
+            size_t len = MIN(RAM_FILE_LOAD_CHUNK, blk->length - done);
+            int ret = ram_file_pread(rf->fd, blk->host + done, len,
+                                     blk->file_offset + done);
+
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Failed to read block '%s' "
+                                 "from ram-file",
+                                 qemu_ram_get_idstr(blk->rb));
+                return -1;
+            }
+        }
+        trace_ram_file_load_block(qemu_ram_get_idstr(blk->rb),
+                                  blk->file_offset, blk->length);
+    }
+    return 0;
+}
+
+#ifdef CONFIG_LINUX
+
+typedef struct LazyRestoreState {
+    int fd;
+    int uffd;
+    /* Of RAMFileBlock, taken over from the incoming migration */
+    GArray *blocks;
+    size_t max_page_size;
+
+    QemuThread fault_thread;
+    QemuThread prefetch_thread;
+    bool threads_running;
+    bool quit;
+    EventNotifier quit_notifier;
+
+    /*
+     * Serializes page placement with the fault thread and protects the
+     * placed bitmaps, the prefetch position and the counters below.
+     */
+    QemuMutex lock;
+    /* Pages to prefetch right after the most recent fault */
+    guint hint_block;
+    unsigned long hint_page;
+    unsigned long hint_left;
+    /* Position of the background sweep */
+    guint sweep_block;
+    unsigned long sweep_page;
+
+    bool active;
+    /* Guest RAM could not be restored; the guest has been stopped */
+    bool failed;
+    uint64_t total_pages;
+    uint64_t placed_pages;
+    uint64_t faulted_pages;
+    uint64_t prefetched_pages;
+    /* Sum of fault service times, in ns */
+    uint64_t fault_latency;
+    int64_t start_time;
+    int64_t end_time;
+} LazyRestoreState;
+
+/*
+ * The most recent lazy restore; kept after completion so that its
+ * statistics remain visible in query-migrate.
+ */
+static LazyRestoreState *lazy_restore;
+
+bool ram_file_lazy_restore_supported(void)
+{
+    uint64_t features;
+
+    /* MISSING mode on anonymous memory is part of the base UFFD API */
+    return uffd_query_features(&features) == 0;
+}
+
+bool ram_file_lazy_restore_active(void)
+{
+    return lazy_restore && qatomic_read(&lazy_restore->active);
+}
+
+static RAMFileBlock *lazy_restore_find_block(LazyRestoreState *lr,
+                                             uint64_t addr, guint *idx)
+{
+    guint i;
+
+    for (i = 0; i < lr->blocks->len; i++) {
+        RAMFileBlock *blk = &g_array_index(lr->blocks, RAMFileBlock, i);
+
+        if (addr >= (uintptr_t)blk->host &&
+            addr < (uintptr_t)blk->host + blk->length) {
+            *idx = i;
+            return blk;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Place the pages [page, page + npages) of @blk from @buf, skipping any
+ * page that has been placed in the meantime.  Called with lr->lock held.
+ *
+ * Returns the number of pages placed or -1 on error.
+ */
+static int lazy_restore_place(LazyRestoreState *lr, RAMFileBlock *blk,
+                              unsigned long page, unsigned long npages,
+                              uint8_t *buf)
+{
+    unsigned long end = page + npages;
+    unsigned long cur = page;
+    int placed = 0;
+
+    while (cur < end) {
+        unsigned long first = find_next_zero_bit(blk->placed, end, cur);
+        unsigned long last;
+        uint8_t *src, *dst;
+        bool zero;
+        int ret;
+
+        if (first >= end) {
+            break;
+        }
+
+        /* Group a run of missing pages that are all zero or all not */
+        src = buf + (first - page) * blk->page_size;
+        zero = blk->zeroable && buffer_is_zero(src, blk->page_size);
+        for (last = first + 1; last < end && !test_bit(last, blk->placed);
+             last++) {
+            uint8_t *next = buf + (last - page) * blk->page_size;
+
+            if (blk->zeroable &&
+                buffer_is_zero(next, blk->page_size) != zero) {
+                break;
+            }
+        }
+
+        dst = blk->host + first * blk->page_size;
+        if (zero) {
+            ret = uffd_zero_page(lr->uffd, dst,
+                                 (last - first) * blk->page_size, false);
+        } else {
+            ret = uffd_copy_page(lr->uffd, dst, src,
+                                 (last - first) * blk->page_size, false);
+        }
+        if (ret) {
+            error_report("%s: failed to place pages of '%s' at %p",
+                         __func__, qemu_ram_get_idstr(blk->rb), dst);
+            return -1;
+        }
+
+        bitmap_set(blk->placed, first, last - first);
+        lr->placed_pages += last - first;
+        placed += last - first;
+        cur = last;
+    }
+    return placed;
+}
+
+/*
+ * Pages can no longer be read from the ram-file.  Dropping the userfaultfd
+ * registration wakes every vCPU waiting for a page, which then sees a zero
+ * page, so stop the guest before it runs on with them.
+ */
+static void lazy_restore_fail(LazyRestoreState *lr)
+{
+    guint i;
+
+    qemu_mutex_lock(&lr->lock);
+    if (lr->failed) {
+        qemu_mutex_unlock(&lr->lock);
+        return;
+    }
+    lr->failed = true;
+    qatomic_set(&lr->quit, true);
+    qemu_system_vmstop_request_prepare();
+    qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
+
+    for (i = 0; i < lr->blocks->len; i++) {
+        RAMFileBlock *blk = &g_array_index(lr->blocks, RAMFileBlock, i);
+
+        uffd_unregister_memory(lr->uffd, blk->host, blk->length);
+    }
+    qemu_mutex_unlock(&lr->lock);
+
+    error_report("Lazy restore failed, guest RAM is incomplete; "
+                 "stopping the guest");
+}
+
+static void lazy_restore_handle_fault(LazyRestoreState *lr, uint64_t addr,
+                                      uint8_t *buf)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    RAMFileBlock *blk;
+    unsigned long page;
+    uint8_t *host;
+    guint idx;
+    int ret;
+
+    blk = lazy_restore_find_block(lr, addr, &idx);
+    if (!blk) {
+        error_report("%s: fault at 0x%" PRIx64 " outside of guest RAM",
+                     __func__, addr);
+        return;
+    }
+    page = (addr - (uintptr_t)blk->host) / blk->page_size;
+    host = blk->host + page * blk->page_size;
+    trace_lazy_restore_fault(qemu_ram_get_idstr(blk->rb), addr, page);
+
+    qemu_mutex_lock(&lr->lock);
+    ret = test_bit(page, blk->placed);
+    qemu_mutex_unlock(&lr->lock);
+    if (ret) {
+        /* Raced with the prefetcher; the page is there already */
+        uffd_wakeup(lr->uffd, host, blk->page_size);
+        return;
+    }
+
+    ret = ram_file_pread(lr->fd, buf, blk->page_size,
+                         blk->file_offset + page * blk->page_size);
+    if (ret < 0) {
+        error_report("%s: failed to read ram-file: %s", __func__,
+                     strerror(-ret));
+        lazy_restore_fail(lr);
+        return;
+    }
+
+    qemu_mutex_lock(&lr->lock);
+    ret = lazy_restore_place(lr, blk, page, 1, buf);
+    if (ret < 0) {
+        qemu_mutex_unlock(&lr->lock);
+        lazy_restore_fail(lr);
+        return;
+    }
+    if (ret == 0) {
+        uffd_wakeup(lr->uffd, host, blk->page_size);
+    } else if (ret > 0) {
+        lr->faulted_pages++;
+        lr->fault_latency += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    }
+    /* Guests tend to touch neighbouring pages next */
+    lr->hint_block = idx;
+    lr->hint_page = page + 1;
+    lr->hint_left = MAX(1, RAM_FILE_FAULT_WINDOW / blk->page_size);
+    qemu_mutex_unlock(&lr->lock);
+}
+
+static void *lazy_restore_fault_thread(void *opaque)
+{
+    LazyRestoreState *lr = opaque;
+    struct uffd_msg msgs[RAM_FILE_MAX_EVENTS];
+    struct pollfd pfd[2];
+    uint8_t *buf = qemu_memalign(qemu_real_host_page_size,
+                                 lr->max_page_size);
+
+    pfd[0].fd = lr->uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = event_notifier_get_fd(&lr->quit_notifier);
+    pfd[1].events = POLLIN;
+
+    while (!qatomic_read(&lr->quit)) {
+        int i, n;
+
+        pfd[0].revents = pfd[1].revents = 0;
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: poll failed: %s", __func__, strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        if (!(pfd[0].revents & POLLIN)) {
+            continue;
+        }
+
+        n = uffd_read_events(lr->uffd, msgs, RAM_FILE_MAX_EVENTS);
+        if (n < 0) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (msgs[i].event == UFFD_EVENT_PAGEFAULT) {
+                lazy_restore_handle_fault(lr, msgs[i].arg.pagefault.address,
+                                          buf);
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    return NULL;
+}
+
+/*
+ * Pick the next run of missing pages for the prefetcher: right behind the
+ * most recent fault first, otherwise wherever the sweep has got to.
+ * Called with lr->lock held.
+ */
+static RAMFileBlock *lazy_restore_next_run(LazyRestoreState *lr,
+                                           unsigned long *page,
+                                           unsigned long *npages)
+{
+    RAMFileBlock *blk = NULL;
+    unsigned long first = 0, limit, max;
+
+    if (lr->hint_left) {
+        RAMFileBlock *hb = &g_array_index(lr->blocks, RAMFileBlock,
+                                          lr->hint_block);
+
+        limit = MIN(hb->nr_pages, lr->hint_page + lr->hint_left);
+        first = find_next_zero_bit(hb->placed, limit, lr->hint_page);
+        if (first < limit) {
+            blk = hb;
+        } else {
+            lr->hint_left = 0;
+        }
+    }
+
+    if (!blk) {
+        for (; lr->sweep_block < lr->blocks->len;
+             lr->sweep_block++, lr->sweep_page = 0) {
+            RAMFileBlock *sb = &g_array_index(lr->blocks, RAMFileBlock,
+                                              lr->sweep_block);
+
+            first = find_next_zero_bit(sb->placed, sb->nr_pages,
+                                       lr->sweep_page);
+            if (first < sb->nr_pages) {
+                blk = sb;
+                break;
+            }
+        }
+        if (!blk) {
+            return NULL;
+        }
+        limit = blk->nr_pages;
+    }
+
+    max = MAX(1, RAM_FILE_PREFETCH_CHUNK / blk->page_size);
+    limit = MIN(limit, first + max);
+    *page = first;
+    *npages = find_next_bit(blk->placed, limit, first) - first;
+
+    if (lr->hint_left) {
+        unsigned long used = first + *npages - lr->hint_page;
+
+        lr->hint_page = first + *npages;
+        lr->hint_left = lr->hint_left > used ? lr->hint_left - used : 0;
+    } else {
+        lr->sweep_page = first + *npages;
+    }
+    return blk;
+}
+
+static void lazy_restore_finish_bh(void *opaque);
+
+static void *lazy_restore_prefetch_thread(void *opaque)
+{
+    LazyRestoreState *lr = opaque;
+    size_t buf_size = MAX(RAM_FILE_PREFETCH_CHUNK, lr->max_page_size);
+    uint8_t *buf = qemu_memalign(qemu_real_host_page_size, buf_size);
+    bool complete = false;
+
+    while (!qatomic_read(&lr->quit)) {
+        RAMFileBlock *blk;
+        unsigned long page, npages;
+        int ret;
+
+        qemu_mutex_lock(&lr->lock);
+        blk = lazy_restore_next_run(lr, &page, &npages);
+        qemu_mutex_unlock(&lr->lock);
+        if (!blk) {
+            complete = true;
+            break;
+        }
+
+        /* Read outside the lock so faults are not held up behind I/O */
+        ret = ram_file_pread(lr->fd, buf, npages * blk->page_size,
+                             blk->file_offset + page * blk->page_size);
+        if (ret < 0) {
+            error_report("%s: failed to read ram-file: %s", __func__,
+                         strerror(-ret));
+            lazy_restore_fail(lr);
+            break;
+        }
+
+        qemu_mutex_lock(&lr->lock);
+        ret = lazy_restore_place(lr, blk, page, npages, buf);
+        if (ret > 0) {
+            lr->prefetched_pages += ret;
+        }
+        qemu_mutex_unlock(&lr->lock);
+        if (ret < 0) {
+            lazy_restore_fail(lr);
+            break;
+        }
+    }
+
+    qemu_vfree(buf);
+    if (complete) {
+        aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                lazy_restore_finish_bh, NULL);
+    }
+    return NULL;
+}
+
+/* Tear down the userfaultfd side of @lr, keeping its statistics */
+static void lazy_restore_stop(LazyRestoreState *lr)
+{
+    guint i;
+
+    if (lr->threads_running) {
+        qatomic_set(&lr->quit, true);
+        event_notifier_set(&lr->quit_notifier);
+        qemu_thread_join(&lr->prefetch_thread);
+        qemu_thread_join(&lr->fault_thread);
+        lr->threads_running = false;
+        event_notifier_cleanup(&lr->quit_notifier);
+    }
+
+    if (lr->blocks) {
+        for (i = 0; i < lr->blocks->len; i++) {
+            RAMFileBlock *blk = &g_array_index(lr->blocks, RAMFileBlock, i);
+
+            if (blk->placed) {
+                if (!lr->failed) {
+                    uffd_unregister_memory(lr->uffd, blk->host, blk->length);
+                }
+                qemu_madvise(blk->host, blk->length, QEMU_MADV_HUGEPAGE);
+            }
+        }
+        ram_file_load_blocks_free(lr->blocks);
+        lr->blocks = NULL;
+    }
+    if (lr->uffd >= 0) {
+        uffd_close_fd(lr->uffd);
+        lr->uffd = -1;
+    }
+    if (lr->fd >= 0) {
+        close(lr->fd);
+        lr->fd = -1;
+    }
+
+    qemu_mutex_lock(&lr->lock);
+    if (lr->active) {
+        lr->end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        qatomic_set(&lr->active, false);
+    }
+    qemu_mutex_unlock(&lr->lock);
+}
+
+/* Guest RAM is about to be overwritten, stop feeding it */
+static void lazy_restore_cancel(void)
+{
+    if (lazy_restore) {
+        lazy_restore_stop(lazy_restore);
+    }
+}
+
+static void lazy_restore_free(LazyRestoreState *lr)
+{
+    lazy_restore_stop(lr);
+    qemu_mutex_destroy(&lr->lock);
+    g_free(lr);
+}
+
+static void lazy_restore_finish_bh(void *opaque)
+{
+    LazyRestoreState *lr = lazy_restore;
+
+    /* A new restore may have replaced the one that scheduled us */
+    if (!lr || !lr->active || lr->placed_pages < lr->total_pages) {
+        return;
+    }
+    lazy_restore_stop(lr);
+    trace_lazy_restore_complete(lr->faulted_pages, lr->prefetched_pages,
+                                lr->end_time - lr->start_time);
+}
+
+static int lazy_restore_start(RAMFileLoadState *rf, Error **errp)
+{
+    LazyRestoreState *lr;
+    guint i;
+
+    if (lazy_restore) {
+        lazy_restore_free(lazy_restore);
+        lazy_restore = NULL;
+    }
+
+    lr = g_new0(LazyRestoreState, 1);
+    lr->fd = -1;
+    qemu_mutex_init(&lr->lock);
+    lr->uffd = uffd_create_fd(0, true);
+    if (lr->uffd < 0) {
+        error_setg(errp, "Failed to create userfaultfd");
+        goto fail;
+    }
+
+    lr->blocks = rf->blocks;
+    for (i = 0; i < lr->blocks->len; i++) {
+        RAMFileBlock *blk = &g_array_index(lr->blocks, RAMFileBlock, i);
+        const char *name = qemu_ram_get_idstr(blk->rb);
+        uint64_t ioctls;
+
+        if (blk->length % blk->page_size) {
+            error_setg(errp, "Block '%s' is not a whole number of pages",
+                       name);
+            goto fail;
+        }
+        /*
+         * Other processes, such as vhost-user back ends, access shared
+         * memory directly and would never fault on the missing pages.
+         */
+        if (qemu_ram_is_shared(blk->rb)) {
+            error_setg(errp, "Block '%s' is shared memory", name);
+            goto fail;
+        }
+        /* Placing pages one by one would split transparent huge pages */
+        qemu_madvise(blk->host, blk->length, QEMU_MADV_NOHUGEPAGE);
+        if (ram_discard_range(name, 0, blk->length)) {
+            error_setg(errp, "Failed to discard block '%s'", name);
+            goto fail;
+        }
+        if (uffd_register_memory(lr->uffd, blk->host, blk->length,
+                                 UFFDIO_REGISTER_MODE_MISSING, &ioctls)) {
+            error_setg(errp, "Failed to register block '%s' with "
+                       "userfaultfd", name);
+            goto fail;
+        }
+        blk->placed = bitmap_new(blk->nr_pages);
+        if (!(ioctls & (1ULL << _UFFDIO_COPY))) {
+            error_setg(errp, "userfaultfd cannot copy pages into block '%s'",
+                       name);
+            goto fail;
+        }
+        blk->zeroable = ioctls & (1ULL << _UFFDIO_ZEROPAGE);
+        lr->max_page_size = MAX(lr->max_page_size, blk->page_size);
+        lr->total_pages += blk->nr_pages;
+    }
+
+    if (event_notifier_init(&lr->quit_notifier, false)) {
+        error_setg(errp, "Failed to create lazy restore event notifier");
+        goto fail;
+    }
+
+    /* The restore owns the file and the block list from now on */
+    lr->fd = rf->fd;
+    rf->fd = -1;
+    rf->blocks = NULL;
+
+    lr->active = true;
+    lr->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    lr->threads_running = true;
+    qemu_thread_create(&lr->fault_thread, "lazy-restore-fault",
+                       lazy_restore_fault_thread, lr, QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&lr->prefetch_thread, "lazy-restore-prefetch",
+                       lazy_restore_prefetch_thread, lr, QEMU_THREAD_JOINABLE);
+    lazy_restore = lr;
+    trace_lazy_restore_start(lr->blocks->len, lr->total_pages);
+    return 0;
+
+fail:
+    /* Leave the block list to the caller for the eager fallback */
+    if (lr->blocks) {
+        for (i = 0; i < lr->blocks->len; i++) {
+            RAMFileBlock *blk = &g_array_index(lr->blocks, RAMFileBlock, i);
+
+            if (blk->placed) {
+                uffd_unregister_memory(lr->uffd, blk->host, blk->length);
+                g_free(blk->placed);
+                blk->placed = NULL;
+            }
+            qemu_madvise(blk->host, blk->length, QEMU_MADV_HUGEPAGE);
+        }
+        lr->blocks = NULL;
+    }
+    lazy_restore_free(lr);
+    return -1;
+}
+
+void fill_destination_lazy_restore_info(MigrationInfo *info)
+{
+    LazyRestoreState *lr = lazy_restore;
+    LazyRestoreInfo *lri;
+
+    if (!lr) {
+        return;
+    }
+
+    lri = g_new0(LazyRestoreInfo, 1);
+    qemu_mutex_lock(&lr->lock);
+    lri->active = lr->active;
+    lri->total_pages = lr->total_pages;
+    lri->faulted_pages = lr->faulted_pages;
+    lri->prefetched_pages = lr->prefetched_pages;
+    lri->fault_latency_avg = lr->faulted_pages ?
+        lr->fault_latency / lr->faulted_pages / SCALE_US : 0;
+    lri->restore_time = (lr->active ?
+                         qemu_clock_get_ms(QEMU_CLOCK_REALTIME) :
+                         lr->end_time) - lr->start_time;
+    qemu_mutex_unlock(&lr->lock);
+
+    info->has_lazy_restore = true;
+    info->lazy_restore = lri;
+}
+
+#else /* !CONFIG_LINUX */
+
+bool ram_file_lazy_restore_supported(void)
+{
+    return false;
+}
+
+bool ram_file_lazy_restore_active(void)
+{
+    return false;
+}
+
+static void lazy_restore_cancel(void)
+{
+}
+
+static int lazy_restore_start(RAMFileLoadState *rf, Error **errp)
+{
+    error_setg(errp, "Lazy restore is only supported on Linux");
+    return -1;
+}
+
+void fill_destination_lazy_restore_info(MigrationInfo *info)
+{
+}
+
+#endif /* CONFIG_LINUX */
+
+/**
+ * ram_file_load_setup: open the ram-file on the destination
+ *
+ * Returns 0 for success or -1 on error
+ *
+ * @errp: pointer to an error
+ */
+int ram_file_load_setup(Error **errp)
+{
+    RAMFileLoadState *rf = &ram_file_load;
+    const char *path = migrate_ram_file();
+
+    if (ram_file_check_caps(errp)) {
+        return -1;
+    }
+
+    lazy_restore_cancel();
+    ram_file_load_cleanup();
+    rf->fd = qemu_open_old(path, O_RDONLY);
+    if (rf->fd < 0) {
+        error_setg_errno(errp, errno, "Failed to open ram-file '%s'", path);
+        return -1;
+    }
+    rf->blocks = g_array_new(false, true, sizeof(RAMFileBlock));
+    trace_ram_file_load_setup(path);
+    return 0;
+}
+
+/**
+ * ram_file_load_block: note where a RAMBlock lives in the ram-file
+ *
+ * @rb: the RAMBlock
+ * @file_offset: offset of its slot as announced by the source
+ */
+void ram_file_load_block(RAMBlock *rb, uint64_t file_offset)
+{
+    RAMFileLoadState *rf = &ram_file_load;
+    RAMFileBlock blk = {
+        .rb = rb,
+        .host = qemu_ram_get_host_addr(rb),
+        .file_offset = file_offset,
+        .length = qemu_ram_get_used_length(rb),
+        .page_size = qemu_ram_pagesize(rb),
+    };
+
+    blk.nr_pages = blk.length / blk.page_size;
+    g_array_append_val(rf->blocks, blk);
+}
+
+/**
+ * ram_file_load_complete: bring guest RAM in from the ram-file
+ *
+ * The source has finished writing the file.  With lazy-restore the
+ * guest is allowed to run before its memory is fully read; if that
+ * cannot be set up we fall back to reading everything now.
+ *
+ * Returns 0 for success or -1 on error
+ *
+ * @errp: pointer to an error
+ */
+int ram_file_load_complete(Error **errp)
+{
+    RAMFileLoadState *rf = &ram_file_load;
+    int ret;
+
+    if (migrate_lazy_restore()) {
+        Error *local_err = NULL;
+
+        if (!lazy_restore_start(rf, &local_err)) {
+            return 0;
+        }
+        warn_report_err(local_err);
+        warn_report("Lazy restore unavailable, loading ram-file eagerly");
+    }
+
+    ret = ram_file_load_eager(rf, errp);
+    ram_file_load_cleanup();
+    return ret;
+}
+
+void ram_file_load_cleanup(void)
+{
+    RAMFileLoadState *rf = &ram_file_load;
+
+    if (rf->fd >= 0) {
+        close(rf->fd);
+        rf->fd = -1;
+    }
+    ram_file_load_blocks_free(rf->blocks);
+    rf->blocks = NULL;
+}
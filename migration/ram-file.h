@@ -0,0 +1,32 @@
+/*
+ * Guest RAM stored at fixed offsets in a local file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_RAM_FILE_H
+#define QEMU_MIGRATION_RAM_FILE_H
+
+#include "exec/cpu-common.h"
+#include "qapi/qapi-types-migration.h"
+
+/* Source side */
+int ram_file_save_setup(Error **errp);
+uint64_t ram_file_reserve(ram_addr_t length);
+int ram_file_save_page(uint64_t pos, const uint8_t *buf, size_t len,
+                       bool zero);
+int ram_file_save_sync(Error **errp);
+void ram_file_save_cleanup(void);
+
+/* Destination side */
+int ram_file_load_setup(Error **errp);
+void ram_file_load_block(RAMBlock *rb, uint64_t file_offset);
+int ram_file_load_complete(Error **errp);
+void ram_file_load_cleanup(void);
+
+bool ram_file_lazy_restore_supported(void);
+bool ram_file_lazy_restore_active(void);
+void fill_destination_lazy_restore_info(MigrationInfo *info);
+
+#endif
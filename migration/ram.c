@@ -29,6 +29,7 @@
 #include "qemu/osdep.h"
 #include "cpu.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
@@ -56,6 +57,7 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "ram-file.h"
 #include "sysemu/runstate.h"
 
 #if defined(__linux__)
@@ -80,6 +82,8 @@
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* All pages are in the ram-file, the destination may read it */
+#define RAM_SAVE_FLAG_FILE_SYNC        0x200
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
@@ -309,6 +313,8 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /* Last block sent on the postcopy preempt channel */
+    RAMBlock *last_sent_block_preempt;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -652,6 +658,38 @@ static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
     }
 }
 
+/**
+ * mig_throttle_guest_to_rate: throttle the guest to a target dirty rate
+ *
+ * Used by the predictive-convergence controller instead of the
+ * stepwise increase of mig_throttle_guest_down().  Assumes the dirty
+ * rate scales with the CPU time left to the guest, and only ever
+ * increases the throttle; if the assumption does not hold, the next
+ * measured rate leads to a further increase.
+ *
+ * @dirty_rate: current dirty rate in bytes per second
+ * @target_rate: dirty rate in bytes per second we want to get under
+ */
+void mig_throttle_guest_to_rate(uint64_t dirty_rate, uint64_t target_rate)
+{
+    MigrationState *s = migrate_get_current();
+    uint64_t pct_max = s->parameters.max_cpu_throttle;
+    uint64_t throttle_now = cpu_throttle_get_percentage();
+    uint64_t cpu_now = 100 - throttle_now;
+    uint64_t cpu_ideal, throttle;
+
+    if (dirty_rate <= target_rate) {
+        return;
+    }
+
+    cpu_ideal = cpu_now * target_rate / dirty_rate;
+    throttle = MIN(100 - cpu_ideal, pct_max);
+    if (throttle > throttle_now) {
+        trace_mig_throttle_guest_to_rate(dirty_rate, target_rate, throttle);
+        cpu_throttle_set(throttle);
+    }
+}
+
 /**
  * xbzrle_cache_zero_page: insert a zero page in the XBZRLE cache
  *
@@ -864,6 +902,72 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
 
     rs->migration_dirty_pages += new_dirty_pages;
     rs->num_dirty_pages_period += new_dirty_pages;
+    rb->dirty_pages_period += new_dirty_pages;
+}
+
+/*
+ * Update the dirty rate of every RAMBlock from the pages dirtied in the
+ * last period.  The rate is averaged with the previous one so that a
+ * single bursty period does not dominate the predictions.
+ */
+static void ramblock_update_dirty_rates(int64_t period_ms)
+{
+    RAMBlock *block;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        uint64_t rate = block->dirty_pages_period * TARGET_PAGE_SIZE * 1000 /
+                        period_ms;
+
+        block->dirty_rate = block->dirty_rate ?
+                            (block->dirty_rate + rate) / 2 : rate;
+        block->dirty_pages_period = 0;
+    }
+}
+
+/**
+ * ram_dirty_rate: sum of the RAMBlock dirty rates
+ *
+ * Returns the rate in bytes per second at which the guest dirties pages
+ * that were already sent, as of the last dirty rate update.
+ */
+uint64_t ram_dirty_rate(void)
+{
+    RAMBlock *block;
+    uint64_t rate = 0;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        rate += block->dirty_rate;
+    }
+
+    return rate;
+}
+
+/**
+ * ram_predict_dirty_bytes: predict how much memory is dirtied again
+ *
+ * Returns the number of bytes expected to be dirtied within @ms
+ * milliseconds.  A RAMBlock cannot contribute more than its size, so a
+ * block that is rewritten as a whole stops adding up once saturated.
+ *
+ * @ms: length of the window in milliseconds
+ */
+uint64_t ram_predict_dirty_bytes(uint64_t ms)
+{
+    RAMBlock *block;
+    uint64_t bytes = 0;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        bytes += MIN(block->dirty_rate * ms / 1000,
+                     (uint64_t)block->used_length);
+    }
+
+    return bytes;
 }
 
 /**
@@ -901,6 +1005,7 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
     /* calculate period counters */
     ram_counters.dirty_pages_rate = rs->num_dirty_pages_period * 1000
                 / (end_time - rs->time_last_bitmap_sync);
+    ramblock_update_dirty_rates(end_time - rs->time_last_bitmap_sync);
 
     if (!page_count) {
         return;
@@ -957,7 +1062,8 @@ static void migration_trigger_throttle(RAMState *rs)
     /* During block migration the auto-converge logic incorrectly detects
      * that ram migration makes no progress. Avoid this by disabling the
      * throttling logic during the bulk phase of block migration. */
-    if (migrate_auto_converge() && !blk_mig_bulk_active()) {
+    if (migrate_auto_converge() && !migrate_predictive_convergence() &&
+        !blk_mig_bulk_active()) {
         /* The following detection logic can be refined later. For now:
            Check to see if the ratio between dirtied bytes and the approx.
            amount of bytes that just got transferred since the last time
@@ -1220,6 +1326,43 @@ static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
     return 1;
 }
 
+/**
+ * ram_save_file_page: write a page to its slot in the ram-file
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int ram_save_file_page(RAMState *rs, RAMBlock *block,
+                              ram_addr_t offset)
+{
+    uint8_t *p = block->host + offset;
+    bool zero = is_zero_range(p, TARGET_PAGE_SIZE);
+    int len;
+
+    len = ram_file_save_page(block->file_offset + offset, p,
+                             TARGET_PAGE_SIZE, zero);
+    if (len < 0) {
+        error_report("%s: failed to write page of '%s' to ram-file: %s",
+                     __func__, block->idstr, strerror(-len));
+        return len;
+    }
+
+    if (zero) {
+        ram_counters.duplicate++;
+    } else {
+        ram_counters.normal++;
+    }
+    /* Keep the rate limiter aware of the file I/O */
+    ram_counters.file_bytes += len;
+    ram_counters.transferred += len;
+    qemu_file_update_transfer(rs->f, len);
+
+    return 1;
+}
+
 static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
                                  ram_addr_t offset, uint8_t *source_buf)
 {
@@ -1987,6 +2130,10 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
+    if (migrate_use_ram_file()) {
+        return ram_save_file_page(rs, block, offset);
+    }
+
     if (save_compress_page(rs, block, offset)) {
         return 1;
     }
@@ -2077,6 +2224,81 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     return (res < 0 ? res : pages);
 }
 
+/*
+ * Returns true if pages requested by the destination should be sent
+ * on the postcopy preempt channel rather than behind the background
+ * stream on the main channel.
+ */
+static bool postcopy_preempt_active(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return migrate_postcopy_preempt() && migration_in_postcopy() &&
+           s->postcopy_qemufile_src;
+}
+
+/**
+ * ram_save_urgent_host_page: send a requested host page on the preempt
+ * channel
+ *
+ * The page is followed by an EOS marker and the channel is flushed
+ * right away, so that the destination can place it without waiting for
+ * the main channel to drain.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_urgent_host_page(RAMState *rs, PageSearchStatus *pss,
+                                     bool last_stage)
+{
+    MigrationState *s = migrate_get_current();
+    QEMUFile *main_file = rs->f;
+    RAMBlock *main_last_sent = rs->last_sent_block;
+    int pages;
+
+    rs->f = s->postcopy_qemufile_src;
+    rs->last_sent_block = rs->last_sent_block_preempt;
+
+    trace_ram_save_urgent_host_page(pss->block->idstr,
+                                    (uint64_t)pss->page << TARGET_PAGE_BITS);
+    pages = ram_save_host_page(rs, pss, last_stage);
+    if (pages > 0) {
+        qemu_put_be64(rs->f, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(rs->f);
+        if (qemu_file_get_error(rs->f)) {
+            pages = -EIO;
+        }
+    }
+
+    rs->last_sent_block_preempt = rs->last_sent_block;
+    rs->last_sent_block = main_last_sent;
+    rs->f = main_file;
+
+    return pages;
+}
+
+/**
+ * ram_save_preempt_end: end the postcopy preempt channel
+ *
+ * A bare EOS marker tells the destination that no more pages follow on
+ * the channel, so that it can wait for the pages still in flight before
+ * it stops listening for faults.
+ *
+ * Returns 0 for success or negative on error
+ */
+static int ram_save_preempt_end(void)
+{
+    QEMUFile *f = migrate_get_current()->postcopy_qemufile_src;
+
+    trace_ram_save_preempt_end();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(f);
+    return qemu_file_get_error(f);
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -2096,7 +2318,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 {
     PageSearchStatus pss;
     int pages = 0;
-    bool again, found;
+    bool again, found, urgent;
 
     /* No dirty page as there is zero RAM */
     if (!ram_bytes_total()) {
@@ -2114,6 +2336,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     do {
         again = true;
         found = get_queued_page(rs, &pss);
+        urgent = found;
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
@@ -2121,7 +2344,11 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
         }
 
         if (found) {
-            pages = ram_save_host_page(rs, &pss, last_stage);
+            if (urgent && postcopy_preempt_active()) {
+                pages = ram_save_urgent_host_page(rs, &pss, last_stage);
+            } else {
+                pages = ram_save_host_page(rs, &pss, last_stage);
+            }
         }
     } while (!pages && again);
 
@@ -2228,6 +2455,7 @@ static void ram_save_cleanup(void *opaque)
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    ram_file_save_cleanup();
     ram_state_cleanup(rsp);
 }
 
@@ -2235,6 +2463,7 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->last_sent_block_preempt = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->ram_bulk_stage = true;
@@ -2496,6 +2725,7 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms)
     /* Easiest way to make sure we don't resume in the middle of a host-page */
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->last_sent_block_preempt = NULL;
     rs->last_page = 0;
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
@@ -2665,6 +2895,8 @@ static void ram_list_init_bitmaps(void)
             bitmap_set(block->bmap, 0, pages);
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
+            block->dirty_pages_period = 0;
+            block->dirty_rate = 0;
         }
     }
 }
@@ -2724,6 +2956,7 @@ static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
 
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->last_sent_block_preempt = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     /*
@@ -2804,8 +3037,19 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMState **rsp = opaque;
     RAMBlock *block;
+    int ret;
+
+    if (migrate_use_ram_file()) {
+        Error *local_err = NULL;
+
+        if (ram_file_save_setup(&local_err)) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
 
     if (compress_threads_save_setup()) {
+        ram_file_save_cleanup();
         return -1;
     }
 
@@ -2813,6 +3057,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     if (!migration_in_colo_state()) {
         if (ram_init_all(rsp) != 0) {
             compress_threads_save_cleanup();
+            ram_file_save_cleanup();
             return -1;
         }
     }
@@ -2832,13 +3077,21 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_use_ram_file()) {
+                block->file_offset = ram_file_reserve(block->used_length);
+                qemu_put_be64(f, block->file_offset);
+            }
         }
     }
 
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
-    multifd_send_sync_main(f);
+    ret = multifd_send_sync_main(f);
+    if (ret < 0) {
+        return ret;
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
@@ -2938,7 +3191,11 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 out:
     if (ret >= 0
         && migration_is_setup_or_active(migrate_get_current()->state)) {
-        multifd_send_sync_main(rs->f);
+        ret = multifd_send_sync_main(rs->f);
+        if (ret < 0) {
+            return ret;
+        }
+
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
         ram_counters.transferred += 8;
@@ -2996,8 +3253,26 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     }
 
+    if (ret >= 0 && postcopy_preempt_active()) {
+        ret = ram_save_preempt_end();
+    }
+
+    if (ret >= 0 && migrate_use_ram_file()) {
+        Error *local_err = NULL;
+
+        if (ram_file_save_sync(&local_err)) {
+            error_report_err(local_err);
+            ret = -EIO;
+        } else {
+            qemu_put_be64(f, RAM_SAVE_FLAG_FILE_SYNC);
+        }
+    }
+
+    if (ret >= 0) {
+        ret = multifd_send_sync_main(rs->f);
+    }
+
     if (ret >= 0) {
-        multifd_send_sync_main(rs->f);
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
     }
@@ -3077,19 +3352,23 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel the page arrives on, each keeps its own
+ *           continuation block
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block;
+    static RAMBlock *blocks[RAM_CHANNEL_MAX];
+    RAMBlock *block;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
+        if (!blocks[channel]) {
             error_report("Ack, bad migration stream!");
             return NULL;
         }
-        return block;
+        return blocks[channel];
     }
 
     len = qemu_get_byte(f);
@@ -3107,6 +3386,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
         return NULL;
     }
 
+    blocks[channel] = block;
     return block;
 }
 
@@ -3450,6 +3730,189 @@ void colo_release_ram_cache(void)
     ram_state_cleanup(&ram_state);
 }
 
+/*
+ * Pre-faulting of guest RAM on the destination
+ *
+ * With the prefault-ram capability, a few threads populate guest RAM
+ * in the background while the first pass of an incoming migration is
+ * still arriving, so that loading a page no longer takes a fault and
+ * has the kernel zero fill it first.  Populating never changes the
+ * contents, so it can run concurrently with pages being loaded.
+ */
+#define RAM_PREFAULT_MAX_THREADS 8
+#define RAM_PREFAULT_CHUNK       (64 * MiB)
+
+typedef struct {
+    uint8_t *host;
+    size_t length;
+    size_t page_size;
+    /* Fall back to touching the pages when madvise() can't populate */
+    bool touch;
+} RAMPrefaultRange;
+
+static struct RAMPrefaultState {
+    QemuThread *threads;
+    int num_threads;
+    RAMPrefaultRange *ranges;
+    int num_ranges;
+    uint64_t total;
+    int64_t start_time;
+    bool quit;
+    /* protects the cursor below */
+    QemuMutex lock;
+    int next_range;
+    size_t next_offset;
+} *ram_prefault;
+
+/* Whether this load started out with fresh, untouched guest RAM */
+static bool ram_load_fresh;
+
+static void ram_prefault_chunk(RAMPrefaultRange *range, size_t offset,
+                               size_t len)
+{
+    uint8_t *host = range->host + offset;
+    size_t i;
+
+    if (!qemu_madvise(host, len, QEMU_MADV_POPULATE_WRITE) || !range->touch) {
+        return;
+    }
+
+    for (i = 0; i < len; i += range->page_size) {
+        /* Atomic so that a page being loaded meanwhile is not clobbered */
+        qatomic_fetch_or(host + i, 0);
+    }
+}
+
+static void *ram_prefault_thread(void *opaque)
+{
+    struct RAMPrefaultState *rp = opaque;
+
+    while (!qatomic_read(&rp->quit)) {
+        RAMPrefaultRange *range;
+        size_t offset, len;
+
+        qemu_mutex_lock(&rp->lock);
+        if (rp->next_range == rp->num_ranges) {
+            qemu_mutex_unlock(&rp->lock);
+            break;
+        }
+        range = &rp->ranges[rp->next_range];
+        offset = rp->next_offset;
+        len = MIN(RAM_PREFAULT_CHUNK, range->length - offset);
+        rp->next_offset += len;
+        if (rp->next_offset == range->length) {
+            rp->next_range++;
+            rp->next_offset = 0;
+        }
+        qemu_mutex_unlock(&rp->lock);
+
+        ram_prefault_chunk(range, offset, len);
+    }
+
+    return NULL;
+}
+
+/*
+ * ram_prefault_start: start populating guest RAM in the background
+ *
+ * Called once the RAMBlock list has been synchronised with the source.
+ * Postcopy and lazy restore rely on missing pages to trap accesses, so
+ * nothing is populated for them.
+ */
+static void ram_prefault_start(void)
+{
+    struct RAMPrefaultState *rp;
+    long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
+    RAMBlock *block;
+    int i;
+
+    if (ram_prefault || !migrate_prefault_ram() || !ram_load_fresh ||
+        postcopy_is_advised() || migrate_postcopy_ram() ||
+        migrate_lazy_restore()) {
+        return;
+    }
+
+    rp = g_new0(struct RAMPrefaultState, 1);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        RAMPrefaultRange *range;
+
+        if (!block->used_length) {
+            continue;
+        }
+        rp->ranges = g_renew(RAMPrefaultRange, rp->ranges,
+                             rp->num_ranges + 1);
+        range = &rp->ranges[rp->num_ranges++];
+        range->host = block->host;
+        range->length = block->used_length;
+        range->page_size = block->page_size;
+        /*
+         * Touching file backed or huge pages can raise SIGBUS when the
+         * backing runs out, so only anonymous RAM falls back to it.
+         */
+        range->touch = block->fd < 0 &&
+                       block->page_size == qemu_real_host_page_size;
+        rp->total += block->used_length;
+    }
+
+    rp->num_threads = host_procs > 1 ?
+                      MIN(host_procs / 2, RAM_PREFAULT_MAX_THREADS) : 1;
+    rp->threads = g_new0(QemuThread, rp->num_threads);
+    rp->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_init(&rp->lock);
+    ram_prefault = rp;
+
+    trace_ram_prefault_start(rp->num_threads, rp->total);
+    for (i = 0; i < rp->num_threads; i++) {
+        qemu_thread_create(&rp->threads[i], "prefault",
+                           ram_prefault_thread, rp, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void ram_prefault_stop(void)
+{
+    struct RAMPrefaultState *rp = ram_prefault;
+    int i;
+
+    if (!rp) {
+        return;
+    }
+
+    qatomic_set(&rp->quit, true);
+    for (i = 0; i < rp->num_threads; i++) {
+        qemu_thread_join(&rp->threads[i]);
+    }
+    trace_ram_prefault_stop(rp->next_range == rp->num_ranges,
+                            qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                            rp->start_time);
+
+    qemu_mutex_destroy(&rp->lock);
+    g_free(rp->threads);
+    g_free(rp->ranges);
+    g_free(rp);
+    ram_prefault = NULL;
+}
+
+/*
+ * ram_page_known_zero: whether a page still holds the zeroes it was
+ * allocated with
+ *
+ * Nothing writes to guest RAM before an incoming migration starts, so
+ * a page that was not loaded yet still reads as zero, and a zero page
+ * for it needs neither a check nor a write.  This doesn't hold for
+ * memory that was shared or backed by a file, nor for ROMs that the
+ * devices filled in themselves.
+ */
+static bool ram_page_known_zero(RAMBlock *block, void *host)
+{
+    if (!ram_load_fresh || migration_incoming_colo_enabled() ||
+        block->fd >= 0 || qemu_ram_is_shared(block) ||
+        memory_region_is_rom(block->mr)) {
+        return false;
+    }
+
+    return !ramblock_recv_bitmap_test(block, host);
+}
+
 /**
  * ram_load_setup: Setup RAM for migration incoming side
  *
@@ -3460,12 +3923,24 @@ void colo_release_ram_cache(void)
  */
 static int ram_load_setup(QEMUFile *f, void *opaque)
 {
+    if (migrate_use_ram_file()) {
+        Error *local_err = NULL;
+
+        if (ram_file_load_setup(&local_err)) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     if (compress_threads_load_setup(f)) {
+        ram_file_load_cleanup();
         return -1;
     }
 
     xbzrle_load_setup();
     ramblock_recv_map_init();
+    ram_load_fresh = runstate_check(RUN_STATE_INMIGRATE) &&
+                     !migrate_use_ram_file();
 
     return 0;
 }
@@ -3478,8 +3953,10 @@ static int ram_load_cleanup(void *opaque)
         qemu_ram_block_writeback(rb);
     }
 
+    ram_prefault_stop();
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
+    ram_file_load_cleanup();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
@@ -3508,23 +3985,32 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
 /**
  * ram_load_postcopy: load a page in postcopy case
  *
- * Returns 0 for success or -errno in case of error
+ * Returns 0 for success, 1 at the end of the preempt channel or -errno
+ * in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt
+ * thread for pages arriving on the preempt channel.  There every host
+ * page is followed by an EOS marker; an EOS marker without a page ends
+ * the channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: RAM_CHANNEL_PRECOPY for the main channel,
+ *           RAM_CHANNEL_POSTCOPY for the preempt channel
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
+    void *postcopy_host_page = channel == RAM_CHANNEL_POSTCOPY ?
+                               mis->postcopy_preempt_tmp_page :
+                               mis->postcopy_tmp_page;
     void *this_host = NULL;
     bool all_zero = true;
+    bool got_page = false;
     int target_pages = 0;
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
@@ -3553,7 +4039,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -3562,6 +4048,7 @@ static int ram_load_postcopy(QEMUFile *f)
                 break;
             }
             target_pages++;
+            got_page = true;
             matches_target_page_size = block->page_size == TARGET_PAGE_SIZE;
             /*
              * Postcopy requires that we place whole host pages atomically;
@@ -3645,7 +4132,11 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            } else if (!got_page) {
+                ret = 1;
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: 0x%x"
@@ -3762,6 +4253,7 @@ static int ram_load_precopy(QEMUFile *f)
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
         void *host = NULL, *host_bak = NULL;
+        bool known_zero = false;
         uint8_t ch;
 
         /*
@@ -3790,7 +4282,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -3822,6 +4315,7 @@ static int ram_load_precopy(QEMUFile *f)
                 break;
             }
             if (!migration_incoming_in_colo_state()) {
+                known_zero = ram_page_known_zero(block, host);
                 ramblock_recv_bitmap_set(block, host);
             }
 
@@ -3879,6 +4373,9 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (migrate_use_ram_file()) {
+                        ram_file_load_block(block, qemu_get_be64(f));
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -3889,10 +4386,16 @@ static int ram_load_precopy(QEMUFile *f)
 
                 total_ram_bytes -= length;
             }
+            if (!ret) {
+                ram_prefault_start();
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
             ch = qemu_get_byte(f);
+            if (ch == 0 && known_zero) {
+                break;
+            }
             ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
             break;
 
@@ -3918,6 +4421,20 @@ static int ram_load_precopy(QEMUFile *f)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_FILE_SYNC: {
+            Error *local_err = NULL;
+
+            if (!migrate_use_ram_file()) {
+                error_report("Received ram-file sync without ram-file set");
+                ret = -EINVAL;
+                break;
+            }
+            if (ram_file_load_complete(&local_err)) {
+                error_report_err(local_err);
+                ret = -EIO;
+            }
+            break;
+        }
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             multifd_recv_sync_main();
@@ -3967,7 +4484,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -1906,6 +1906,7 @@ static void *postcopy_ram_listen_thread(void *opaque)
          * state yet; wait for the end of the main thread.
          */
         qemu_event_wait(&mis->main_thread_load_event);
+        postcopy_preempt_drain(mis);
     }
     postcopy_ram_incoming_cleanup(mis);
 
@@ -2074,7 +2075,8 @@ static gboolean postcopy_sync_page_req(gpointer key, gpointer value,
         return FALSE;
     }
 
-    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset);
+    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset,
+                                            qemu_ram_pagesize(rb));
     if (ret) {
         /* Please refer to above comment. */
         error_report("%s: send rp message failed for addr %p",
@@ -2565,6 +2567,9 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
 
     assert(migrate_postcopy_ram());
 
+    /* The preempt channel is not used again after recovery */
+    postcopy_preempt_stop(mis);
+
     /* Clear the triggered bit to allow one recovery */
     mis->postcopy_recover_triggered = false;
 
@@ -39,6 +39,11 @@ void socket_send_channel_create(QIOTaskFunc f, void *data)
                                      f, data, NULL, NULL);
 }
 
+bool socket_send_channel_available(void)
+{
+    return outgoing_args.saddr != NULL;
+}
+
 int socket_send_channel_destroy(QIOChannel *send)
 {
     /* Remove channel */
@@ -150,6 +155,9 @@ socket_start_incoming_migration_internal(SocketAddress *saddr,
     if (migrate_use_multifd()) {
         num = migrate_multifd_channels();
     }
+    if (migrate_postcopy_preempt()) {
+        num++;
+    }
 
     if (qio_net_listener_open_sync(listener, saddr, num, errp) < 0) {
         object_unref(OBJECT(listener));
@@ -293,6 +293,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "postcopy request count: %" PRIu64 "\n",
                            info->ram->postcopy_requests);
         }
+        if (info->ram->file_bytes) {
+            monitor_printf(mon, "ram-file: %" PRIu64 " kbytes\n",
+                           info->ram->file_bytes >> 10);
+        }
     }
 
     if (info->has_disk) {
@@ -355,6 +359,56 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+
+    if (info->has_convergence) {
+        monitor_printf(mon, "convergence decision: %s\n",
+                       ConvergenceDecision_str(info->convergence->decision));
+        monitor_printf(mon, "convergence bandwidth: %" PRIu64 " bytes/s, "
+                       "dirty rate: %" PRIu64 " bytes/s\n",
+                       info->convergence->bandwidth,
+                       info->convergence->dirty_rate);
+        monitor_printf(mon, "convergence predicted downtime: %" PRIu64
+                       " ms\n", info->convergence->predicted_downtime);
+        if (info->convergence->has_iterations) {
+            monitor_printf(mon, "convergence iterations: %" PRIu64 "\n",
+                           info->convergence->iterations);
+        }
+        if (info->convergence->has_completion_predicted_downtime) {
+            monitor_printf(mon, "convergence downtime at completion: %" PRIu64
+                           " ms predicted\n",
+                           info->convergence->completion_predicted_downtime);
+        }
+    }
+
+    if (info->has_postcopy_latency) {
+        Visitor *v;
+        char *str;
+        v = string_output_visitor_new(false, &str);
+        visit_type_uint64List(v, NULL, &info->postcopy_latency->histogram,
+                              &error_abort);
+        visit_complete(v, &str);
+        monitor_printf(mon, "postcopy fault latency: %" PRIu64 " faults, "
+                       "%" PRIu64 " us average, %" PRIu64 " us max\n",
+                       info->postcopy_latency->count,
+                       info->postcopy_latency->average,
+                       info->postcopy_latency->max);
+        monitor_printf(mon, "postcopy fault latency histogram: %s\n", str);
+        g_free(str);
+        visit_free(v);
+    }
+
+    if (info->has_multifd_recv) {
+        MultiFDRecvChannelInfoList *chan;
+
+        for (chan = info->multifd_recv; chan; chan = chan->next) {
+            monitor_printf(mon, "multifd channel %u: %" PRIu64 " packets, "
+                           "%" PRIu64 " pages, %" PRIu64 " kbytes, "
+                           "%" PRIu64 " kbytes/s\n",
+                           chan->value->id, chan->value->packets,
+                           chan->value->pages, chan->value->bytes >> 10,
+                           chan->value->throughput >> 10);
+        }
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -373,6 +427,20 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->vfio->transferred >> 10);
     }
 
+    if (info->has_lazy_restore) {
+        monitor_printf(mon, "lazy restore: %s\n",
+                       info->lazy_restore->active ? "active" : "complete");
+        monitor_printf(mon, "lazy restore pages: %" PRIu64 " total, %" PRIu64
+                       " faulted, %" PRIu64 " prefetched\n",
+                       info->lazy_restore->total_pages,
+                       info->lazy_restore->faulted_pages,
+                       info->lazy_restore->prefetched_pages);
+        monitor_printf(mon, "lazy restore fault latency: %" PRIu64 " us\n",
+                       info->lazy_restore->fault_latency_avg);
+        monitor_printf(mon, "lazy restore time: %" PRIu64 " ms\n",
+                       info->lazy_restore->restore_time);
+    }
+
     qapi_free_MigrationInfo(info);
 }
 
@@ -487,6 +555,12 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_AUTHZ),
             params->tls_authz);
+        monitor_printf(mon, "%s: '%s'\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_RAM_FILE),
+            params->ram_file);
+        monitor_printf(mon, "%s: %u pages\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PREFETCH_WINDOW),
+            params->postcopy_prefetch_window);
 
         if (params->has_block_bitmap_mapping) {
             const BitmapMigrationNodeAliasList *bmnal;
@@ -1395,6 +1469,16 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         error_setg(&err, "The block-bitmap-mapping parameter can only be set "
                    "through QMP");
         break;
+    case MIGRATION_PARAMETER_RAM_FILE:
+        p->has_ram_file = true;
+        p->ram_file = g_new0(StrOrNull, 1);
+        p->ram_file->type = QTYPE_QSTRING;
+        visit_type_str(v, param, &p->ram_file->u.s, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_WINDOW:
+        p->has_postcopy_prefetch_window = true;
+        visit_type_uint32(v, param, &p->postcopy_prefetch_window, &err);
+        break;
     default:
         assert(0);
     }
@@ -97,6 +97,7 @@ struct NBDExport {
     Notifier eject_notifier;
 
     bool allocation_depth;
+    bool sendfile;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
 };
@@ -1714,6 +1715,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->sendfile = arg->sendfile;
 
     blk_add_aio_context_notifier(blk, blk_aio_attached, blk_aio_detach, exp);
 
@@ -1820,6 +1822,49 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Send @header followed by @size bytes of export data at @offset, letting
+ * the block layer hand the data to the socket with sendfile() instead of
+ * reading it into a buffer first.
+ *
+ * Returns -ENOTSUP without sending anything and without setting @errp if
+ * that isn't possible, for example because the export did not enable it,
+ * the connection uses TLS or the export is not backed by a plain file; the
+ * caller then has to read the data and send the reply itself.
+ *
+ * Once the header is sent, a read error can only be reported by failing
+ * the connection, which is why exports have to opt in.
+ */
+static int coroutine_fn nbd_co_sendfile(NBDClient *client, void *header,
+                                        size_t header_len, uint64_t offset,
+                                        size_t size, Error **errp)
+{
+    int ret;
+
+    if (!client->exp->sendfile || client->ioc != QIO_CHANNEL(client->sioc)) {
+        return -ENOTSUP;
+    }
+
+    /*
+     * blk_co_sendfile() returns -ENOTSUP instead of waiting for a drained
+     * section to end, so send_lock is never held across such a wait.
+     */
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    ret = blk_co_sendfile(client->exp->common.blk, offset, size,
+                          client->sioc, header, header_len);
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    trace_nbd_co_sendfile(offset, size, ret);
+    if (ret < 0 && ret != -ENOTSUP) {
+        error_setg_errno(errp, -ret, "sending data from file failed");
+        return -EIO;
+    }
+    return ret;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1971,15 +2016,26 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
         } else {
-            ret = blk_pread(exp->common.blk, offset + progress,
-                            data + progress, pnum);
-            if (ret < 0) {
-                error_setg_errno(errp, -ret, "reading from file failed");
-                break;
+            NBDStructuredReadData chunk;
+
+            set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                         NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                         sizeof(chunk) - sizeof(chunk.h) + pnum);
+            stq_be_p(&chunk.offset, offset + progress);
+            ret = nbd_co_sendfile(client, &chunk, sizeof(chunk),
+                                  offset + progress, pnum, errp);
+            if (ret == -ENOTSUP) {
+                ret = blk_pread(exp->common.blk, offset + progress,
+                                data + progress, pnum);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "reading from file failed");
+                    break;
+                }
+                ret = nbd_co_send_structured_read(client, handle,
+                                                  offset + progress,
+                                                  data + progress, pnum,
+                                                  final, errp);
             }
-            ret = nbd_co_send_structured_read(client, handle, offset + progress,
-                                              data + progress, pnum, final,
-                                              errp);
         }
 
         if (ret < 0) {
@@ -2350,6 +2406,33 @@ static coroutine_fn int nbd_send_generic_reply(NBDClient *client,
     }
 }
 
+/*
+ * Send the complete reply to a read request with nbd_co_sendfile(), as a
+ * simple reply or a single data chunk.  Returns -ENOTSUP if nothing was
+ * sent.
+ */
+static coroutine_fn int nbd_co_send_read_sendfile(NBDClient *client,
+                                                  NBDRequest *request,
+                                                  Error **errp)
+{
+    if (client->structured_reply) {
+        NBDStructuredReadData chunk;
+
+        set_be_chunk(&chunk.h, NBD_REPLY_FLAG_DONE,
+                     NBD_REPLY_TYPE_OFFSET_DATA, request->handle,
+                     sizeof(chunk) - sizeof(chunk.h) + request->len);
+        stq_be_p(&chunk.offset, request->from);
+        return nbd_co_sendfile(client, &chunk, sizeof(chunk), request->from,
+                               request->len, errp);
+    } else {
+        NBDSimpleReply reply;
+
+        set_be_simple_reply(&reply, 0, request->handle);
+        return nbd_co_sendfile(client, &reply, sizeof(reply), request->from,
+                               request->len, errp);
+    }
+}
+
 /* Handle NBD_CMD_READ request.
  * Return -errno if sending fails. Other errors are reported directly to the
  * client as an error reply. */
@@ -2377,6 +2460,13 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    if (request->len) {
+        ret = nbd_co_send_read_sendfile(client, request, errp);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+
     ret = blk_pread(exp->common.blk, request->from, data, request->len);
     if (ret < 0) {
         return nbd_send_generic_reply(client, request->handle, ret,
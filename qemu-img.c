@@ -49,6 +49,7 @@
 #include "block/qapi.h"
 #include "crypto/init.h"
 #include "trace/control.h"
+#include "trace/trace-root.h"
 #include "qemu/throttle.h"
 #include "block/throttle-groups.h"
 
@@ -199,6 +200,8 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "       (with '-c', this lets the coroutines compress clusters in parallel,\n"
+           "       but the compressed clusters are stored in completion order)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1651,6 +1654,12 @@ typedef struct ImgConvertState {
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
+
+    /* Time spent by all coroutines in each stage, for tracing */
+    uint64_t read_bytes;
+    uint64_t read_ns;
+    uint64_t write_bytes;
+    uint64_t write_ns;
 } ImgConvertState;
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
@@ -1975,7 +1984,11 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 retry:
         copy_range = s->copy_range && s->status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
+            int64_t start = get_clock();
+
             ret = convert_co_read(s, sector_num, n, buf);
+            s->read_ns += get_clock() - start;
+            s->read_bytes += n * BDRV_SECTOR_SIZE;
             if (ret < 0) {
                 error_report("error while reading at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
@@ -1996,6 +2009,8 @@ retry:
         }
 
         if (s->ret == -EINPROGRESS) {
+            int64_t start = get_clock();
+
             if (copy_range) {
                 ret = convert_co_copy_range(s, sector_num, n);
                 if (ret) {
@@ -2005,6 +2020,8 @@ retry:
             } else {
                 ret = convert_co_write(s, sector_num, n, buf, status);
             }
+            s->write_ns += get_clock() - start;
+            s->write_bytes += n * BDRV_SECTOR_SIZE;
             if (ret < 0) {
                 error_report("error while writing at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
@@ -2043,6 +2060,7 @@ static int convert_do_copy(ImgConvertState *s)
 {
     int ret, i, n;
     int64_t sector_num = 0;
+    int64_t start;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     if (!s->has_zero_init && s->target_is_new && s->min_sparse &&
@@ -2075,6 +2093,7 @@ static int convert_do_copy(ImgConvertState *s)
     /* Do the copy */
     s->sector_next_status = 0;
     s->ret = -EINPROGRESS;
+    start = get_clock();
 
     qemu_co_mutex_init(&s->lock);
     for (i = 0; i < s->num_coroutines; i++) {
@@ -2087,6 +2106,16 @@ static int convert_do_copy(ImgConvertState *s)
         main_loop_wait(false);
     }
 
+    /*
+     * Busy time is summed over all coroutines, so a stage that keeps more
+     * than one of them busy at a time has a busy time above the elapsed time.
+     * Compression is part of the write stage.
+     */
+    trace_qemu_img_convert_stage("read", s->read_bytes, s->read_ns,
+                                 get_clock() - start);
+    trace_qemu_img_convert_stage("write", s->write_bytes, s->write_ns,
+                                 get_clock() - start);
+
     if (s->compressed && !s->ret) {
         /* signal EOF to align */
         ret = blk_pwrite_compressed(s->target, 0, NULL, 0);
@@ -2114,6 +2143,7 @@ static int convert_copy_bitmaps(BlockDriverState *src, BlockDriverState *dst)
                                    true, bdrv_dirty_bitmap_granularity(bm),
                                    true, true,
                                    true, !bdrv_dirty_bitmap_enabled(bm),
+                                   true, bdrv_dirty_bitmap_get_sparse(bm),
                                    &err);
         if (err) {
             error_reportf_err(err, "Failed to create bitmap %s: ", name);
@@ -4691,7 +4721,7 @@ static int img_bitmap(int argc, char **argv)
         case BITMAP_ADD:
             qmp_block_dirty_bitmap_add(bs->node_name, bitmap,
                                        !!granularity, granularity, true, true,
-                                       false, false, &err);
+                                       false, false, false, false, &err);
             op = "add";
             break;
         case BITMAP_REMOVE:
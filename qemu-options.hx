@@ -1162,6 +1162,12 @@ SRST
             supporting platforms, and 0 on other platforms. Setting it
             to 0 disables this feature.
 
+        ``lockless-data-path``
+            Map reads and in-place writes of allocated clusters without
+            taking the image lock if their L2 table is cached. Writes
+            only do this with ``overlap-check`` set to ``constant`` or
+            ``none`` (on/off; default: off)
+
         ``pass-discard-request``
             Whether discard requests to the qcow2 device should be
             forwarded to the data source (on/off; default: on if
@@ -5189,7 +5195,7 @@ SRST
 
             CN=laptop.example.com,O=Example Home,L=London,ST=London,C=GB
 
-    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink``
+    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,io-uring-sqpoll=on|off,io-uring-fixed-buffers=on|off``
         Creates a dedicated event loop thread that devices can be
         assigned to. This is known as an IOThread. By default device
         emulation happens in vCPU threads or the main event loop thread.
@@ -5232,6 +5238,18 @@ SRST
         ::
 
             (qemu) qom-set /objects/iothread1 poll-max-ns 100000
+
+        The ``io-uring-sqpoll`` and ``io-uring-fixed-buffers`` parameters
+        configure the io_uring ring used by ``aio=io_uring`` block nodes
+        in this IOThread, and cannot be changed at run-time.
+        ``io-uring-sqpoll=on`` lets a kernel thread poll for new requests,
+        which saves system calls at the cost of a busy host CPU.
+        ``io-uring-fixed-buffers=on`` registers guest RAM with the ring so
+        that the kernel does not map guest buffers for every request;
+        guest RAM is then pinned and must fit into ``RLIMIT_MEMLOCK``.
+        Both options trade resources for fewer per-request kernel
+        operations; whether that pays off depends on the host and the
+        workload, so measure before enabling them.
 ERST
 
 
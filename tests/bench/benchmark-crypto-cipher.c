@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "qemu/bswap.h"
 #include "crypto/init.h"
 #include "crypto/cipher.h"
 
@@ -99,6 +100,76 @@ static void test_cipher_speed(size_t chunk_size,
     g_free(key);
 }
 
+/*
+ * Encrypt requests of @request_size bytes the way the LUKS block driver
+ * does: in 512 byte sectors, each with its own plain64 IV.
+ */
+static void test_cipher_speed_sectors(size_t request_size,
+                                      QCryptoCipherMode mode,
+                                      QCryptoCipherAlgorithm alg)
+{
+    QCryptoCipher *cipher;
+    Error *err = NULL;
+    uint8_t *key = NULL, *iv = NULL;
+    uint8_t *buf = NULL;
+    const size_t sector_size = 512;
+    size_t nkey;
+    size_t niv;
+    const size_t total = 2 * GiB;
+    uint64_t sector = 0;
+    size_t remain;
+    size_t offset;
+
+    if (!qcrypto_cipher_supports(alg, mode)) {
+        return;
+    }
+
+    nkey = qcrypto_cipher_get_key_len(alg);
+    niv = qcrypto_cipher_get_iv_len(alg, mode);
+    if (mode == QCRYPTO_CIPHER_MODE_XTS) {
+        nkey *= 2;
+    }
+    g_assert(niv >= sizeof(sector));
+
+    key = g_new0(uint8_t, nkey);
+    memset(key, g_test_rand_int(), nkey);
+
+    iv = g_new0(uint8_t, niv);
+
+    buf = g_new0(uint8_t, request_size);
+    memset(buf, g_test_rand_int(), request_size);
+
+    cipher = qcrypto_cipher_new(alg, mode,
+                                key, nkey, &err);
+    g_assert(cipher != NULL);
+
+    g_test_timer_start();
+    remain = total;
+    while (remain) {
+        for (offset = 0; offset < request_size; offset += sector_size) {
+            stq_le_p(iv, sector++);
+            g_assert(qcrypto_cipher_setiv(cipher, iv, niv, &err) == 0);
+            g_assert(qcrypto_cipher_encrypt(cipher,
+                                            buf + offset,
+                                            buf + offset,
+                                            sector_size,
+                                            &err) == 0);
+        }
+        remain -= request_size;
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("enc(%s-%s) request %zu bytes %.2f MB/sec ",
+                   QCryptoCipherAlgorithm_str(alg),
+                   QCryptoCipherMode_str(mode),
+                   request_size, (double)total / MiB / g_test_timer_last());
+
+    qcrypto_cipher_free(cipher);
+    g_free(buf);
+    g_free(iv);
+    g_free(key);
+}
+
 
 static void test_cipher_speed_ecb_aes_128(const void *opaque)
 {
@@ -164,6 +235,22 @@ static void test_cipher_speed_xts_aes_256(const void *opaque)
                       QCRYPTO_CIPHER_ALG_AES_256);
 }
 
+static void test_cipher_speed_xts_sectors_aes_128(const void *opaque)
+{
+    size_t request_size = (size_t)opaque;
+    test_cipher_speed_sectors(request_size,
+                              QCRYPTO_CIPHER_MODE_XTS,
+                              QCRYPTO_CIPHER_ALG_AES_128);
+}
+
+static void test_cipher_speed_xts_sectors_aes_256(const void *opaque)
+{
+    size_t request_size = (size_t)opaque;
+    test_cipher_speed_sectors(request_size,
+                              QCRYPTO_CIPHER_MODE_XTS,
+                              QCRYPTO_CIPHER_ALG_AES_256);
+}
+
 
 int main(int argc, char **argv)
 {
@@ -204,5 +291,22 @@ int main(int argc, char **argv)
     ADD_TESTS(16384);
     ADD_TESTS(65536);
 
+#define ADD_SECTOR_TEST(mode, cipher, keysize, request)                 \
+    if ((!alg || g_str_equal(alg, #mode "-sectors")) &&                 \
+        (!size || g_str_equal(size, #request)))                         \
+        g_test_add_data_func(                                           \
+        "/crypto/cipher/" #mode "-" #cipher "-" #keysize                \
+        "/sectors/request-" #request,                                   \
+        (void *)request,                                                \
+        test_cipher_speed_ ## mode ## _sectors_ ## cipher ## _ ## keysize)
+
+    /* Typical guest request sizes */
+    ADD_SECTOR_TEST(xts, aes, 128, 4096);
+    ADD_SECTOR_TEST(xts, aes, 256, 4096);
+    ADD_SECTOR_TEST(xts, aes, 128, 65536);
+    ADD_SECTOR_TEST(xts, aes, 256, 65536);
+    ADD_SECTOR_TEST(xts, aes, 128, 1048576);
+    ADD_SECTOR_TEST(xts, aes, 256, 1048576);
+
     return g_test_run();
 }
@@ -15,6 +15,7 @@
 #include "libqos/libqtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -472,6 +473,8 @@ typedef struct {
     bool use_shmem;
     /* only launch the target process */
     bool only_target;
+    /* send requested postcopy pages on their own channel */
+    bool postcopy_preempt;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -664,6 +667,7 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     QTestState *from, *to;
+    bool postcopy_preempt = args->postcopy_preempt;
 
     if (test_migrate_start(&from, &to, uri, args)) {
         return -1;
@@ -673,6 +677,11 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -720,6 +729,27 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_preempt(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp_return;
+
+    args->postcopy_preempt = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_set_parameter_int(to, "postcopy-prefetch-window", 16);
+    migrate_postcopy_start(from, to);
+
+    rsp_return = migrate_query(to);
+    g_assert(qdict_haskey(rsp_return, "postcopy-latency"));
+    qobject_unref(rsp_return);
+
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -931,6 +961,62 @@ static void test_xbzrle_unix(void)
     g_free(uri);
 }
 
+static void test_ram_file(bool lazy)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    char *path = g_strdup_printf("%s/ramfile", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_str(from, "ram-file", path);
+    migrate_set_parameter_str(to, "ram-file", path);
+    if (lazy) {
+        migrate_set_capability(to, "lazy-restore", true);
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    /* Guest RAM went through the file, not the stream */
+    g_assert_cmpint(read_ram_property_int(from, "file-bytes"), >, 0);
+
+    test_migrate_end(from, to, true);
+    unlink(path);
+    g_free(path);
+    g_free(uri);
+}
+
+static void test_ram_file_eager(void)
+{
+    test_ram_file(false);
+}
+
+static void test_ram_file_lazy(void)
+{
+    test_ram_file(true);
+}
+
 static void test_precopy_tcp(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -1219,6 +1305,70 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
+static void test_migrate_predictive_convergence(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp_return, *rsp_conv;
+    int64_t percentage;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "predictive-convergence", true);
+    migrate_set_capability(from, "auto-converge", true);
+    migrate_set_parameter_int(from, "max-cpu-throttle", 95);
+
+    /* Make it impossible to converge without throttling */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 100000000); /* ~100Mb/s */
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* The controller must find out it does not converge and throttle */
+    percentage = 0;
+    while (percentage == 0) {
+        percentage = read_migrate_property_int(from, "cpu-throttle-percentage");
+        usleep(100);
+        g_assert_false(got_stop);
+    }
+    g_assert_cmpint(percentage, <=, 95);
+
+    rsp_return = migrate_query(from);
+    rsp_conv = qdict_get_qdict(rsp_return, "convergence");
+    g_assert(rsp_conv);
+    g_assert_cmpstr(qdict_get_str(rsp_conv, "decision"), ==, "throttle");
+    g_assert(!qdict_haskey(rsp_conv, "iterations"));
+    qobject_unref(rsp_return);
+
+    /* Now let it converge */
+    migrate_set_parameter_int(from, "downtime-limit", 250);
+    migrate_set_parameter_int(from, "max-bandwidth", 400000000);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    /* The prediction made when stopping is kept for comparison */
+    rsp_return = migrate_query(from);
+    rsp_conv = qdict_get_qdict(rsp_return, "convergence");
+    g_assert(rsp_conv);
+    g_assert_cmpstr(qdict_get_str(rsp_conv, "decision"), ==, "complete");
+    g_assert(qdict_haskey(rsp_conv, "completion-predicted-downtime"));
+    g_assert(qdict_haskey(rsp_return, "downtime"));
+    qobject_unref(rsp_return);
+
+    g_free(uri);
+
+    test_migrate_end(from, to, true);
+}
+
 static void test_multifd_tcp(const char *method)
 {
     MigrateStart *args = migrate_start_new();
@@ -1293,6 +1443,63 @@ static void test_multifd_tcp_zstd(void)
 }
 #endif
 
+static void test_multifd_tcp_prefault(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp, *rsp_return;
+    QList *channels;
+    char *uri;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter_int(from, "multifd-channels", 4);
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+    migrate_set_capability(to, "prefault-ram", true);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    uri = migrate_get_socket_address(to, "socket-address");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* Every receiving channel reports its statistics */
+    rsp_return = migrate_query(to);
+    channels = qdict_get_qlist(rsp_return, "multifd-recv");
+    g_assert(channels);
+    g_assert_cmpint(qlist_size(channels), ==, 4);
+    qobject_unref(rsp_return);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
 /*
  * This test does:
  *  source               target
@@ -1439,9 +1646,12 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
+    qtest_add_func("/migration/ram_file/eager", test_ram_file_eager);
+    qtest_add_func("/migration/ram_file/lazy", test_ram_file_lazy);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
@@ -1453,8 +1663,12 @@ int main(int argc, char **argv)
                    test_validate_uuid_dst_not_set);
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
+    qtest_add_func("/migration/predictive_convergence",
+                   test_migrate_predictive_convergence);
     qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
     qtest_add_func("/migration/multifd/tcp/cancel", test_multifd_tcp_cancel);
+    qtest_add_func("/migration/multifd/tcp/prefault",
+                   test_multifd_tcp_prefault);
     qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
@@ -0,0 +1,271 @@
+/*
+ * QTest testcase for vhost-user-blk exports of qemu-storage-daemon
+ *
+ * Based on tests/qtest/virtio-blk-test.c
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest-single.h"
+#include "qemu/bswap.h"
+#include "qemu/memfd.h"
+#include "qemu/module.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "libqos/qgraph.h"
+#include "libqos/vhost-user-blk.h"
+
+#define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
+#define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
+#define QSD_TIMEOUT_US          (10 * 1000 * 1000)
+
+/* Enough requests in a row for the IOThread to switch to polling */
+#define POLL_REQUESTS           256
+
+typedef struct QVirtioBlkReq {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+    char *data;
+    uint8_t status;
+} QVirtioBlkReq;
+
+typedef struct StorageDaemon {
+    pid_t pid;
+    char *tmp_dir;
+    char *img_path;
+    char *sock_path;
+} StorageDaemon;
+
+#ifdef HOST_WORDS_BIGENDIAN
+static const bool host_is_big_endian = true;
+#else
+static const bool host_is_big_endian; /* false */
+#endif
+
+static inline void virtio_blk_fix_request(QVirtioDevice *d, QVirtioBlkReq *req)
+{
+    if (qvirtio_is_big_endian(d) != host_is_big_endian) {
+        req->type = bswap32(req->type);
+        req->ioprio = bswap32(req->ioprio);
+        req->sector = bswap64(req->sector);
+    }
+}
+
+static uint64_t virtio_blk_request(QGuestAllocator *alloc, QVirtioDevice *d,
+                                   QVirtioBlkReq *req, uint64_t data_size)
+{
+    uint64_t addr;
+    uint8_t status = 0xFF;
+
+    g_assert_cmpuint(data_size % 512, ==, 0);
+    addr = guest_alloc(alloc, sizeof(*req) + data_size);
+
+    virtio_blk_fix_request(d, req);
+
+    memwrite(addr, req, 16);
+    memwrite(addr + 16, req->data, data_size);
+    memwrite(addr + 16 + data_size, &status, sizeof(status));
+
+    return addr;
+}
+
+/* Write @pattern to @sector, or check that it is there if @write is false */
+static void do_rw(QVirtioDevice *dev, QGuestAllocator *alloc, QVirtQueue *vq,
+                  uint64_t sector, uint8_t pattern, bool write)
+{
+    QTestState *qts = global_qtest;
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+    char expected[512];
+    char data[512];
+
+    memset(expected, pattern, sizeof(expected));
+
+    req.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = write ? expected : data;
+    memset(data, 0, sizeof(data));
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 512, !write, true);
+    qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(readb(req_addr + 528), ==, 0);
+
+    if (!write) {
+        memread(req_addr + 16, data, 512);
+        g_assert_cmpmem(data, 512, expected, 512);
+    }
+
+    guest_free(alloc, req_addr);
+}
+
+static QVirtQueue *setup_vq(QVirtioDevice *dev, QGuestAllocator *alloc)
+{
+    uint64_t features;
+    QVirtQueue *vq;
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    g_assert_cmpint(qvirtio_config_readq(dev, 0), ==, TEST_IMAGE_SIZE / 512);
+
+    vq = qvirtqueue_setup(dev, alloc, 0);
+    qvirtio_set_driver_ok(dev);
+
+    return vq;
+}
+
+static void basic(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVhostUserBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QVirtQueue *vq = setup_vq(dev, t_alloc);
+
+    do_rw(dev, t_alloc, vq, 0, 0x42, true);
+    do_rw(dev, t_alloc, vq, 0, 0x42, false);
+    do_rw(dev, t_alloc, vq, 1, 0, false);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+/*
+ * With poll-max-ns > 0, the IOThread of the export soon polls the virtqueue
+ * and turns off guest notifications.  Every request must still complete,
+ * whether it is found by polling or by the kick handler.
+ */
+static void many_requests(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVhostUserBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QVirtQueue *vq = setup_vq(dev, t_alloc);
+    int i;
+
+    for (i = 0; i < POLL_REQUESTS; i++) {
+        do_rw(dev, t_alloc, vq, i, i % 255 + 1, true);
+    }
+    for (i = 0; i < POLL_REQUESTS; i++) {
+        do_rw(dev, t_alloc, vq, i, i % 255 + 1, false);
+    }
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+static void storage_daemon_stop(void *opaque)
+{
+    StorageDaemon *qsd = opaque;
+    int status;
+
+    kill(qsd->pid, SIGTERM);
+    g_assert_cmpint(waitpid(qsd->pid, &status, 0), ==, qsd->pid);
+
+    unlink(qsd->sock_path);
+    unlink(qsd->img_path);
+    rmdir(qsd->tmp_dir);
+
+    g_free(qsd->sock_path);
+    g_free(qsd->img_path);
+    g_free(qsd->tmp_dir);
+    g_free(qsd);
+
+    qos_invalidate_command_line();
+}
+
+static StorageDaemon *storage_daemon_start(const char *poll_max_ns)
+{
+    const char *qsd_bin = getenv("QTEST_QEMU_STORAGE_DAEMON_BINARY");
+    StorageDaemon *qsd = g_new0(StorageDaemon, 1);
+    gint64 start_time;
+    int fd, ret;
+
+    qsd->tmp_dir = g_dir_make_tmp("qtest-vhost-user-blk-XXXXXX", NULL);
+    g_assert(qsd->tmp_dir);
+    qsd->img_path = g_build_filename(qsd->tmp_dir, "disk.img", NULL);
+    qsd->sock_path = g_build_filename(qsd->tmp_dir, "vhost-user-blk.sock",
+                                      NULL);
+
+    fd = open(qsd->img_path, O_CREAT | O_RDWR, 0600);
+    g_assert_cmpint(fd, >=, 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    qsd->pid = fork();
+    g_assert_cmpint(qsd->pid, >=, 0);
+    if (qsd->pid == 0) {
+        g_autofree char *blockdev = g_strdup_printf(
+            "driver=file,node-name=disk0,filename=%s", qsd->img_path);
+        g_autofree char *iothread = g_strdup_printf(
+            "iothread,id=iothread0,poll-max-ns=%s", poll_max_ns);
+        g_autofree char *export = g_strdup_printf(
+            "type=vhost-user-blk,id=export0,node-name=disk0,writable=on,"
+            "iothread=iothread0,addr.type=unix,addr.path=%s",
+            qsd->sock_path);
+
+        execl(qsd_bin, qsd_bin, "--blockdev", blockdev, "--object", iothread,
+              "--export", export, NULL);
+        _exit(1);
+    }
+
+    /* QEMU connects to the socket once, at startup */
+    start_time = g_get_monotonic_time();
+    while (!g_file_test(qsd->sock_path, G_FILE_TEST_EXISTS)) {
+        g_assert(g_get_monotonic_time() - start_time <= QSD_TIMEOUT_US);
+        g_usleep(1000);
+    }
+
+    return qsd;
+}
+
+static void *vhost_user_blk_test_setup(GString *cmd_line, void *arg)
+{
+    StorageDaemon *qsd = storage_daemon_start(arg);
+
+    g_test_queue_destroy(storage_daemon_stop, qsd);
+
+    /* vhost-user needs guest RAM that the daemon can map */
+    g_string_append_printf(cmd_line,
+                           " -m 256 -object memory-backend-memfd,id=mem,"
+                           "size=256M,share=on -numa node,memdev=mem"
+                           " -chardev socket,id=char1,path=%s ",
+                           qsd->sock_path);
+
+    return arg;
+}
+
+static void register_vhost_user_blk_test(void)
+{
+    QOSGraphTestOptions opts = {
+        .before = vhost_user_blk_test_setup,
+    };
+
+    if (!getenv("QTEST_QEMU_STORAGE_DAEMON_BINARY") ||
+        !qemu_memfd_check(MFD_ALLOW_SEALING)) {
+        return;
+    }
+
+    opts.arg = (void *) "0";
+    qos_add_test("basic", "vhost-user-blk", basic, &opts);
+    qos_add_test("many-requests", "vhost-user-blk", many_requests, &opts);
+
+    opts.arg = (void *) "1000000000";
+    qos_add_test("poll/basic", "vhost-user-blk", basic, &opts);
+    qos_add_test("poll/many-requests", "vhost-user-blk", many_requests,
+                 &opts);
+}
+
+libqos_init(register_vhost_user_blk_test);
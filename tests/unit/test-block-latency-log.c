@@ -0,0 +1,153 @@
+/*
+ * Test the log-linear latency histogram of block accounting
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "block/accounting.h"
+
+/* Account @latency_ns alone and return the bound reported for it */
+static uint64_t single_bound(int64_t latency_ns)
+{
+    BlockLatencyLogHistogram hist = { 0 };
+    uint64_t res;
+
+    block_latency_log_account(&hist, latency_ns);
+    g_assert_cmpint(hist.count, ==, 1);
+
+    res = block_latency_log_percentile(&hist, 100);
+    g_assert_cmpint(res, ==, block_latency_log_percentile(&hist, 50));
+
+    block_latency_log_clear(&hist);
+    return res;
+}
+
+static void test_empty(void)
+{
+    BlockLatencyLogHistogram hist = { 0 };
+
+    g_assert_cmpint(block_latency_log_percentile(&hist, 50), ==, 0);
+    g_assert_cmpint(block_latency_log_percentile(&hist, 99.9), ==, 0);
+    g_assert(hist.buckets == NULL);
+}
+
+static void test_below_min(void)
+{
+    uint64_t max = (1ULL << BLOCK_LATENCY_LOG_MIN_BITS) - 1;
+
+    g_assert_cmpint(single_bound(-1), ==, max);
+    g_assert_cmpint(single_bound(0), ==, max);
+    g_assert_cmpint(single_bound(15), ==, max);
+    g_assert_cmpint(single_bound(max), ==, max);
+}
+
+static void test_bounds(void)
+{
+    int exp, sub;
+
+    for (exp = BLOCK_LATENCY_LOG_MIN_BITS; exp < BLOCK_LATENCY_LOG_MAX_BITS;
+         exp++)
+    {
+        uint64_t width = 1ULL << (exp - BLOCK_LATENCY_LOG_SUB_BITS);
+
+        for (sub = 0; sub < (1 << BLOCK_LATENCY_LOG_SUB_BITS); sub++) {
+            uint64_t lower = (1ULL << exp) + sub * width;
+            uint64_t upper = lower + width - 1;
+
+            /* Every latency in the bucket reports the bucket's upper end */
+            g_assert_cmpint(single_bound(lower), ==, upper);
+            g_assert_cmpint(single_bound(lower + width / 2), ==, upper);
+            g_assert_cmpint(single_bound(upper), ==, upper);
+
+            /* And the bucket is narrow enough */
+            g_assert_cmpint(upper - lower, <, lower / 16);
+        }
+    }
+}
+
+static void test_above_max(void)
+{
+    uint64_t max = (1ULL << BLOCK_LATENCY_LOG_MAX_BITS) - 1;
+
+    /* The last bucket with a bound still has one */
+    g_assert_cmpint(single_bound(max), ==, max);
+
+    /* Everything above goes to the overflow bucket, which has none */
+    g_assert_cmpuint(single_bound(max + 1), ==, UINT64_MAX);
+    g_assert_cmpuint(single_bound(INT64_MAX), ==, UINT64_MAX);
+}
+
+static void test_overflow(void)
+{
+    BlockLatencyLogHistogram hist = { 0 };
+    uint64_t max = (1ULL << BLOCK_LATENCY_LOG_MAX_BITS) - 1;
+    int i;
+
+    /* 998 requests of 1 ms and two that took too long */
+    for (i = 0; i < 998; i++) {
+        block_latency_log_account(&hist, 1000000);
+    }
+    block_latency_log_account(&hist, max);
+    block_latency_log_account(&hist, max + 1);
+    block_latency_log_account(&hist, INT64_MAX);
+
+    g_assert_cmpint(hist.count, ==, 1001);
+    g_assert_cmpint(hist.buckets[BLOCK_LATENCY_LOG_OVERFLOW], ==, 2);
+
+    g_assert_cmpint(block_latency_log_percentile(&hist, 99), ==,
+                    single_bound(1000000));
+    g_assert_cmpint(block_latency_log_percentile(&hist, 99.8), ==, max);
+    g_assert_cmpuint(block_latency_log_percentile(&hist, 99.9), ==,
+                     UINT64_MAX);
+    g_assert_cmpuint(block_latency_log_percentile(&hist, 100), ==,
+                     UINT64_MAX);
+
+    block_latency_log_clear(&hist);
+}
+
+static void test_percentiles(void)
+{
+    BlockLatencyLogHistogram hist = { 0 };
+    int i;
+
+    /* 1 us .. 1000 us */
+    for (i = 1; i <= 1000; i++) {
+        block_latency_log_account(&hist, i * 1000);
+    }
+    g_assert_cmpint(hist.count, ==, 1000);
+
+    g_assert_cmpint(block_latency_log_percentile(&hist, 50), >=, 500000);
+    g_assert_cmpint(block_latency_log_percentile(&hist, 50), <,
+                    500000 + 500000 / 16);
+    g_assert_cmpint(block_latency_log_percentile(&hist, 99), >=, 990000);
+    g_assert_cmpint(block_latency_log_percentile(&hist, 99), <,
+                    990000 + 990000 / 16);
+    g_assert_cmpint(block_latency_log_percentile(&hist, 99.9), >=, 999000);
+    g_assert_cmpint(block_latency_log_percentile(&hist, 99.9), <,
+                    999000 + 999000 / 16);
+
+    /* The smallest rank is 1, so p0 is the bound of the first request */
+    g_assert_cmpint(block_latency_log_percentile(&hist, 0), ==,
+                    single_bound(1000));
+
+    block_latency_log_clear(&hist);
+    g_assert_cmpint(hist.count, ==, 0);
+    g_assert(hist.buckets == NULL);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/block/latency-log/empty", test_empty);
+    g_test_add_func("/block/latency-log/below-min", test_below_min);
+    g_test_add_func("/block/latency-log/bounds", test_bounds);
+    g_test_add_func("/block/latency-log/above-max", test_above_max);
+    g_test_add_func("/block/latency-log/overflow", test_overflow);
+    g_test_add_func("/block/latency-log/percentiles", test_percentiles);
+
+    return g_test_run();
+}
@@ -0,0 +1,243 @@
+/*
+ * Block status cache tests
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block.h"
+#include "block/block_int.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+
+#define TEST_IMAGE_SIZE (64 * 1024)
+
+typedef struct BDRVTestState {
+    /* Number of calls of bdrv_test_co_block_status() */
+    int block_status_calls;
+    /* Report zeroes instead of data */
+    bool zero;
+} BDRVTestState;
+
+static int coroutine_fn bdrv_test_co_prwv(BlockDriverState *bs,
+                                          uint64_t offset, uint64_t bytes,
+                                          QEMUIOVector *qiov, int flags)
+{
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int bytes)
+{
+    return 0;
+}
+
+static int coroutine_fn
+bdrv_test_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
+                      PreallocMode prealloc, BdrvRequestFlags flags,
+                      Error **errp)
+{
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_block_status(BlockDriverState *bs,
+                                                  bool want_zero,
+                                                  int64_t offset, int64_t count,
+                                                  int64_t *pnum, int64_t *map,
+                                                  BlockDriverState **file)
+{
+    BDRVTestState *s = bs->opaque;
+
+    s->block_status_calls++;
+    *pnum = count;
+    *map = offset;
+    *file = bs;
+    return (s->zero ? BDRV_BLOCK_ZERO : BDRV_BLOCK_DATA) |
+           BDRV_BLOCK_OFFSET_VALID;
+}
+
+static BlockDriver bdrv_test = {
+    .format_name            = "test",
+    .instance_size          = sizeof(BDRVTestState),
+
+    .bdrv_co_preadv         = bdrv_test_co_prwv,
+    .bdrv_co_pwritev        = bdrv_test_co_prwv,
+    .bdrv_co_pdiscard       = bdrv_test_co_pdiscard,
+    .bdrv_co_truncate       = bdrv_test_co_truncate,
+    .bdrv_co_block_status   = bdrv_test_co_block_status,
+};
+
+static BlockBackend *test_open(BDRVTestState **s)
+{
+    BlockBackend *blk;
+    BlockDriverState *bs;
+
+    blk = blk_new(qemu_get_aio_context(), BLK_PERM_ALL, BLK_PERM_ALL);
+    bs = bdrv_new_open_driver(&bdrv_test, "test-node",
+                              BDRV_O_RDWR | BDRV_O_UNMAP, &error_abort);
+    bs->total_sectors = TEST_IMAGE_SIZE / BDRV_SECTOR_SIZE;
+    blk_insert_bs(blk, bs, &error_abort);
+    bdrv_unref(bs);
+
+    *s = bs->opaque;
+    return blk;
+}
+
+/* Query the block status of @offset and check that it was reported as data */
+static void test_query(BlockBackend *blk, int64_t offset, int64_t bytes,
+                       int64_t expected_pnum)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    BlockDriverState *file;
+    int64_t pnum, map;
+    int ret;
+
+    ret = bdrv_block_status(bs, offset, bytes, &pnum, &map, &file);
+    g_assert_cmpint(ret, >=, 0);
+    g_assert(ret & BDRV_BLOCK_DATA);
+    g_assert(ret & BDRV_BLOCK_OFFSET_VALID);
+    g_assert_cmpint(pnum, ==, expected_pnum);
+    g_assert_cmpint(map, ==, offset);
+    g_assert(file == bs);
+}
+
+static void test_hit(void)
+{
+    BDRVTestState *s;
+    BlockBackend *blk = test_open(&s);
+
+    test_query(blk, 0, TEST_IMAGE_SIZE, TEST_IMAGE_SIZE);
+    g_assert_cmpint(s->block_status_calls, ==, 1);
+
+    /* Any offset inside the cached range is a hit */
+    test_query(blk, 0, TEST_IMAGE_SIZE, TEST_IMAGE_SIZE);
+    test_query(blk, 4096, 4096, 4096);
+    test_query(blk, 4096, TEST_IMAGE_SIZE, TEST_IMAGE_SIZE - 4096);
+    g_assert_cmpint(s->block_status_calls, ==, 1);
+
+    blk_unref(blk);
+}
+
+static void test_zero_not_cached(void)
+{
+    BDRVTestState *s;
+    BlockBackend *blk = test_open(&s);
+    int64_t pnum;
+    int ret, i;
+
+    s->zero = true;
+    for (i = 0; i < 2; i++) {
+        ret = bdrv_block_status(blk_bs(blk), 0, TEST_IMAGE_SIZE, &pnum, NULL,
+                                NULL);
+        g_assert_cmpint(ret, >=, 0);
+        g_assert(ret & BDRV_BLOCK_ZERO);
+    }
+    g_assert_cmpint(s->block_status_calls, ==, 2);
+
+    blk_unref(blk);
+}
+
+static void test_invalidate_write(void)
+{
+    BDRVTestState *s;
+    BlockBackend *blk = test_open(&s);
+    uint8_t buf[512] = { 0 };
+    int ret;
+
+    test_query(blk, 0, 4096, 4096);
+    test_query(blk, 8192, 4096, 4096);
+    g_assert_cmpint(s->block_status_calls, ==, 2);
+
+    ret = blk_pwrite(blk, 0, buf, sizeof(buf), 0);
+    g_assert_cmpint(ret, ==, sizeof(buf));
+
+    /* Only the range that was written to is dropped */
+    test_query(blk, 8192, 4096, 4096);
+    g_assert_cmpint(s->block_status_calls, ==, 2);
+    test_query(blk, 0, 4096, 4096);
+    g_assert_cmpint(s->block_status_calls, ==, 3);
+
+    blk_unref(blk);
+}
+
+static void test_invalidate_discard(void)
+{
+    BDRVTestState *s;
+    BlockBackend *blk = test_open(&s);
+    int ret;
+
+    test_query(blk, 0, TEST_IMAGE_SIZE, TEST_IMAGE_SIZE);
+    g_assert_cmpint(s->block_status_calls, ==, 1);
+
+    ret = blk_pdiscard(blk, 4096, 4096);
+    g_assert_cmpint(ret, ==, 0);
+
+    test_query(blk, 0, TEST_IMAGE_SIZE, TEST_IMAGE_SIZE);
+    g_assert_cmpint(s->block_status_calls, ==, 2);
+
+    blk_unref(blk);
+}
+
+static void test_invalidate_truncate(void)
+{
+    BDRVTestState *s;
+    BlockBackend *blk = test_open(&s);
+    int ret;
+
+    test_query(blk, 0, 4096, 4096);
+    g_assert_cmpint(s->block_status_calls, ==, 1);
+
+    /* Shrinking does not touch [0, 4096) but still invalidates everything */
+    ret = blk_truncate(blk, TEST_IMAGE_SIZE / 2, false, PREALLOC_MODE_OFF, 0,
+                       &error_abort);
+    g_assert_cmpint(ret, ==, 0);
+
+    test_query(blk, 0, 4096, 4096);
+    g_assert_cmpint(s->block_status_calls, ==, 2);
+
+    ret = blk_truncate(blk, TEST_IMAGE_SIZE, false, PREALLOC_MODE_OFF, 0,
+                       &error_abort);
+    g_assert_cmpint(ret, ==, 0);
+
+    test_query(blk, 0, TEST_IMAGE_SIZE, TEST_IMAGE_SIZE);
+    g_assert_cmpint(s->block_status_calls, ==, 3);
+
+    blk_unref(blk);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/block-status-cache/hit", test_hit);
+    g_test_add_func("/block-status-cache/zero-not-cached",
+                    test_zero_not_cached);
+    g_test_add_func("/block-status-cache/invalidate-write",
+                    test_invalidate_write);
+    g_test_add_func("/block-status-cache/invalidate-discard",
+                    test_invalidate_discard);
+    g_test_add_func("/block-status-cache/invalidate-truncate",
+                    test_invalidate_truncate);
+
+    return g_test_run();
+}
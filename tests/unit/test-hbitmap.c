@@ -10,6 +10,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "qemu/hbitmap.h"
 #include "qemu/bitmap.h"
 #include "block/block.h"
@@ -26,6 +27,7 @@ typedef struct TestHBitmapData {
     size_t         size;
     size_t         old_size;
     int            granularity;
+    bool           sparse;
 } TestHBitmapData;
 
 
@@ -79,7 +81,11 @@ static void hbitmap_test_init(TestHBitmapData *data,
                               uint64_t size, int granularity)
 {
     size_t n;
-    data->hb = hbitmap_alloc(size, granularity);
+    if (data->sparse) {
+        data->hb = hbitmap_alloc_sparse(size, granularity);
+    } else {
+        data->hb = hbitmap_alloc(size, granularity);
+    }
 
     n = DIV_ROUND_UP(size, BITS_PER_LONG);
     if (n == 0) {
@@ -793,11 +799,26 @@ static void test_hbitmap_serialize_zeroes(TestHBitmapData *data,
     }
 }
 
+static void hbitmap_test_setup_sparse(TestHBitmapData *data,
+                                      const void *unused)
+{
+    data->sparse = true;
+}
+
+/* Run each test on both a dense and a sparse HBitmap */
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
+    g_autofree char *sparse_path = NULL;
+
     g_test_add(testpath, TestHBitmapData, NULL, NULL, test_func,
                hbitmap_test_teardown);
+
+    assert(g_str_has_prefix(testpath, "/hbitmap/"));
+    sparse_path = g_strdup_printf("/hbitmap/sparse/%s",
+                                  testpath + strlen("/hbitmap/"));
+    g_test_add(sparse_path, TestHBitmapData, NULL, hbitmap_test_setup_sparse,
+               test_func, hbitmap_test_teardown);
 }
 
 static void test_hbitmap_iter_and_reset(TestHBitmapData *data,
@@ -1042,6 +1063,117 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+/*
+ * Converting between representations, and merging bitmaps that use
+ * different ones, must not change the contents.
+ */
+static void test_hbitmap_sparse_convert(TestHBitmapData *data,
+                                        const void *unused)
+{
+    g_autofree char *hash = NULL;
+    g_autofree char *new_hash = NULL;
+    HBitmap *other;
+
+    hbitmap_test_init(data, L3 * 4, 0);
+    hbitmap_test_set(data, 0, L3);
+    hbitmap_test_set(data, L3 * 2 + 17, L2 * 3);
+    hbitmap_test_reset(data, L2, L1 * 5);
+    hash = hbitmap_sha256(data->hb, &error_abort);
+
+    hbitmap_set_sparse(data->hb, !data->sparse);
+    g_assert(hbitmap_is_sparse(data->hb) == !data->sparse);
+    hbitmap_test_check(data, 0);
+    new_hash = hbitmap_sha256(data->hb, &error_abort);
+    g_assert_cmpstr(new_hash, ==, hash);
+
+    /* Merge in a bitmap that uses the other representation */
+    other = data->sparse ? hbitmap_alloc(L3 * 4, 0) :
+                           hbitmap_alloc_sparse(L3 * 4, 0);
+    hbitmap_set(other, L3 * 3, L3);
+    hbitmap_set_sparse(data->hb, data->sparse);
+    g_assert(hbitmap_merge(data->hb, other, data->hb));
+    hbitmap_free(other);
+
+    bitmap_set(data->bits, L3 * 3, L3);
+    hbitmap_test_check(data, 0);
+}
+
+/* A sparse bitmap only pays for pages that are neither clear nor full */
+static void test_hbitmap_sparse_memory(void)
+{
+    uint64_t size = (uint64_t)L3 * L1;
+    HBitmap *dense = hbitmap_alloc(size, 0);
+    HBitmap *sparse = hbitmap_alloc_sparse(size, 0);
+    uint64_t empty = hbitmap_memory_usage(sparse);
+
+    g_assert_cmpuint(empty * 64, <, hbitmap_memory_usage(dense));
+
+    /* Apart from a few words in the upper levels, full costs nothing */
+    hbitmap_set(sparse, 0, size);
+    g_assert_cmpuint(hbitmap_memory_usage(sparse), <, empty + 1024);
+
+    hbitmap_reset(sparse, L3, 1);
+    g_assert_cmpuint(hbitmap_memory_usage(sparse), >, empty + 1024);
+    g_assert_cmpuint(hbitmap_count(sparse), ==, size - 1);
+
+    hbitmap_set(sparse, L3, 1);
+    g_assert_cmpuint(hbitmap_memory_usage(sparse), <, empty + 1024);
+
+    hbitmap_reset_all(sparse);
+    g_assert_cmpuint(hbitmap_memory_usage(sparse), ==, empty);
+
+    hbitmap_free(dense);
+    hbitmap_free(sparse);
+}
+
+/*
+ * Memory use and speed of a bitmap for a 64 TiB disk at 64 KiB
+ * granularity, with one in @opaque 64 KiB clusters dirty at random
+ * (or none if @opaque is 0).
+ */
+static void perf_sparse(gconstpointer opaque)
+{
+    int density = GPOINTER_TO_INT(opaque);
+    uint64_t size = UINT64_C(64) << 40;
+    uint64_t clusters = size >> 16;
+    uint64_t nr_dirty = density ? clusters / density : 0;
+    int sparse;
+
+    for (sparse = 0; sparse < 2; sparse++) {
+        HBitmap *hb = sparse ? hbitmap_alloc_sparse(size, 16) :
+                               hbitmap_alloc(size, 16);
+        GRand *rand = g_rand_new_with_seed(0x1234);
+        double set_time, iter_time;
+        int64_t offset, count;
+        uint64_t i, found = 0;
+
+        g_test_timer_start();
+        for (i = 0; i < nr_dirty; i++) {
+            uint64_t cluster = ((uint64_t)g_rand_int(rand) << 32 |
+                                g_rand_int(rand)) % clusters;
+            hbitmap_set(hb, cluster << 16, 1 << 16);
+        }
+        set_time = g_test_timer_elapsed();
+
+        g_test_timer_start();
+        for (offset = 0;
+             hbitmap_next_dirty_area(hb, offset, size, INT64_MAX,
+                                     &offset, &count);
+             offset += count) {
+            found += count;
+        }
+        iter_time = g_test_timer_elapsed();
+
+        g_assert_cmpuint(found, ==, hbitmap_count(hb));
+        g_test_message("%s, 1/%d dirty: %" PRIu64 " KiB, set %f s, "
+                       "iterate %f s", sparse ? "sparse" : "dense", density,
+                       hbitmap_memory_usage(hb) >> 10, set_time, iter_time);
+
+        g_rand_free(rand);
+        hbitmap_free(hb);
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1245,18 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    hbitmap_test_add("/hbitmap/convert", test_hbitmap_sparse_convert);
+    g_test_add_func("/hbitmap/memory", test_hbitmap_sparse_memory);
+
+    if (g_test_perf()) {
+        g_test_add_data_func("/hbitmap/perf/empty", GINT_TO_POINTER(0),
+                             perf_sparse);
+        g_test_add_data_func("/hbitmap/perf/1-in-100000",
+                             GINT_TO_POINTER(100000), perf_sparse);
+        g_test_add_data_func("/hbitmap/perf/1-in-100",
+                             GINT_TO_POINTER(100), perf_sparse);
+    }
+
     g_test_run();
 
     return 0;
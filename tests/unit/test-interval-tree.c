@@ -0,0 +1,225 @@
+/*
+ * Interval tree tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+typedef struct TestRange {
+    IntervalTreeNode node;
+    bool inserted;
+    bool serialising;
+} TestRange;
+
+/* Check the AVL property and the subtree ends, return the height */
+static int check_subtree(IntervalTreeNode *node)
+{
+    int left, right;
+    uint64_t end = node ? node->end : 0;
+
+    if (!node) {
+        return 0;
+    }
+
+    left = check_subtree(node->left);
+    right = check_subtree(node->right);
+    g_assert_cmpint(ABS(left - right), <=, 1);
+    g_assert_cmpint(node->height, ==, 1 + MAX(left, right));
+
+    if (node->left) {
+        g_assert_cmpuint(node->left->start, <=, node->start);
+        end = MAX(end, node->left->subtree_end);
+    }
+    if (node->right) {
+        g_assert_cmpuint(node->right->start, >=, node->start);
+        end = MAX(end, node->right->subtree_end);
+    }
+    g_assert_cmpuint(node->subtree_end, ==, end);
+
+    return node->height;
+}
+
+static bool range_is_serialising(IntervalTreeNode *node, void *opaque)
+{
+    return container_of(node, TestRange, node)->serialising;
+}
+
+/* Reference implementation: the overlapping range with the lowest start */
+static TestRange *find_linear(TestRange *ranges, int n,
+                              uint64_t start, uint64_t end,
+                              bool only_serialising)
+{
+    TestRange *best = NULL;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        TestRange *r = &ranges[i];
+
+        if (!r->inserted || r->node.start >= end || start >= r->node.end) {
+            continue;
+        }
+        if (only_serialising && !r->serialising) {
+            continue;
+        }
+        if (!best || r->node.start < best->node.start ||
+            (r->node.start == best->node.start && r < best)) {
+            best = r;
+        }
+    }
+
+    return best;
+}
+
+static void test_interval_tree_empty(void)
+{
+    IntervalTreeRoot root = { NULL };
+
+    g_assert(interval_tree_is_empty(&root));
+    g_assert_null(interval_tree_find(&root, 0, UINT64_MAX, NULL, NULL));
+}
+
+static void test_interval_tree_overlap(void)
+{
+    IntervalTreeRoot root = { NULL };
+    TestRange a = { .node = { .start = 0, .end = 4096 } };
+    TestRange b = { .node = { .start = 4096, .end = 8192 } };
+    TestRange c = { .node = { .start = 1024, .end = 1024 } };
+
+    interval_tree_insert(&root, &a.node);
+    interval_tree_insert(&root, &b.node);
+    interval_tree_insert(&root, &c.node);
+
+    /* Ranges are half-open */
+    g_assert(interval_tree_find(&root, 4096, 4097, NULL, NULL) == &b.node);
+    g_assert(interval_tree_find(&root, 4095, 4096, NULL, NULL) == &a.node);
+    g_assert_null(interval_tree_find(&root, 8192, 9000, NULL, NULL));
+
+    /* An empty range only overlaps ranges that strictly contain it */
+    g_assert(interval_tree_find(&root, 1000, 2000, range_is_serialising,
+                                NULL) == NULL);
+    c.serialising = true;
+    g_assert(interval_tree_find(&root, 1000, 2000, range_is_serialising,
+                                NULL) == &c.node);
+    g_assert_null(interval_tree_find(&root, 1024, 2000, range_is_serialising,
+                                     NULL));
+
+    interval_tree_remove(&root, &a.node);
+    g_assert_null(interval_tree_find(&root, 0, 1024, NULL, NULL));
+    interval_tree_remove(&root, &b.node);
+    interval_tree_remove(&root, &c.node);
+    g_assert(interval_tree_is_empty(&root));
+}
+
+static void test_interval_tree_random(void)
+{
+    IntervalTreeRoot root = { NULL };
+    int n = 512;
+    TestRange *ranges = g_new0(TestRange, n);
+    GRand *rand = g_rand_new_with_seed(0x1234);
+    int i;
+
+    for (i = 0; i < 100000; i++) {
+        TestRange *r = &ranges[g_rand_int_range(rand, 0, n)];
+        uint64_t start = g_rand_int_range(rand, 0, 1 << 16);
+        uint64_t end = start + g_rand_int_range(rand, 0, 1 << 10);
+        bool only_serialising = g_rand_boolean(rand);
+        IntervalTreeNode *found;
+        TestRange *expected;
+
+        if (r->inserted) {
+            interval_tree_remove(&root, &r->node);
+            r->inserted = false;
+        } else {
+            r->node.start = g_rand_int_range(rand, 0, 1 << 16);
+            r->node.end = r->node.start + g_rand_int_range(rand, 0, 1 << 12);
+            r->serialising = g_rand_boolean(rand);
+            interval_tree_insert(&root, &r->node);
+            r->inserted = true;
+        }
+
+        if (i % 1000 == 0) {
+            check_subtree(root.root);
+        }
+
+        found = interval_tree_find(&root, start, end,
+                                   only_serialising ?
+                                   range_is_serialising : NULL, NULL);
+        expected = find_linear(ranges, n, start, end, only_serialising);
+        g_assert(found == (expected ? &expected->node : NULL));
+    }
+
+    g_rand_free(rand);
+    g_free(ranges);
+}
+
+/*
+ * Look up conflicting requests the way block/io.c does at a given queue
+ * depth: requests of 4k to 64k spread over a 1G disk, one in eight of
+ * them serialising, and every request looking for a conflict once.
+ */
+static void perf_conflict_lookup(gconstpointer opaque)
+{
+    int depth = GPOINTER_TO_INT(opaque);
+    IntervalTreeRoot root = { NULL };
+    TestRange *ranges = g_new0(TestRange, depth);
+    GRand *rand = g_rand_new_with_seed(0x5678);
+    unsigned long found = 0;
+    double tree_time, list_time;
+    int rounds = 1000;
+    int i, j;
+
+    for (i = 0; i < depth; i++) {
+        TestRange *r = &ranges[i];
+
+        r->node.start = (uint64_t)g_rand_int_range(rand, 0, 1 << 18) << 12;
+        r->node.end = r->node.start +
+                      ((uint64_t)g_rand_int_range(rand, 1, 17) << 12);
+        r->serialising = g_rand_int_range(rand, 0, 8) == 0;
+        r->inserted = true;
+        interval_tree_insert(&root, &r->node);
+    }
+
+    g_test_timer_start();
+    for (j = 0; j < rounds; j++) {
+        for (i = 0; i < depth; i++) {
+            found += !!interval_tree_find(&root, ranges[i].node.start,
+                                          ranges[i].node.end,
+                                          range_is_serialising, NULL);
+        }
+    }
+    tree_time = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (j = 0; j < rounds; j++) {
+        for (i = 0; i < depth; i++) {
+            found -= !!find_linear(ranges, depth, ranges[i].node.start,
+                                   ranges[i].node.end, true);
+        }
+    }
+    list_time = g_test_timer_elapsed();
+
+    g_assert_cmpuint(found, ==, 0);
+    g_test_message("Queue depth %d, %d lookups: tree %f s, list %f s",
+                   depth, depth * rounds, tree_time, list_time);
+
+    g_rand_free(rand);
+    g_free(ranges);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_interval_tree_empty);
+    g_test_add_func("/interval-tree/overlap", test_interval_tree_overlap);
+    g_test_add_func("/interval-tree/random", test_interval_tree_random);
+    if (g_test_perf()) {
+        g_test_add_data_func("/interval-tree/perf/depth-256",
+                             GINT_TO_POINTER(256), perf_conflict_lookup);
+        g_test_add_data_func("/interval-tree/perf/depth-1024",
+                             GINT_TO_POINTER(1024), perf_conflict_lookup);
+    }
+    return g_test_run();
+}
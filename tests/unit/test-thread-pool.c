@@ -232,6 +232,44 @@ static void test_cancel_async(void)
     do_test_cancel(false);
 }
 
+static int noop_cb(void *opaque)
+{
+    return 0;
+}
+
+static void count_done_cb(void *opaque, int ret)
+{
+    int *done = opaque;
+    (*done)++;
+}
+
+/*
+ * Submit @opaque requests at a time that do no work, so that the time spent
+ * is what the pool itself costs to hand requests to workers and complete
+ * them in the AioContext.
+ */
+static void perf_throughput(gconstpointer opaque)
+{
+    int depth = GPOINTER_TO_INT(opaque);
+    int total = 200000;
+    int submitted = 0;
+    int done = 0;
+    double duration;
+
+    g_test_timer_start();
+    while (done < total) {
+        while (submitted < total && submitted - done < depth) {
+            thread_pool_submit_aio(pool, noop_cb, NULL, count_done_cb, &done);
+            submitted++;
+        }
+        aio_poll(ctx, true);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Queue depth %d: %d requests in %f s, %.0f requests/s",
+                   depth, total, duration, total / duration);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_abort);
@@ -245,6 +283,12 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
+    if (g_test_perf()) {
+        g_test_add_data_func("/thread-pool/perf/depth-1",
+                             GINT_TO_POINTER(1), perf_throughput);
+        g_test_add_data_func("/thread-pool/perf/depth-64",
+                             GINT_TO_POINTER(64), perf_throughput);
+    }
 
     return g_test_run();
 }
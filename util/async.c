@@ -401,7 +401,9 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(ctx->linux_io_uring_sqpoll,
+                                      ctx->linux_io_uring_fixed_buffers,
+                                      errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -417,6 +419,24 @@ LuringState *aio_get_linux_io_uring(AioContext *ctx)
 }
 #endif
 
+void aio_context_set_io_uring_params(AioContext *ctx, bool sqpoll,
+                                     bool fixed_buffers, Error **errp)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->linux_io_uring) {
+        error_setg(errp, "io_uring parameters cannot be changed once "
+                   "io_uring is in use");
+        return;
+    }
+    ctx->linux_io_uring_sqpoll = sqpoll;
+    ctx->linux_io_uring_fixed_buffers = fixed_buffers;
+#else
+    if (sqpoll || fixed_buffers) {
+        error_setg(errp, "io_uring is not supported in this build");
+    }
+#endif
+}
+
 void aio_notify(AioContext *ctx)
 {
     /*
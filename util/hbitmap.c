@@ -50,8 +50,33 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * Each level is stored as an array of pages of HBITMAP_PAGE_WORDS words.
+ * A dense HBitmap allocates all of them upfront.  A sparse HBitmap only
+ * allocates the pages that contain both zero and one bits: pages that are
+ * entirely clear or entirely set point to a shared, read-only page instead,
+ * and are allocated when they are first modified.  Memory is then
+ * proportional to the number of pages with mixed contents rather than to
+ * the size of the bitmap.
  */
 
+/* 4 KiB pages on 64-bit hosts, 2 KiB on 32-bit hosts */
+#define HBITMAP_PAGE_SHIFT     9
+#define HBITMAP_PAGE_WORDS     (1 << HBITMAP_PAGE_SHIFT)
+
+static const unsigned long hbitmap_zero_page[HBITMAP_PAGE_WORDS];
+static const unsigned long hbitmap_ones_page[HBITMAP_PAGE_WORDS] = {
+    [0 ... HBITMAP_PAGE_WORDS - 1] = ~0UL
+};
+
+/* Bookkeeping for a page of a sparse HBitmap */
+typedef struct HBitmapPageInfo {
+    /* Number of words in the page that are not zero */
+    uint16_t nonzero;
+    /* Number of words in the page that have all bits set */
+    uint16_t full;
+} HBitmapPageInfo;
+
 struct HBitmap {
     /*
      * Size of the bitmap, as requested in hbitmap_alloc or in hbitmap_truncate.
@@ -87,6 +112,9 @@ struct HBitmap {
     /* A meta dirty bitmap to track the dirtiness of bits in this HBitmap. */
     HBitmap *meta;
 
+    /* Whether uniform pages share hbitmap_zero_page/hbitmap_ones_page. */
+    bool sparse;
+
     /* A number of progressively less coarse bitmaps (i.e. level 0 is the
      * coarsest).  Each bit in level N represents a word in level N+1 that
      * has a set bit, except the last level where each bit represents the
@@ -94,13 +122,144 @@ struct HBitmap {
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
      * bitmap will still allocate HBITMAP_LEVELS arrays.
+     *
+     * Each level is an array of pages; use hb_load() and hb_store() to
+     * access its words.
      */
-    unsigned long *levels[HBITMAP_LEVELS];
+    unsigned long **levels[HBITMAP_LEVELS];
 
-    /* The length of each levels[] array. */
+    /* The length of each level, in words. */
     uint64_t sizes[HBITMAP_LEVELS];
+
+    /* For sparse bitmaps, the contents of each page of each level. */
+    HBitmapPageInfo *pages[HBITMAP_LEVELS];
 };
 
+static inline uint64_t hb_num_pages(uint64_t words)
+{
+    return DIV_ROUND_UP(words, HBITMAP_PAGE_WORDS);
+}
+
+/* Number of words in page @page of a level that is @words words long */
+static inline size_t hb_page_words(uint64_t words, uint64_t page)
+{
+    return MIN(words - (page << HBITMAP_PAGE_SHIFT), HBITMAP_PAGE_WORDS);
+}
+
+static inline bool hb_page_is_shared(const unsigned long *page)
+{
+    return page == hbitmap_zero_page || page == hbitmap_ones_page;
+}
+
+static inline unsigned long hb_load(const HBitmap *hb, int level, uint64_t pos)
+{
+    return hb->levels[level][pos >> HBITMAP_PAGE_SHIFT]
+                            [pos & (HBITMAP_PAGE_WORDS - 1)];
+}
+
+/* Make @page of @level point to a shared page and drop its own memory */
+static void hb_share_page(HBitmap *hb, int level, uint64_t page,
+                          const unsigned long *shared)
+{
+    size_t words = hb_page_words(hb->sizes[level], page);
+
+    assert(hb->sparse);
+    if (!hb_page_is_shared(hb->levels[level][page])) {
+        g_free(hb->levels[level][page]);
+    }
+    hb->levels[level][page] = (unsigned long *)shared;
+    hb->pages[level][page] = (HBitmapPageInfo) {
+        .nonzero = shared == hbitmap_zero_page ? 0 : words,
+        .full = shared == hbitmap_zero_page ? 0 : words,
+    };
+}
+
+/* Give @page of @level its own memory, with the same contents */
+static void hb_unshare_page(HBitmap *hb, int level, uint64_t page)
+{
+    size_t words = hb_page_words(hb->sizes[level], page);
+    unsigned long *shared = hb->levels[level][page];
+
+    assert(hb_page_is_shared(shared));
+    hb->levels[level][page] = g_memdup(shared, words * sizeof(unsigned long));
+}
+
+static void hb_store(HBitmap *hb, int level, uint64_t pos, unsigned long val)
+{
+    uint64_t page = pos >> HBITMAP_PAGE_SHIFT;
+    size_t i = pos & (HBITMAP_PAGE_WORDS - 1);
+    HBitmapPageInfo *info;
+    size_t words;
+    unsigned long old;
+
+    if (!hb->sparse) {
+        hb->levels[level][page][i] = val;
+        return;
+    }
+
+    old = hb->levels[level][page][i];
+    if (old == val) {
+        return;
+    }
+    if (hb_page_is_shared(hb->levels[level][page])) {
+        hb_unshare_page(hb, level, page);
+    }
+    hb->levels[level][page][i] = val;
+
+    info = &hb->pages[level][page];
+    info->nonzero += !old - !val;
+    info->full += (val == ~0UL) - (old == ~0UL);
+
+    words = hb_page_words(hb->sizes[level], page);
+    if (info->nonzero == 0) {
+        hb_share_page(hb, level, page, hbitmap_zero_page);
+    } else if (info->full == words) {
+        hb_share_page(hb, level, page, hbitmap_ones_page);
+    }
+}
+
+/* Set all words of @page of @level to zero or, if @ones, to all ones */
+static void hb_fill_page(HBitmap *hb, int level, uint64_t page, bool ones)
+{
+    if (hb->sparse) {
+        hb_share_page(hb, level, page,
+                      ones ? hbitmap_ones_page : hbitmap_zero_page);
+    } else {
+        memset(hb->levels[level][page], ones ? 0xff : 0,
+               hb_page_words(hb->sizes[level], page) * sizeof(unsigned long));
+    }
+}
+
+/* Allocate pages [@start, @end) of @level, all zero */
+static void hb_alloc_pages(HBitmap *hb, int level, uint64_t start,
+                           uint64_t end)
+{
+    uint64_t page;
+
+    for (page = start; page < end; page++) {
+        if (hb->sparse) {
+            hb->levels[level][page] = (unsigned long *)hbitmap_zero_page;
+            hb->pages[level][page] = (HBitmapPageInfo) { 0 };
+        } else {
+            hb->levels[level][page] =
+                g_new0(unsigned long, hb_page_words(hb->sizes[level], page));
+        }
+    }
+}
+
+/* Free pages [@start, @end) of @level */
+static void hb_free_pages(HBitmap *hb, int level, uint64_t start,
+                          uint64_t end)
+{
+    uint64_t page;
+
+    for (page = start; page < end; page++) {
+        if (!hb_page_is_shared(hb->levels[level][page])) {
+            g_free(hb->levels[level][page]);
+        }
+    }
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -114,7 +273,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
     do {
         i--;
         pos >>= BITS_PER_LEVEL;
-        cur = hbi->cur[i] & hb->levels[i][pos];
+        cur = hbi->cur[i] & hb_load(hb, i, pos);
     } while (cur == 0);
 
     /* Check for end of iteration.  We always use fewer than BITS_PER_LONG
@@ -136,7 +295,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_load(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +308,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_load(hbi->hb, HBITMAP_LEVELS - 1, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +341,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_load(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -220,8 +379,7 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur = hb_load(hb, HBITMAP_LEVELS - 1, pos);
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -247,13 +405,14 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     if (cur == (unsigned long)-1) {
         do {
             pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        } while (pos < sz &&
+                 hb_load(hb, HBITMAP_LEVELS - 1, pos) == (unsigned long)-1);
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_load(hb, HBITMAP_LEVELS - 1, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -378,19 +537,24 @@ static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
 /* Setting starts at the last layer and propagates up if an element
  * changes.
  */
-static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t last)
+static inline bool hb_set_elem(HBitmap *hb, int level, uint64_t start,
+                               uint64_t last)
 {
+    uint64_t pos = start >> BITS_PER_LEVEL;
     unsigned long mask;
     unsigned long old;
 
-    assert((last >> BITS_PER_LEVEL) == (start >> BITS_PER_LEVEL));
+    assert((last >> BITS_PER_LEVEL) == pos);
     assert(start <= last);
 
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
-    old = *elem;
-    *elem |= mask;
-    return old != *elem;
+    old = hb_load(hb, level, pos);
+    if ((old | mask) == old) {
+        return false;
+    }
+    hb_store(hb, level, pos, old | mask);
+    return true;
 }
 
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
@@ -406,18 +570,18 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
+        changed |= hb_set_elem(hb, level, start, next - 1);
         for (;;) {
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+            changed |= (hb_load(hb, level, i) == 0);
+            hb_store(hb, level, i, ~0UL);
         }
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(hb, level, start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -456,19 +620,23 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
 /* Resetting works the other way round: propagate up if the new
  * value is zero.
  */
-static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t last)
+static inline bool hb_reset_elem(HBitmap *hb, int level, uint64_t start,
+                                 uint64_t last)
 {
+    uint64_t pos = start >> BITS_PER_LEVEL;
     unsigned long mask;
-    bool blanked;
+    unsigned long old;
 
-    assert((last >> BITS_PER_LEVEL) == (start >> BITS_PER_LEVEL));
+    assert((last >> BITS_PER_LEVEL) == pos);
     assert(start <= last);
 
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
-    blanked = *elem != 0 && ((*elem & ~mask) == 0);
-    *elem &= ~mask;
-    return blanked;
+    old = hb_load(hb, level, pos);
+    if (old & mask) {
+        hb_store(hb, level, pos, old & ~mask);
+    }
+    return old != 0 && ((old & ~mask) == 0);
 }
 
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
@@ -490,7 +658,7 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        if (hb_reset_elem(hb, level, start, next - 1)) {
             changed = true;
         } else {
             pos++;
@@ -502,13 +670,13 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+            changed |= (hb_load(hb, level, i) != 0);
+            hb_store(hb, level, i, 0UL);
         }
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    if (hb_reset_elem(hb, level, start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -554,12 +722,16 @@ void hbitmap_reset_all(HBitmap *hb)
 {
     unsigned int i;
 
-    /* Same as hbitmap_alloc() except for memset() instead of malloc() */
+    /* Same as hbitmap_alloc() except for clearing instead of allocating */
     for (i = HBITMAP_LEVELS; --i >= 1; ) {
-        memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
+        uint64_t page;
+
+        for (page = 0; page < hb_num_pages(hb->sizes[i]); page++) {
+            hb_fill_page(hb, i, page, false);
+        }
     }
 
-    hb->levels[0][0] = 1UL << (BITS_PER_LONG - 1);
+    hb_store(hb, 0, 0, 1UL << (BITS_PER_LONG - 1));
     hb->count = 0;
 }
 
@@ -588,7 +760,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_load(hb, HBITMAP_LEVELS - 1, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -600,12 +772,37 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
     return UINT64_C(64) << hb->granularity;
 }
 
+/*
+ * Set @count words of @level starting at @pos to zero or, if @ones, to all
+ * ones, filling whole pages at once where possible.
+ */
+static void hb_fill_words(HBitmap *hb, int level, uint64_t pos,
+                          uint64_t count, bool ones)
+{
+    uint64_t end = pos + count;
+
+    while (pos < end) {
+        uint64_t page = pos >> HBITMAP_PAGE_SHIFT;
+        uint64_t page_end = MIN((page + 1) << HBITMAP_PAGE_SHIFT,
+                                hb->sizes[level]);
+
+        if (!(pos & (HBITMAP_PAGE_WORDS - 1)) && page_end <= end) {
+            hb_fill_page(hb, level, page, ones);
+            pos = page_end;
+            continue;
+        }
+        for (; pos < MIN(page_end, end); pos++) {
+            hb_store(hb, level, pos, ones ? ~0UL : 0);
+        }
+    }
+}
+
 /* Start should be aligned to serialization granularity, chunk size should be
  * aligned to serialization granularity too, except for last chunk.
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -619,7 +816,7 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
@@ -627,7 +824,7 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t cur;
 
     if (!count) {
         return 0;
@@ -641,7 +838,7 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -650,8 +847,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_load(hb, HBITMAP_LEVELS - 1, cur);
+
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
 
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
@@ -664,7 +862,7 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -673,13 +871,16 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+        unsigned long el;
+
+        memcpy(&el, buf, sizeof(el));
 
         if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
+            le32_to_cpus((uint32_t *)&el);
         } else {
-            le64_to_cpus((uint64_t *)cur);
+            le64_to_cpus((uint64_t *)&el);
         }
+        hb_store(hb, HBITMAP_LEVELS - 1, cur, el);
 
         buf += sizeof(unsigned long);
         cur++;
@@ -693,14 +894,14 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, HBITMAP_LEVELS - 1, first, el_count, false);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -710,14 +911,14 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, HBITMAP_LEVELS - 1, first, el_count, true);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -734,17 +935,31 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     for (lev = HBITMAP_LEVELS - 1; lev-- > 0; ) {
         prev_size = size;
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
-        memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
+        hb_fill_words(bitmap, lev, 0, size, false);
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
-                bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
-                    1UL << (i & (BITS_PER_LONG - 1));
+            const unsigned long *page =
+                bitmap->levels[lev + 1][i >> HBITMAP_PAGE_SHIFT];
+
+            /* Skip clear pages, and set whole words for full ones */
+            if (page == hbitmap_zero_page) {
+                i |= HBITMAP_PAGE_WORDS - 1;
+            } else if (page == hbitmap_ones_page &&
+                       !(i & (BITS_PER_LONG - 1)) &&
+                       i + BITS_PER_LONG <= prev_size) {
+                hb_store(bitmap, lev, i >> BITS_PER_LEVEL, ~0UL);
+                i += BITS_PER_LONG - 1;
+            } else if (hb_load(bitmap, lev + 1, i)) {
+                uint64_t pos = i >> BITS_PER_LEVEL;
+
+                hb_store(bitmap, lev, pos, hb_load(bitmap, lev, pos) |
+                         1UL << (i & (BITS_PER_LONG - 1)));
             }
         }
     }
 
-    bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    hb_store(bitmap, 0, 0,
+             hb_load(bitmap, 0, 0) | 1UL << (BITS_PER_LONG - 1));
     bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
 }
 
@@ -753,12 +968,14 @@ void hbitmap_free(HBitmap *hb)
     unsigned i;
     assert(!hb->meta);
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
+        hb_free_pages(hb, i, 0, hb_num_pages(hb->sizes[i]));
         g_free(hb->levels[i]);
+        g_free(hb->pages[i]);
     }
     g_free(hb);
 }
 
-HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+static HBitmap *hbitmap_do_alloc(uint64_t size, int granularity, bool sparse)
 {
     HBitmap *hb = g_new0(struct HBitmap, 1);
     unsigned i;
@@ -772,10 +989,18 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
 
     hb->size = size;
     hb->granularity = granularity;
+    hb->sparse = sparse;
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
+        uint64_t pages;
+
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        pages = hb_num_pages(size);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        hb->levels[i] = g_new(unsigned long *, pages);
+        if (sparse) {
+            hb->pages[i] = g_new(HBitmapPageInfo, pages);
+        }
+        hb_alloc_pages(hb, i, 0, pages);
     }
 
     /* We necessarily have free bits in level 0 due to the definition
@@ -783,10 +1008,101 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
      * hbitmap_iter_skip_words.
      */
     assert(size == 1);
-    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    hb_store(hb, 0, 0, 1UL << (BITS_PER_LONG - 1));
     return hb;
 }
 
+HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+{
+    return hbitmap_do_alloc(size, granularity, false);
+}
+
+HBitmap *hbitmap_alloc_sparse(uint64_t size, int granularity)
+{
+    return hbitmap_do_alloc(size, granularity, true);
+}
+
+bool hbitmap_is_sparse(const HBitmap *hb)
+{
+    return hb->sparse;
+}
+
+void hbitmap_set_sparse(HBitmap *hb, bool sparse)
+{
+    unsigned i;
+    uint64_t page, pages;
+    size_t j, words;
+
+    if (hb->sparse == sparse) {
+        return;
+    }
+
+    for (i = 0; i < HBITMAP_LEVELS; i++) {
+        pages = hb_num_pages(hb->sizes[i]);
+        if (!sparse) {
+            for (page = 0; page < pages; page++) {
+                if (hb_page_is_shared(hb->levels[i][page])) {
+                    hb_unshare_page(hb, i, page);
+                }
+            }
+            g_free(hb->pages[i]);
+            hb->pages[i] = NULL;
+            continue;
+        }
+
+        hb->pages[i] = g_new0(HBitmapPageInfo, pages);
+        for (page = 0; page < pages; page++) {
+            HBitmapPageInfo *info = &hb->pages[i][page];
+            unsigned long *p = hb->levels[i][page];
+
+            words = hb_page_words(hb->sizes[i], page);
+            for (j = 0; j < words; j++) {
+                info->nonzero += p[j] != 0;
+                info->full += p[j] == ~0UL;
+            }
+        }
+    }
+
+    hb->sparse = sparse;
+    if (sparse) {
+        for (i = 0; i < HBITMAP_LEVELS; i++) {
+            pages = hb_num_pages(hb->sizes[i]);
+            for (page = 0; page < pages; page++) {
+                HBitmapPageInfo *info = &hb->pages[i][page];
+
+                words = hb_page_words(hb->sizes[i], page);
+                if (info->nonzero == 0) {
+                    hb_share_page(hb, i, page, hbitmap_zero_page);
+                } else if (info->full == words) {
+                    hb_share_page(hb, i, page, hbitmap_ones_page);
+                }
+            }
+        }
+    }
+}
+
+uint64_t hbitmap_memory_usage(const HBitmap *hb)
+{
+    uint64_t bytes = sizeof(*hb);
+    uint64_t page, pages;
+    unsigned i;
+
+    for (i = 0; i < HBITMAP_LEVELS; i++) {
+        pages = hb_num_pages(hb->sizes[i]);
+        bytes += pages * sizeof(unsigned long *);
+        if (hb->sparse) {
+            bytes += pages * sizeof(HBitmapPageInfo);
+        }
+        for (page = 0; page < pages; page++) {
+            if (!hb_page_is_shared(hb->levels[i][page])) {
+                bytes += hb_page_words(hb->sizes[i], page) *
+                         sizeof(unsigned long);
+            }
+        }
+    }
+    return bytes;
+}
+
 void hbitmap_truncate(HBitmap *hb, uint64_t size)
 {
     bool shrink;
@@ -823,17 +1139,43 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
 
     hb->size = size;
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
+        uint64_t old_pages, pages, last;
+
         size = MAX(BITS_TO_LONGS(size), 1);
         if (hb->sizes[i] == size) {
             break;
         }
         old = hb->sizes[i];
-        hb->sizes[i] = size;
-        hb->levels[i] = g_realloc(hb->levels[i], size * sizeof(unsigned long));
-        if (!shrink) {
-            memset(&hb->levels[i][old], 0x00,
-                   (size - old) * sizeof(*hb->levels[i]));
+        old_pages = hb_num_pages(old);
+        pages = hb_num_pages(size);
+
+        /*
+         * Resize the page that becomes, or stops being, the last one.
+         * When shrinking, the words that are cut off are already clear.
+         */
+        last = MIN(old_pages, pages) - 1;
+        if (hb->sparse && hb->levels[i][last] == hbitmap_ones_page) {
+            hb_unshare_page(hb, i, last);
+        }
+        if (!hb_page_is_shared(hb->levels[i][last])) {
+            size_t old_words = hb_page_words(old, last);
+            size_t words = hb_page_words(size, last);
+
+            hb->levels[i][last] = g_renew(unsigned long, hb->levels[i][last],
+                                          words);
+            if (words > old_words) {
+                memset(&hb->levels[i][last][old_words], 0,
+                       (words - old_words) * sizeof(unsigned long));
+            }
+        }
+
+        hb_free_pages(hb, i, pages, old_pages);
+        hb->levels[i] = g_renew(unsigned long *, hb->levels[i], pages);
+        if (hb->sparse) {
+            hb->pages[i] = g_renew(HBitmapPageInfo, hb->pages[i], pages);
         }
+        hb->sizes[i] = size;
+        hb_alloc_pages(hb, i, old_pages, pages);
     }
     if (hb->meta) {
         hbitmap_truncate(hb->meta, hb->size << hb->granularity);
@@ -908,11 +1250,28 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
     /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
      * It may be possible to improve running times for sparsely populated maps
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+     * Pages that are uniform in sparse bitmaps are handled at once though.
      */
     assert(a->size == b->size);
     for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
+        uint64_t page;
+
+        for (page = 0; page < hb_num_pages(a->sizes[i]); page++) {
+            const unsigned long *pa = a->levels[i][page];
+            const unsigned long *pb = b->levels[i][page];
+            uint64_t end = MIN((page + 1) << HBITMAP_PAGE_SHIFT, a->sizes[i]);
+
+            if (pa == hbitmap_ones_page || pb == hbitmap_ones_page) {
+                hb_fill_page(result, i, page, true);
+                continue;
+            }
+            if (pa == hbitmap_zero_page && pb == hbitmap_zero_page) {
+                hb_fill_page(result, i, page, false);
+                continue;
+            }
+            for (j = page << HBITMAP_PAGE_SHIFT; j < end; j++) {
+                hb_store(result, i, j, hb_load(a, i, j) | hb_load(b, i, j));
+            }
         }
     }
 
@@ -924,10 +1283,18 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
-    size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    uint64_t words = bitmap->sizes[HBITMAP_LEVELS - 1];
+    uint64_t page, pages = hb_num_pages(words);
+    struct iovec *iov = g_new(struct iovec, pages);
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+
+    /* Hash the pages in order, as if the level was a single array */
+    for (page = 0; page < pages; page++) {
+        iov[page].iov_base = bitmap->levels[HBITMAP_LEVELS - 1][page];
+        iov[page].iov_len = hb_page_words(words, page) * sizeof(unsigned long);
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, pages, &hash, errp);
+    g_free(iov);
 
     return hash;
 }
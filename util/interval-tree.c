@@ -0,0 +1,190 @@
+/*
+ * Interval tree of possibly overlapping ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+static inline int node_height(IntervalTreeNode *node)
+{
+    return node ? node->height : 0;
+}
+
+/* Recompute the height and subtree end of @node from its children */
+static void node_update(IntervalTreeNode *node)
+{
+    node->height = 1 + MAX(node_height(node->left),
+                           node_height(node->right));
+    node->subtree_end = node->end;
+    if (node->left) {
+        node->subtree_end = MAX(node->subtree_end, node->left->subtree_end);
+    }
+    if (node->right) {
+        node->subtree_end = MAX(node->subtree_end, node->right->subtree_end);
+    }
+}
+
+/* Order by start, and by address between nodes with the same start */
+static int node_compare(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    if (a->start != b->start) {
+        return a->start < b->start ? -1 : 1;
+    }
+    if (a == b) {
+        return 0;
+    }
+    return (uintptr_t)a < (uintptr_t)b ? -1 : 1;
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeNode *node)
+{
+    IntervalTreeNode *left = node->left;
+
+    node->left = left->right;
+    left->right = node;
+    node_update(node);
+    node_update(left);
+    return left;
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeNode *node)
+{
+    IntervalTreeNode *right = node->right;
+
+    node->right = right->left;
+    right->left = node;
+    node_update(node);
+    node_update(right);
+    return right;
+}
+
+/* Restore the AVL property at @node, returning the new subtree root */
+static IntervalTreeNode *rebalance(IntervalTreeNode *node)
+{
+    int balance = node_height(node->left) - node_height(node->right);
+
+    if (balance > 1) {
+        if (node_height(node->left->left) < node_height(node->left->right)) {
+            node->left = rotate_left(node->left);
+        }
+        return rotate_right(node);
+    }
+    if (balance < -1) {
+        if (node_height(node->right->right) < node_height(node->right->left)) {
+            node->right = rotate_right(node->right);
+        }
+        return rotate_left(node);
+    }
+
+    node_update(node);
+    return node;
+}
+
+static IntervalTreeNode *insert_node(IntervalTreeNode *subtree,
+                                     IntervalTreeNode *node)
+{
+    if (!subtree) {
+        return node;
+    }
+
+    if (node_compare(node, subtree) < 0) {
+        subtree->left = insert_node(subtree->left, node);
+    } else {
+        subtree->right = insert_node(subtree->right, node);
+    }
+    return rebalance(subtree);
+}
+
+static IntervalTreeNode *remove_min_node(IntervalTreeNode *subtree,
+                                         IntervalTreeNode **min)
+{
+    if (!subtree->left) {
+        *min = subtree;
+        return subtree->right;
+    }
+
+    subtree->left = remove_min_node(subtree->left, min);
+    return rebalance(subtree);
+}
+
+static IntervalTreeNode *remove_node(IntervalTreeNode *subtree,
+                                     IntervalTreeNode *node)
+{
+    int cmp;
+
+    assert(subtree);
+    cmp = node_compare(node, subtree);
+    if (cmp < 0) {
+        subtree->left = remove_node(subtree->left, node);
+    } else if (cmp > 0) {
+        subtree->right = remove_node(subtree->right, node);
+    } else {
+        IntervalTreeNode *min;
+
+        if (!node->right) {
+            return node->left;
+        }
+        /* Replace the node with its successor */
+        min = NULL;
+        subtree = remove_min_node(node->right, &min);
+        min->right = subtree;
+        min->left = node->left;
+        subtree = min;
+    }
+    return rebalance(subtree);
+}
+
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    assert(node->start <= node->end);
+
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    node->subtree_end = node->end;
+    root->root = insert_node(root->root, node);
+}
+
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    root->root = remove_node(root->root, node);
+}
+
+static IntervalTreeNode *find_node(IntervalTreeNode *node,
+                                   uint64_t start, uint64_t end,
+                                   IntervalTreeMatchFunc *match, void *opaque)
+{
+    IntervalTreeNode *found;
+
+    /* Nothing in this subtree ends after @start */
+    if (!node || node->subtree_end <= start) {
+        return NULL;
+    }
+
+    found = find_node(node->left, start, end, match, opaque);
+    if (found) {
+        return found;
+    }
+
+    /* This node and everything to its right starts at or after @end */
+    if (node->start >= end) {
+        return NULL;
+    }
+
+    if (start < node->end && (!match || match(node, opaque))) {
+        return node;
+    }
+
+    return find_node(node->right, start, end, match, opaque);
+}
+
+IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root,
+                                     uint64_t start, uint64_t end,
+                                     IntervalTreeMatchFunc *match,
+                                     void *opaque)
+{
+    return find_node(root->root, start, end, match, opaque);
+}
@@ -48,6 +48,9 @@ struct ThreadPoolElement {
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Entry in the pool's completed list, see thread_pool_push_completed() */
+    QSLIST_ENTRY(ThreadPoolElement) completed;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
@@ -63,6 +66,13 @@ struct ThreadPool {
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSLIST_HEAD(, ThreadPoolElement) completed_local;
+
+    /*
+     * Requests that are done, pushed atomically by the worker threads and
+     * moved to completed_local by the completion bottom half.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) completed;
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
@@ -73,6 +83,27 @@ struct ThreadPool {
     bool stopping;
 };
 
+/*
+ * Hand a request that is done over to the completion bottom half.  The bottom
+ * half is only scheduled if @elem is the first entry in the completed list,
+ * so that requests which are done at about the same time are completed by
+ * a single run of the bottom half.
+ */
+static void thread_pool_push_completed(ThreadPool *pool,
+                                       ThreadPoolElement *elem)
+{
+    ThreadPoolElement *next;
+
+    do {
+        next = qatomic_read(&pool->completed.slh_first);
+        elem->completed.sle_next = next;
+    } while (qatomic_cmpxchg(&pool->completed.slh_first, next, elem) != next);
+
+    if (!next) {
+        qemu_bh_schedule(pool->completion_bh);
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -107,10 +138,9 @@ static void *worker_thread(void *opaque)
         /* Write ret before state.  */
         smp_wmb();
         req->state = THREAD_DONE;
+        thread_pool_push_completed(pool, req);
 
         qemu_mutex_lock(&pool->lock);
-
-        qemu_bh_schedule(pool->completion_bh);
     }
 
     pool->cur_threads--;
@@ -162,15 +192,21 @@ static void spawn_thread(ThreadPool *pool)
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
+    ThreadPoolElement *elem;
 
     aio_context_acquire(pool->ctx);
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
+    for (;;) {
+        if (QSLIST_EMPTY(&pool->completed_local)) {
+            QSLIST_MOVE_ATOMIC(&pool->completed_local, &pool->completed);
+            if (QSLIST_EMPTY(&pool->completed_local)) {
+                break;
+            }
         }
 
+        elem = QSLIST_FIRST(&pool->completed_local);
+        QSLIST_REMOVE_HEAD(&pool->completed_local, completed);
+        assert(elem->state == THREAD_DONE);
+
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
         QLIST_REMOVE(elem, all);
@@ -181,24 +217,17 @@ restart:
 
             /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
              * wait for another request that completed at the same time.
+             * Requests that are pushed later schedule us anyway.
              */
-            qemu_bh_schedule(pool->completion_bh);
+            if (!QSLIST_EMPTY(&pool->completed_local)) {
+                qemu_bh_schedule(pool->completion_bh);
+            }
 
             aio_context_release(pool->ctx);
             elem->common.cb(elem->common.opaque, elem->ret);
             aio_context_acquire(pool->ctx);
-
-            /* We can safely cancel the completion_bh here regardless of someone
-             * else having scheduled it meanwhile because we reenter the
-             * completion function anyway (goto restart).
-             */
-            qemu_bh_cancel(pool->completion_bh);
-
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
     aio_context_release(pool->ctx);
 }
@@ -219,10 +248,10 @@ static void thread_pool_cancel(BlockAIOCB *acb)
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        thread_pool_push_completed(pool, elem);
     }
 
 }
@@ -310,6 +339,8 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
+    QSLIST_INIT(&pool->completed_local);
+    QSLIST_INIT(&pool->completed);
     QTAILQ_INIT(&pool->request_list);
 }
 
@@ -26,7 +26,10 @@
  * protocol messages over the UNIX domain socket.
  *
  * When virtqueues are set up libvhost-user calls set_watch() to monitor kick
- * fds. These fds are also handled in the VuServer->ctx AioContext.
+ * fds. These fds are also handled in the VuServer->ctx AioContext. When the
+ * AioContext polls (e.g. an IOThread with poll-max-ns > 0), the virtqueues are
+ * polled for new requests as well, and the driver is asked not to kick while
+ * polling is active.
  *
  * Both vu_client_trip() and kick fd monitoring can be stopped by shutting down
  * the socket connection. Shutting down the socket connection causes
@@ -217,6 +220,71 @@ static void kick_handler(void *opaque)
     }
 }
 
+/* Return the virtqueue whose kick fd @vu_fd_watch monitors, or NULL */
+static VuVirtq *vu_fd_watch_get_vq(VuFdWatch *vu_fd_watch)
+{
+    VuDev *vu_dev = vu_fd_watch->vu_dev;
+    intptr_t index = (intptr_t)vu_fd_watch->pvt;
+
+    if (index < 0 || index >= vu_dev->max_queues ||
+        vu_dev->vq[index].kick_fd != vu_fd_watch->fd) {
+        return NULL;
+    }
+
+    return &vu_dev->vq[index];
+}
+
+static bool kick_poll_handler(void *opaque)
+{
+    VuFdWatch *vu_fd_watch = opaque;
+    VuDev *vu_dev = vu_fd_watch->vu_dev;
+    VuVirtq *vq = vu_fd_watch_get_vq(vu_fd_watch);
+
+    if (!vq || vu_dev->broken || !vq->handler ||
+        !vu_queue_started(vu_dev, vq) || vu_queue_empty(vu_dev, vq)) {
+        return false;
+    }
+
+    vq->handler(vu_dev, vq - vu_dev->vq);
+
+    if (vu_dev->broken) {
+        VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+
+        qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    }
+    return true;
+}
+
+static void kick_poll_set_notification(VuFdWatch *vu_fd_watch, int enable)
+{
+    VuDev *vu_dev = vu_fd_watch->vu_dev;
+    VuVirtq *vq = vu_fd_watch_get_vq(vu_fd_watch);
+
+    if (vq && !vu_dev->broken && vu_queue_started(vu_dev, vq) &&
+        vq->vring.avail && vq->vring.used) {
+        vu_queue_set_notification(vu_dev, vq, enable);
+    }
+}
+
+/* No kicks needed while the virtqueue is being polled */
+static void kick_poll_begin(void *opaque)
+{
+    kick_poll_set_notification(opaque, 0);
+}
+
+/* The AioContext polls one last time after this, so no request is missed */
+static void kick_poll_end(void *opaque)
+{
+    kick_poll_set_notification(opaque, 1);
+}
+
+static void set_kick_fd_handler(AioContext *ctx, VuFdWatch *vu_fd_watch)
+{
+    aio_set_fd_handler(ctx, vu_fd_watch->fd, true, kick_handler, NULL,
+                       kick_poll_handler, vu_fd_watch);
+    aio_set_fd_poll(ctx, vu_fd_watch->fd, kick_poll_begin, kick_poll_end);
+}
+
 static VuFdWatch *find_vu_fd_watch(VuServer *server, int fd)
 {
 
@@ -249,10 +317,9 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
         qemu_set_nonblock(fd);
-        aio_set_fd_handler(server->ioc->ctx, fd, true, kick_handler,
-                           NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+        set_kick_fd_handler(server->ioc->ctx, vu_fd_watch);
     }
 }
 
@@ -376,8 +443,7 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
     qio_channel_attach_aio_context(server->ioc, ctx);
 
     QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, true, kick_handler, NULL,
-                           NULL, vu_fd_watch);
+        set_kick_fd_handler(ctx, vu_fd_watch);
     }
 
     aio_co_schedule(ctx, server->co_trip);